@@ -1,6 +1,7 @@
 import torch
 import json
 
+from pynanoflare.binary import export_binary
 from pynanoflare.modules import Biquad, PlainSequential, CausalDilatedConv1d, ResidualBlock, TCNBlock, MicroTCNBlock, FiLM
 from pynanoflare.rnn import ResGRU, ResLSTM
 from pynanoflare.tcn import TCN, MicroTCN
@@ -44,7 +45,9 @@ if __name__ == "__main__":
         doc = model.generate_doc()
         with open(f'tests/data/{model_name}.json', 'w') as file:
             json.dump(doc, file)
+        export_binary(doc, f'tests/data/{model_name}.nfbm')
         script_module = torch.jit.script(model)
         script_module.save(f'tests/data/{model_name}.torchscript')
         print(f"  ✓ {model_name}.json")
+        print(f"  ✓ {model_name}.nfbm")
         print(f"  ✓ {model_name}.torchscript")
\ No newline at end of file
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <Eigen/Dense>
+
+namespace Nanoflare
+{
+    // Precision of tanh and sigmoid. Maximum absolute error against std::tanh and 1 / (1 + exp(-x)):
+    //  - Exact:      Eigen's tanh() and logistic(), 4e-7
+    //  - Rational:   [7/6] Pade approximant of tanh with the input clamped to +-4.79, 1e-4
+    //  - Polynomial: minimax polynomials on [0, 1] and [1, 5], no division, 1e-4
+    // The fast modes compute sigmoid(x) as 0.5 + 0.5 * tanh(0.5 * x), which halves their error.
+    // They trade accuracy for throughput in the recurrent cells and the WaveNet gate, see
+    // BaseModel::setActivationPrecision().
+    enum class ActivationPrecision { Exact, Rational, Polynomial };
+
+    // tanh and sigmoid of array expressions as expressions of their own, so that they fuse
+    // with the surrounding arithmetic. Fast modes are vectorised with Eigen's packet math.
+    class Activations
+    {
+    public:
+        template<ActivationPrecision P, typename Derived>
+        static inline auto tanh( const Eigen::ArrayBase<Derived>& x ) noexcept
+        {
+            if constexpr (P == ActivationPrecision::Exact)
+                return x.tanh();
+            else
+                return x.unaryExpr( TanhOp<P>() );
+        }
+
+        template<ActivationPrecision P, typename Derived>
+        static inline auto sigmoid( const Eigen::ArrayBase<Derived>& x ) noexcept
+        {
+            if constexpr (P == ActivationPrecision::Exact)
+                return x.logistic();
+            else
+                return x.unaryExpr( SigmoidOp<P>() );
+        }
+
+        template<ActivationPrecision P>
+        struct TanhOp
+        {
+            template<typename Packet>
+            static inline Packet eval( const Packet& x ) noexcept
+            {
+                using namespace Eigen::internal;
+                if constexpr (P == ActivationPrecision::Rational)
+                {
+                    // Beyond 4.97 the approximant exceeds 1, clamping a little earlier balances the error
+                    const Packet v = pmax( pmin( x, pset1<Packet>(4.79f) ), pset1<Packet>(-4.79f) );
+                    const Packet v2 = pmul( v, v );
+                    const Packet num = pmadd( pmadd( padd( v2, pset1<Packet>(378.f) ), v2, pset1<Packet>(17325.f) ), v2, pset1<Packet>(135135.f) );
+                    const Packet den = pmadd( pmadd( pmadd( pset1<Packet>(28.f), v2, pset1<Packet>(3150.f) ), v2, pset1<Packet>(62370.f) ), v2, pset1<Packet>(135135.f) );
+                    return pdiv( pmul( v, num ), den );
+                }
+                else
+                {
+                    // Both pieces are evaluated on |x| and the sign copied back, the high
+                    // piece was fitted with its input clamped to 5 so that it also covers |x| > 5
+                    const Packet a = pmin( pabs( x ), pset1<Packet>(5.f) );
+                    const Packet a2 = pmul( a, a );
+                    Packet low = pset1<Packet>(-0.0246540631f);
+                    low = pmadd( low, a2, pset1<Packet>(0.115413769f) );
+                    low = pmadd( low, a2, pset1<Packet>(-0.328891994f) );
+                    low = pmul( pmadd( low, a2, pset1<Packet>(0.999693766f) ), a );
+                    Packet high = pset1<Packet>(-0.000328293927f);
+                    high = pmadd( high, a, pset1<Packet>(0.007534065f) );
+                    high = pmadd( high, a, pset1<Packet>(-0.0721363153f) );
+                    high = pmadd( high, a, pset1<Packet>(0.37071636f) );
+                    high = pmadd( high, a, pset1<Packet>(-1.08593715f) );
+                    high = pmadd( high, a, pset1<Packet>(1.73447331f) );
+                    high = pmadd( high, a, pset1<Packet>(-0.192723064f) );
+                    const Packet r = pselect( pcmp_lt( a, pset1<Packet>(1.f) ), low, high );
+                    return por( r, pand( x, pset1<Packet>(-0.f) ) );
+                }
+            }
+
+            inline float operator()( const float& x ) const noexcept { return eval( x ); }
+            template<typename Packet>
+            inline Packet packetOp( const Packet& x ) const noexcept { return eval( x ); }
+        };
+
+        template<ActivationPrecision P>
+        struct SigmoidOp
+        {
+            template<typename Packet>
+            static inline Packet eval( const Packet& x ) noexcept
+            {
+                using namespace Eigen::internal;
+                const Packet half = pset1<Packet>(0.5f);
+                return pmadd( TanhOp<P>::eval( pmul( x, half ) ), half, half );
+            }
+
+            inline float operator()( const float& x ) const noexcept { return eval( x ); }
+            template<typename Packet>
+            inline Packet packetOp( const Packet& x ) const noexcept { return eval( x ); }
+        };
+    };
+}
+
+namespace Eigen
+{
+    namespace internal
+    {
+        template<Nanoflare::ActivationPrecision P>
+        struct functor_traits<Nanoflare::Activations::TanhOp<P>> { enum { Cost = 20 * NumTraits<float>::MulCost, PacketAccess = true }; };
+
+        template<Nanoflare::ActivationPrecision P>
+        struct functor_traits<Nanoflare::Activations::SigmoidOp<P>> { enum { Cost = 22 * NumTraits<float>::MulCost, PacketAccess = true }; };
+    }
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <Eigen/Dense>
+#include <cassert>
+#include "nanoflare/utils.h"
+
+namespace Nanoflare
+{
+    // Scalar affine maps folded into the weights w (out, in) and bias b of a layer, see
+    // BaseModel::setNormMean(). The input map x * scale + shift becomes w * scale and
+    // b + shift * w 1, the output map y * scale + shift w * scale and b * scale + shift.
+    // The weights the maps are folded into are kept aside, every fold starts again from them.
+    class AffineFold
+    {
+    public:
+        void setInput(float scale, float shift) { assert(scale != 0.f); m_inputScale = scale; m_inputShift = shift; }
+        void setOutput(float scale, float shift) { m_outputScale = scale; m_outputShift = shift; }
+
+        bool isIdentity() const noexcept
+        {
+            return m_inputScale == 1.f && m_inputShift == 0.f && m_outputScale == 1.f && m_outputShift == 0.f;
+        }
+
+        // Input the input map takes to 0, that causal layers pad their past with
+        float getInputZero() const noexcept { return -m_inputShift / m_inputScale; }
+
+        // Folds the maps into w and b, keeping the ones given aside. w may be a transposed expression.
+        template<typename W, typename B>
+        void apply(W&& w, B&& b)
+        {
+            assert(m_w.size() == 0 && "AffineFold.apply: Weights already folded");
+            if (isIdentity())
+                return;
+            m_w = w;
+            m_b = Eigen::Map<const Eigen::VectorXf>(b.data(), b.size());
+            Eigen::Map<Eigen::VectorXf>(b.data(), b.size()) =
+                ((m_b + m_inputShift * m_w.rowwise().sum()) * m_outputScale).array() + m_outputShift;
+            w = m_w * (m_inputScale * m_outputScale);
+        }
+
+        // Back to the weights given to apply(), to edit them before folding again
+        template<typename W, typename B>
+        void restore(W&& w, B&& b)
+        {
+            if (m_w.size() == 0)
+                return;
+            w = m_w;
+            Eigen::Map<Eigen::VectorXf>(b.data(), b.size()) = m_b;
+            m_w.resize(0, 0);
+            m_b.resize(0);
+        }
+
+        // Bytes kept aside
+        size_t getSize() const { return (m_w.size() + m_b.size()) * sizeof(float); }
+
+    private:
+        float m_inputScale = 1.f, m_inputShift = 0.f;
+        float m_outputScale = 1.f, m_outputShift = 0.f;
+        RowMatrixXf m_w;      // (out, in), empty while nothing is folded
+        Eigen::VectorXf m_b;
+    };
+}
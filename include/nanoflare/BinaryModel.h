@@ -0,0 +1,177 @@
+#pragma once
+
+#include <nlohmann/json.hpp>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include "nanoflare/utils.h"
+
+#if defined(_WIN32)
+    #ifndef NOMINMAX
+        #define NOMINMAX
+    #endif
+    #include <windows.h>
+#else
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+#endif
+
+namespace Nanoflare
+{
+    // Binary model container (little-endian), as written by pynanoflare/binary.py:
+    //
+    //   [Header][JSON document][tensor blob]
+    //
+    // The JSON document is the usual model document except that every tensor
+    // {"shape", "values"} is replaced by {"shape", "offset"}, the offset being
+    // the position in bytes of its float32 values inside the blob. Both the JSON
+    // document and every tensor start on a BinaryModelAlignment boundary.
+    constexpr char BinaryModelMagic[4] = { 'N', 'F', 'B', 'M' };
+    constexpr uint32_t BinaryModelVersion = 1;
+    constexpr size_t BinaryModelAlignment = 64;
+
+    struct BinaryModelHeader
+    {
+        char magic[4];
+        uint32_t version;
+        uint64_t json_offset, json_size;
+        uint64_t blob_offset, blob_size;
+    };
+    static_assert(sizeof(BinaryModelHeader) == 40, "BinaryModelHeader must be packed");
+
+    // Read-only memory mapping of a whole file
+    class MappedFile
+    {
+    public:
+        explicit MappedFile(const std::string& path)
+        {
+#if defined(_WIN32)
+            m_file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+            if (m_file == INVALID_HANDLE_VALUE)
+                throw std::runtime_error("MappedFile: cannot open " + path);
+            LARGE_INTEGER size;
+            GetFileSizeEx(m_file, &size);
+            m_size = static_cast<size_t>(size.QuadPart);
+            if (m_size > 0)
+            {
+                m_mapping = CreateFileMappingA(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+                if (m_mapping != nullptr)
+                    m_data = static_cast<const unsigned char*>(MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0));
+            }
+#else
+            m_fd = ::open(path.c_str(), O_RDONLY);
+            if (m_fd < 0)
+                throw std::runtime_error("MappedFile: cannot open " + path);
+            struct stat st;
+            ::fstat(m_fd, &st);
+            m_size = static_cast<size_t>(st.st_size);
+            if (m_size > 0)
+            {
+                void* ptr = ::mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, m_fd, 0);
+                if (ptr != MAP_FAILED)
+                    m_data = static_cast<const unsigned char*>(ptr);
+            }
+#endif
+            if (m_data == nullptr)
+            {
+                close();
+                throw std::runtime_error("MappedFile: cannot map " + path);
+            }
+        }
+        ~MappedFile() { close(); }
+
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+
+        const unsigned char* data() const { return m_data; }
+        size_t size() const { return m_size; }
+
+    private:
+        void close()
+        {
+#if defined(_WIN32)
+            if (m_data != nullptr)
+                UnmapViewOfFile(m_data);
+            if (m_mapping != nullptr)
+                CloseHandle(m_mapping);
+            if (m_file != INVALID_HANDLE_VALUE)
+                CloseHandle(m_file);
+            m_mapping = nullptr;
+            m_file = INVALID_HANDLE_VALUE;
+#else
+            if (m_data != nullptr)
+                ::munmap(const_cast<unsigned char*>(m_data), m_size);
+            if (m_fd >= 0)
+                ::close(m_fd);
+            m_fd = -1;
+#endif
+            m_data = nullptr;
+        }
+
+#if defined(_WIN32)
+        HANDLE m_file = INVALID_HANDLE_VALUE, m_mapping = nullptr;
+#else
+        int m_fd = -1;
+#endif
+        const unsigned char* m_data = nullptr;
+        size_t m_size = 0;
+    };
+
+    // Memory-mapped binary model. Tensor values are read straight from the
+    // mapping while a model is built from it (see ModelBuilder::buildModel).
+    class BinaryModel
+    {
+    public:
+        explicit BinaryModel(const std::string& path) : m_file(std::make_unique<MappedFile>(path))
+        {
+            parse( m_file->data(), m_file->size() );
+        }
+
+        // View over a binary model already in memory, which must outlive this object
+        BinaryModel(const unsigned char* data, size_t size)
+        {
+            parse( data, size );
+        }
+        ~BinaryModel() = default;
+
+        static bool isBinary(const unsigned char* data, size_t size)
+        {
+            return size >= sizeof(BinaryModelHeader) && std::memcmp(data, BinaryModelMagic, sizeof(BinaryModelMagic)) == 0;
+        }
+
+        const nlohmann::json& getDoc() const { return m_doc; }
+        const TensorBlob& getBlob() const { return m_blob; }
+
+    private:
+        void parse(const unsigned char* data, size_t size)
+        {
+            if (size < sizeof(BinaryModelHeader))
+                throw std::runtime_error("BinaryModel: file too small for header");
+
+            BinaryModelHeader header;
+            std::memcpy(&header, data, sizeof(header));
+            if (std::memcmp(header.magic, BinaryModelMagic, sizeof(BinaryModelMagic)) != 0)
+                throw std::runtime_error("BinaryModel: wrong magic number");
+            if (header.version != BinaryModelVersion)
+                throw std::runtime_error("BinaryModel: unsupported version " + std::to_string(header.version));
+            if (header.json_offset + header.json_size > size || header.blob_offset + header.blob_size > size)
+                throw std::runtime_error("BinaryModel: truncated file");
+            if (header.blob_offset % BinaryModelAlignment != 0)
+                throw std::runtime_error("BinaryModel: misaligned tensor blob");
+
+            const char* json_begin = reinterpret_cast<const char*>(data + header.json_offset);
+            m_doc = nlohmann::json::parse(json_begin, json_begin + header.json_size);
+            m_blob.data = data + header.blob_offset;
+            m_blob.size = header.blob_size;
+        }
+
+        std::unique_ptr<MappedFile> m_file; // null for views
+        nlohmann::json m_doc;
+        TensorBlob m_blob;
+    };
+
+}
@@ -13,6 +13,27 @@ namespace Nanoflare
     // Register builtin models during static initialization
     // This happens before main(), so models are available when needed
     namespace {
+#ifdef NANOFLARE_FIXED_SIZE_MODELS
+        // Instantiations with compile-time shapes for the common small models, picked by
+        // ModelBuilder when a document matches them. Opt-in with NANOFLARE_FIXED_SIZE_MODELS
+        // (CMake option of the same name), as they make every translation unit including this
+        // header several times slower to compile and larger. The registry is shared, so
+        // defining it in a single translation unit of a program is enough.
+        template<int... HiddenSizes>
+        inline void registerFixedSizeRNNs()
+        {
+            (registerSpecialization<ResRNN<GRUT<1, HiddenSizes>>>("ResGRU"), ...);
+            (registerSpecialization<ResRNN<LSTMT<1, HiddenSizes>>>("ResLSTM"), ...);
+        }
+
+        template<int... HiddenSizes>
+        inline void registerFixedSizeTCNs()
+        {
+            (registerSpecialization<MicroTCNT<HiddenSizes, 3>>("MicroTCN"), ...);
+            (registerSpecialization<TCNT<HiddenSizes, 3>>("TCN"), ...);
+        }
+#endif
+
         inline bool registerBuiltinModels()
         {
             registerModel<MicroTCN>("MicroTCN");
@@ -20,6 +41,10 @@ namespace Nanoflare
             registerModel<ResRNN<LSTM>>("ResLSTM");
             registerModel<TCN>("TCN");
             registerModel<WaveNet>("WaveNet");
+#ifdef NANOFLARE_FIXED_SIZE_MODELS
+            registerFixedSizeRNNs<16, 32, 48, 64>();
+            registerFixedSizeTCNs<8, 16, 24, 32>();
+#endif
             return true;
         }
 
@@ -0,0 +1,146 @@
+#pragma once
+
+#include <Eigen/Dense>
+#include <cassert>
+#include "nanoflare/Activations.h"
+#include "nanoflare/Epilogue.h"
+#include "nanoflare/utils.h"
+
+namespace Nanoflare
+{
+    // Register-blocked direct 1D convolution. Every w(o, j, k) * x(j, t + k * dilation) product is
+    // accumulated straight from the input rows, without the kernel_size copies of an im2col matrix:
+    // a block of 4 output channels by 16 time steps (fewer for short blocks) is kept in SIMD
+    // registers, each input lane is loaded once per channel and tap and multiplied into every row.
+    class DirectConv
+    {
+    public:
+        // Above this many weights im2col + GEMM is faster, its cache blocking pays off
+        static constexpr Eigen::Index MaxWeights = 2048;
+
+        static inline bool isFaster(Eigen::Index num_weights) noexcept { return num_weights <= MaxWeights; }
+
+        // Applied to the accumulators before they are stored, followed by the rest of the epilogue.
+        // GatedTanh splits the convolution output channels in a filter and a gate half,
+        // y = tanh(filter) * logistic(gate), and so writes w.rows() / 2 channels
+        enum class Activation { None, Tanh, GatedTanh };
+
+        // y(o, t) = b(o) + sum_{j,k} w(o, j * kernel_size + k) * x(j, t + k * dilation), where x holds
+        // at least y.cols() + dilation * (kernel_size - 1) columns, then the epilogue, whose bias b
+        // starts the accumulators and whose activation, scale and residual apply in registers.
+        // x must not alias y.
+        // Shapes known at compile time (w.rows(), x.rows(), kernel_size) unroll the kernel loops.
+        template<Activation Act = Activation::None, ActivationPrecision P = ActivationPrecision::Exact,
+                 int InChannels = Eigen::Dynamic, int OutChannels = Eigen::Dynamic, int KernelSize = Eigen::Dynamic>
+        static inline void forward(const Eigen::Ref<const RowMatrixXf>& w, const Epilogue& epilogue, int kernel_size, int dilation,
+            const Eigen::Ref<const RowMatrixXf>& x, Eigen::Ref<RowMatrixXf> y) noexcept
+        {
+            constexpr int Gates = Act == Activation::GatedTanh ? 2 : 1;
+            assert(w.cols() == x.rows() * kernel_size && "DirectConv.forward: Wrong input shape");
+            assert((InChannels == Eigen::Dynamic || InChannels == x.rows()) && (OutChannels == Eigen::Dynamic || OutChannels == w.rows())
+                && (KernelSize == Eigen::Dynamic || KernelSize == kernel_size) && "DirectConv.forward: Wrong compile-time shape");
+            assert(y.rows() * Gates == w.rows() && x.cols() >= y.cols() + dilation * (kernel_size - 1) && "DirectConv.forward: Wrong output shape");
+
+            const Args args{ w.data(), w.cols(), &epilogue, y.rows(), x.data(), x.outerStride(), y.data(), y.outerStride(),
+                (int)x.rows(), kernel_size, dilation };
+
+            const Eigen::Index out_rows = OutChannels == Eigen::Dynamic ? y.rows() : OutChannels / Gates;
+            Eigen::Index o = 0;
+            for (; o + 4 <= out_rows; o += 4)
+                rows<4, Act, P, InChannels, KernelSize>(args, o, y.cols());
+            // Remaining rows share one block, a single accumulator would be latency bound
+            switch (out_rows - o)
+            {
+                case 3: rows<3, Act, P, InChannels, KernelSize>(args, o, y.cols()); break;
+                case 2: rows<2, Act, P, InChannels, KernelSize>(args, o, y.cols()); break;
+                case 1: rows<1, Act, P, InChannels, KernelSize>(args, o, y.cols()); break;
+                default: break;
+            }
+        }
+
+    private:
+        struct Args
+        {
+            const float* w; Eigen::Index wStride;
+            const Epilogue* epilogue;
+            Eigen::Index gateRow; // first weight row of the gate half
+            const float* x; Eigen::Index xStride;
+            float* y; Eigen::Index yStride;
+            int inChannels, kernelSize, dilation;
+        };
+
+        template<int Rows, Activation Act, ActivationPrecision P, int InChannels, int KernelSize>
+        static inline void rows(const Args& args, Eigen::Index o, Eigen::Index len) noexcept
+        {
+            if (len >= 16)
+                sweep<Rows, 16, Act, P, InChannels, KernelSize>(args, o, len);
+            else if (len >= 8)
+                sweep<Rows, 8, Act, P, InChannels, KernelSize>(args, o, len);
+            else if (len >= 4)
+                sweep<Rows, 4, Act, P, InChannels, KernelSize>(args, o, len);
+            else
+                sweep<Rows, 1, Act, P, InChannels, KernelSize>(args, o, len);
+        }
+
+        // The last, partial block is shifted left to end at len: it overlaps the previous one and
+        // writes the same values again, which is cheaper than single time step blocks whose
+        // accumulators are latency bound
+        template<int Rows, int Width, Activation Act, ActivationPrecision P, int InChannels, int KernelSize>
+        static inline void sweep(const Args& args, Eigen::Index o, Eigen::Index len) noexcept
+        {
+            Eigen::Index t = 0;
+            for (; t + Width <= len; t += Width)
+                block<Rows, Width, Act, P, InChannels, KernelSize>(args, o, t);
+            if (t < len)
+                block<Rows, Width, Act, P, InChannels, KernelSize>(args, o, len - Width);
+        }
+
+        // Output channels [o, o + Rows) by time steps [t, t + Width), gated blocks hold a filter
+        // and a gate accumulator per output channel
+        template<int Rows, int Width, Activation Act, ActivationPrecision P, int InChannels, int KernelSize>
+        static inline void block(const Args& args, Eigen::Index o, Eigen::Index t) noexcept
+        {
+            using Lane = Eigen::Array<float, 1, Width>;
+            constexpr int Gates = Act == Activation::GatedTanh ? 2 : 1;
+
+            // acc[g * Rows + r] accumulates weight row o + r + g * gateRow
+            Lane acc[Gates * Rows];
+            const float* b = args.epilogue->bias;
+            for (int g = 0; g < Gates; ++g)
+                for (int r = 0; r < Rows; ++r)
+                    acc[g * Rows + r].setConstant(b != nullptr ? b[o + r + g * args.gateRow] : 0.f);
+
+            // Compile-time shapes fully unroll the tap loops
+            const int in_channels = InChannels == Eigen::Dynamic ? args.inChannels : InChannels;
+            const int kernel_size = KernelSize == Eigen::Dynamic ? args.kernelSize : KernelSize;
+            const float* w = args.w + o * args.wStride;
+            for (int j = 0; j < in_channels; ++j)
+            {
+                const float* x = args.x + j * args.xStride + t;
+                for (int k = 0; k < kernel_size; ++k)
+                {
+                    const Lane input = Eigen::Map<const Lane>(x + k * args.dilation);
+                    const int tap = j * kernel_size + k;
+                    for (int g = 0; g < Gates; ++g)
+                        for (int r = 0; r < Rows; ++r)
+                            acc[g * Rows + r] += w[(g * args.gateRow + r) * args.wStride + tap] * input;
+                }
+            }
+
+            const bool finishes = args.epilogue->finishes();
+            for (int r = 0; r < Rows; ++r)
+            {
+                Lane v;
+                if constexpr (Act == Activation::GatedTanh)
+                    v = Activations::tanh<P>(acc[r]) * Activations::sigmoid<P>(acc[Rows + r]);
+                else if constexpr (Act == Activation::Tanh)
+                    v = Activations::tanh<P>(acc[r]);
+                else
+                    v = acc[r];
+                if (finishes)
+                    args.epilogue->finish(v, o + r, t);
+                Eigen::Map<Lane>(args.y + (o + r) * args.yStride + t) = v;
+            }
+        }
+    };
+}
@@ -0,0 +1,173 @@
+#pragma once
+
+#include <Eigen/Dense>
+#include <algorithm>
+#include "nanoflare/Activations.h"
+#include "nanoflare/utils.h"
+
+namespace Nanoflare
+{
+    // What the Linear and convolutional layers apply to their product before storing it,
+    // y = scale * activation(w x + bias) + residual, composed from the with*() setters:
+    //
+    //   conv.forward( x, y, Epilogue().withActivation( Epilogue::Activation::LeakyReLU, 0.2f ).withResidual( r ) );
+    //
+    // Layers set the bias themselves. Kernels that keep output tiles in registers (DirectConv,
+    // SparseGemm, QuantizedGemm) apply it to their accumulators, GEMMs to every panel of output
+    // while it is still in L1, see run(). It only points to its operands, that must outlive the
+    // call. The residual has the shape and layout of the output and must not alias it.
+    struct Epilogue
+    {
+        enum class Activation { None, ReLU, LeakyReLU, PReLU, Tanh };
+
+        const float* bias = nullptr;     // one per output channel
+        Activation activation = Activation::None;
+        float slope = 0.f;               // LeakyReLU
+        const float* slopes = nullptr;   // PReLU, one per output channel
+        ActivationPrecision precision = ActivationPrecision::Exact; // Tanh
+        float scale = 1.f;
+        const float* residual = nullptr;
+        Eigen::Index residualStride = 0;
+
+        Epilogue withBias(const float* b) const noexcept { Epilogue e = *this; e.bias = b; return e; }
+        Epilogue withActivation(Activation a, float negative_slope = 0.f) const noexcept
+        {
+            Epilogue e = *this;
+            e.activation = a;
+            e.slope = negative_slope;
+            return e;
+        }
+        Epilogue withPReLU(const float* negative_slopes) const noexcept
+        {
+            Epilogue e = *this;
+            e.activation = Activation::PReLU;
+            e.slopes = negative_slopes;
+            return e;
+        }
+        Epilogue withTanh(ActivationPrecision p) const noexcept
+        {
+            Epilogue e = *this;
+            e.activation = Activation::Tanh;
+            e.precision = p;
+            return e;
+        }
+        Epilogue withScale(float s) const noexcept { Epilogue e = *this; e.scale = s; return e; }
+        // r must be a view of existing memory, not an expression evaluated into a temporary
+        Epilogue withResidual(const Eigen::Ref<const RowMatrixXf>& r) const noexcept
+        {
+            Epilogue e = *this;
+            e.residual = r.data();
+            e.residualStride = r.outerStride();
+            return e;
+        }
+
+        // The same epilogue for the channel-major output time steps from t onwards
+        Epilogue fromTimeStep(Eigen::Index t) const noexcept
+        {
+            Epilogue e = *this;
+            if (e.residual != nullptr)
+                e.residual += t;
+            return e;
+        }
+
+        bool isIdentity() const noexcept { return bias == nullptr && finishes() == false; }
+
+        // Whether finish() does anything
+        bool finishes() const noexcept { return activation != Activation::None || scale != 1.f || residual != nullptr; }
+
+        // Activation, scale and residual of output channel o over the time steps [t, t + v.size()),
+        // for kernels whose accumulators already hold the bias. v is an Eigen array or array view.
+        template<typename Row>
+        inline void finish(Row&& v, Eigen::Index o, Eigen::Index t) const noexcept
+        {
+            switch (activation)
+            {
+                case Activation::None:      break;
+                case Activation::ReLU:      v = v.cwiseMax(0.f); break;
+                case Activation::LeakyReLU: v = (v > 0.f).select(v, v * slope); break;
+                case Activation::PReLU:     v = (v > 0.f).select(v, v * slopes[o]); break;
+                case Activation::Tanh:
+                    switch (precision)
+                    {
+                        case ActivationPrecision::Exact:      v = Activations::tanh<ActivationPrecision::Exact>(v); break;
+                        case ActivationPrecision::Rational:   v = Activations::tanh<ActivationPrecision::Rational>(v); break;
+                        case ActivationPrecision::Polynomial: v = Activations::tanh<ActivationPrecision::Polynomial>(v); break;
+                    }
+                    break;
+            }
+            if (scale != 1.f)
+                v *= scale;
+            if (residual != nullptr)
+                v += Eigen::Map<const Eigen::Array<float, 1, Eigen::Dynamic>>(residual + o * residualStride + t, v.size());
+        }
+
+        // The whole epilogue on output channels [o, o + y.rows()) of a channel-major tile whose
+        // first time step is t
+        inline void apply(Eigen::Ref<RowMatrixXf> y, Eigen::Index o = 0, Eigen::Index t = 0) const noexcept
+        {
+            if (isIdentity())
+                return;
+            for (Eigen::Index r = 0; r < y.rows(); ++r)
+            {
+                auto row = y.row(r).array();
+                if (bias != nullptr)
+                    row += bias[o + r];
+                finish(row, o + r, t);
+            }
+        }
+
+        // The whole epilogue on a time-major (time, channels) output, see Linear::forward()
+        inline void applyTransposed(Eigen::Ref<RowMatrixXf> y) const noexcept
+        {
+            if (isIdentity())
+                return;
+            using Channels = Eigen::Map<const Eigen::Array<float, 1, Eigen::Dynamic>>;
+            auto a = y.array();
+            if (bias != nullptr)
+                a.rowwise() += Channels(bias, y.cols());
+            switch (activation)
+            {
+                case Activation::None:      break;
+                case Activation::ReLU:      a = a.cwiseMax(0.f); break;
+                case Activation::LeakyReLU: a = (a > 0.f).select(a, a * slope); break;
+                case Activation::PReLU:     a = (a > 0.f).select(a, a.rowwise() * Channels(slopes, y.cols())); break;
+                case Activation::Tanh:
+                {
+                    const Epilogue tanh = Epilogue().withTanh(precision);
+                    for (Eigen::Index i = 0; i < y.rows(); ++i)
+                        tanh.finish(y.row(i).array(), 0, 0);
+                    break;
+                }
+            }
+            if (scale != 1.f)
+                a *= scale;
+            if (residual != nullptr)
+                a += Eigen::Map<const RowMatrixXf, 0, Eigen::OuterStride<>>(residual, y.rows(), y.cols(), Eigen::OuterStride<>(residualStride)).array();
+        }
+
+        // Time steps per panel of run(): the output of a panel fills at most half of a 32 KB L1
+        static Eigen::Index panelWidth(Eigen::Index rows) noexcept
+        {
+            return std::max<Eigen::Index>(16, 4096 / std::max<Eigen::Index>(rows, 1) / 16 * 16);
+        }
+
+        // Runs product(t, n), that writes the time steps [t, t + n) of the channel-major y, panel
+        // after panel and applies the whole epilogue to each while it is still in L1
+        template<typename Product>
+        inline void run(Eigen::Ref<RowMatrixXf> y, Product&& product) const noexcept
+        {
+            if (isIdentity())
+            {
+                product(Eigen::Index(0), y.cols());
+                return;
+            }
+            const Eigen::Index panel = panelWidth(y.rows());
+            for (Eigen::Index t = 0; t < y.cols(); t += panel)
+            {
+                const Eigen::Index n = std::min(panel, y.cols() - t);
+                product(t, n);
+                apply(y.middleCols(t, n), 0, t);
+            }
+        }
+    };
+}
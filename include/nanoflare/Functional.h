@@ -1,6 +1,7 @@
 #pragma once
 
 #include <Eigen/Dense>
+#include "nanoflare/Activations.h"
 #include "nanoflare/utils.h"
 
 namespace Nanoflare
@@ -20,9 +21,14 @@ namespace Nanoflare
             a = (a > 0).select(a, a * negative_slope);
         }
 
-        static inline void Sigmoid( Eigen::Ref<RowMatrixXf> x ) noexcept
+        static inline void Sigmoid( Eigen::Ref<RowMatrixXf> x, ActivationPrecision precision = ActivationPrecision::Exact ) noexcept
         {
-            x.array() = x.array().logistic();
+            switch (precision)
+            {
+                case ActivationPrecision::Exact:      x.array() = Activations::sigmoid<ActivationPrecision::Exact>( x.array() ); break;
+                case ActivationPrecision::Rational:   x.array() = Activations::sigmoid<ActivationPrecision::Rational>( x.array() ); break;
+                case ActivationPrecision::Polynomial: x.array() = Activations::sigmoid<ActivationPrecision::Polynomial>( x.array() ); break;
+            }
         }
 
         static inline void Softmax( Eigen::Ref<RowMatrixXf> x) noexcept
@@ -32,9 +38,14 @@ namespace Nanoflare
             x /= x.sum();
         }
 
-        static inline void Tanh( Eigen::Ref<RowMatrixXf> x ) noexcept
+        static inline void Tanh( Eigen::Ref<RowMatrixXf> x, ActivationPrecision precision = ActivationPrecision::Exact ) noexcept
         {
-            x.array() = x.array().tanh();
+            switch (precision)
+            {
+                case ActivationPrecision::Exact:      x.array() = Activations::tanh<ActivationPrecision::Exact>( x.array() ); break;
+                case ActivationPrecision::Rational:   x.array() = Activations::tanh<ActivationPrecision::Rational>( x.array() ); break;
+                case ActivationPrecision::Polynomial: x.array() = Activations::tanh<ActivationPrecision::Polynomial>( x.array() ); break;
+            }
         }
 
         static inline void LayerNorm( Eigen::Ref<RowMatrixXf> x ) noexcept
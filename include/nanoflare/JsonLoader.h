@@ -0,0 +1,146 @@
+#pragma once
+
+#include <nlohmann/json.hpp>
+#include <cstring>
+#include <istream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace Nanoflare
+{
+    // SAX handler building a model document in a single pass over the text. Every
+    // tensor "values" array is stored as one float32 binary value rather than one
+    // json node per number, which divides the document footprint by about four.
+    // The loaders in utils.h read both representations.
+    class JsonLoader
+    {
+    public:
+        using json = nlohmann::json;
+
+        JsonLoader() = default;
+        ~JsonLoader() = default;
+
+        bool null() { return addScalar( nullptr ); }
+        bool boolean(bool value) { return addScalar( value ); }
+        bool number_integer(json::number_integer_t value) { return m_collecting ? collect( static_cast<float>(value) ) : addScalar( value ); }
+        bool number_unsigned(json::number_unsigned_t value) { return m_collecting ? collect( static_cast<float>(value) ) : addScalar( value ); }
+        bool number_float(json::number_float_t value, const json::string_t&) { return m_collecting ? collect( static_cast<float>(value) ) : addScalar( value ); }
+        bool string(json::string_t& value) { return addScalar( std::move(value) ); }
+        bool binary(json::binary_t& value) { return addScalar( std::move(value) ); }
+
+        bool start_object(std::size_t)
+        {
+            if( m_collecting )
+                throw std::runtime_error("JsonLoader: tensor values must be a flat array of numbers");
+            m_stack.push_back( addValue( json::value_t::object ) );
+            return true;
+        }
+
+        bool key(json::string_t& value)
+        {
+            m_key = std::move(value);
+            return true;
+        }
+
+        bool end_object()
+        {
+            m_stack.pop_back();
+            return true;
+        }
+
+        bool start_array(std::size_t)
+        {
+            if( m_collecting )
+                throw std::runtime_error("JsonLoader: tensor values must be a flat array of numbers");
+            if( !m_stack.empty() && m_stack.back()->is_object() && m_key == "values" )
+            {
+                m_collecting = true;
+                m_values.clear();
+                return true;
+            }
+            m_stack.push_back( addValue( json::value_t::array ) );
+            return true;
+        }
+
+        bool end_array()
+        {
+            if( m_collecting )
+            {
+                m_collecting = false;
+                json::binary_t::container_type bytes( m_values.size() * sizeof(float) );
+                if( !bytes.empty() )
+                    std::memcpy( bytes.data(), m_values.data(), bytes.size() );
+                addValue( json::binary( std::move(bytes) ) );
+                return true;
+            }
+            m_stack.pop_back();
+            return true;
+        }
+
+        bool parse_error(std::size_t, const std::string&, const nlohmann::detail::exception& ex)
+        {
+            throw std::runtime_error( std::string("JsonLoader: ") + ex.what() );
+        }
+
+        json& getDoc() { return m_root; }
+
+        // Parse a model document from a stream
+        static json parse(std::istream& stream)
+        {
+            JsonLoader loader;
+            json::sax_parse( stream, &loader );
+            return std::move( loader.getDoc() );
+        }
+
+        // Parse a model document from a character range
+        static json parse(const char* begin, const char* end)
+        {
+            JsonLoader loader;
+            json::sax_parse( begin, end, &loader );
+            return std::move( loader.getDoc() );
+        }
+
+    private:
+        template<typename T>
+        bool addScalar(T&& value)
+        {
+            if( m_collecting )
+                throw std::runtime_error("JsonLoader: tensor values must be a flat array of numbers");
+            addValue( std::forward<T>(value) );
+            return true;
+        }
+
+        template<typename T>
+        json* addValue(T&& value)
+        {
+            if( m_stack.empty() )
+            {
+                m_root = json( std::forward<T>(value) );
+                return &m_root;
+            }
+            json* parent = m_stack.back();
+            if( parent->is_array() )
+            {
+                parent->emplace_back( std::forward<T>(value) );
+                return &parent->back();
+            }
+            json& element = (*parent)[m_key];
+            element = json( std::forward<T>(value) );
+            return &element;
+        }
+
+        bool collect(float value)
+        {
+            m_values.push_back( value );
+            return true;
+        }
+
+        json m_root;
+        std::vector<json*> m_stack; // open containers, innermost last
+        json::string_t m_key;       // last key read in the innermost object
+        bool m_collecting = false;  // inside a tensor "values" array
+        std::vector<float> m_values;
+    };
+
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <Eigen/Dense>
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include "nanoflare/utils.h"
+
+namespace Nanoflare
+{
+    // Load-time truncated SVD of layer weights, see BaseModel::setLowRank(). A (rows, cols)
+    // weight matrix w becomes u (rows, rank) times v (rank, cols), and w x two thinner products
+    // u (v x): rank * (rows + cols) multiply-adds per time step instead of rows * cols. Trained
+    // weights that are close to low rank keep most of their accuracy at a fraction of the cost.
+    class LowRank
+    {
+    public:
+        struct Factors
+        {
+            RowMatrixXf u;     // (rows, rank), left singular vectors scaled by their singular values
+            RowMatrixXf v;     // (rank, cols)
+            float error = 0.f; // relative Frobenius error of u v, |w - u v| / |w|
+
+            Eigen::Index rank() const noexcept { return v.rows(); }
+            bool empty() const noexcept { return v.size() == 0; }
+        };
+
+        // Keeps the smallest rank whose singular values hold a fraction energy of the squared
+        // Frobenius norm of w, at most max_rank when it is not 0. Empty factors when that rank
+        // would not save multiply-adds, w is then used as it is.
+        static Factors factorize(const Eigen::Ref<const RowMatrixXf>& w, float energy, Eigen::Index max_rank = 0)
+        {
+            assert(energy > 0.f && max_rank >= 0 && "LowRank.factorize: Wrong truncation");
+            Factors f;
+            const Eigen::Index rows = w.rows(), cols = w.cols();
+            if (w.size() == 0 || (energy >= 1.f && max_rank == 0))
+                return f;
+
+            const Eigen::BDCSVD<Eigen::MatrixXd> svd(w.cast<double>(), Eigen::ComputeThinU | Eigen::ComputeThinV);
+            const Eigen::VectorXd& s = svd.singularValues();
+            const double total = s.squaredNorm();
+            if (total == 0.0)
+                return f;
+
+            Eigen::Index rank = 0;
+            double kept = 0.0;
+            for (; rank < s.size() && kept < energy * total; ++rank)
+                kept += s(rank) * s(rank);
+            if (max_rank > 0)
+                rank = std::min(rank, max_rank);
+            if (rank * (rows + cols) >= rows * cols)
+                return f;
+
+            f.u = (svd.matrixU().leftCols(rank) * s.head(rank).asDiagonal()).cast<float>();
+            f.v = svd.matrixV().leftCols(rank).transpose().cast<float>();
+            f.error = static_cast<float>(std::sqrt(s.tail(s.size() - rank).squaredNorm() / total));
+            return f;
+        }
+
+        // y = u (v x), or y += u (v x) when Accumulate, with t (rank(), x.cols()) scratch
+        template<bool Accumulate = false, typename Derived>
+        static inline void forward(const Factors& f, const Eigen::MatrixBase<Derived>& x, Eigen::Map<RowMatrixXf> t, Eigen::Ref<RowMatrixXf> y) noexcept
+        {
+            assert(x.rows() == f.v.cols() && t.rows() == f.rank() && t.cols() == x.cols() && y.rows() == f.u.rows() && y.cols() == x.cols()
+                && "LowRank.forward: Wrong shape");
+            t.noalias() = f.v * x;
+            if constexpr (Accumulate)
+                y.noalias() += f.u * t;
+            else
+                y.noalias() = f.u * t;
+        }
+    };
+}
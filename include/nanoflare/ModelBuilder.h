@@ -1,6 +1,13 @@
 #pragma once
 
 #include <nlohmann/json.hpp>
+#include <istream>
+#include <mutex>
+#include <utility>
+#include <vector>
+#include "nanoflare/BinaryModel.h"
+#include "nanoflare/JsonLoader.h"
+#include "nanoflare/Sha256.h"
 #include "nanoflare/models/BaseModel.h"
 
 namespace Nanoflare
@@ -11,6 +18,7 @@ namespace Nanoflare
     public:
         // Define a type for the builder function
         using BuildFn = std::function<void(const nlohmann::json&, std::shared_ptr<BaseModel>&)>;
+        using MatchFn = std::function<bool(const nlohmann::json&)>;
 
         // Get the singleton instance
         static ModelBuilder& getInstance() {
@@ -24,22 +32,117 @@ namespace Nanoflare
             return m_builders.insert({name, builder}).second;
         }
 
+        // Register a builder for the models of a given name whose document satisfies match,
+        // typically an instantiation with compile-time shapes. Specializations are tried in
+        // registration order before the generic builder of that name.
+        bool registerSpecialization(const std::string& name, MatchFn match, BuildFn builder) {
+            // Return false if this builder function is already registered for this name
+            auto& specializations = m_specializations[name];
+            if (const auto* function = builder.target<BuildPtr>())
+                for (const auto& specialization : specializations) {
+                    const auto* other = specialization.second.target<BuildPtr>();
+                    if (other != nullptr && *other == *function)
+                        return false;
+                }
+            specializations.push_back({ std::move(match), std::move(builder) });
+            return true;
+        }
+
         // Create a mdoel by its string name
         void buildModel(const nlohmann::json& data, std::shared_ptr<BaseModel>& obj) {
-            auto doc = data.get<std::map<std::string, nlohmann::json>>();
             auto config = data.at("config").template get<ModelConfig>();
+            auto specializations = m_specializations.find( config.model_type );
+            if (specializations != m_specializations.end())
+                for (const auto& specialization : specializations->second)
+                    if (specialization.first( data )) {
+                        specialization.second( data, obj );
+                        return;
+                    }
             auto it = m_builders.find( config.model_type );
             if (it != m_builders.end())
                 it->second( data, obj ); // Call the registered builder function
         }
 
+        // Create a model from a JSON stream parsed in a single SAX pass (see JsonLoader.h)
+        void buildModel(std::istream& stream, std::shared_ptr<BaseModel>& obj) {
+            buildModel( JsonLoader::parse(stream), obj );
+        }
+
+        // Create a model from a memory-mapped binary file, tensors are read in place from the mapping
+        void buildModel(const BinaryModel& file, std::shared_ptr<BaseModel>& obj) {
+            TensorBlobScope scope( file.getBlob() );
+            buildModel( file.getDoc(), obj );
+        }
+
+        // Create a model from a binary or JSON file. Built models are cached by the SHA-256 digest
+        // of the file content: loading the same content again returns a clone sharing the cached
+        // weights, so an extra instance only costs its scratch buffers and recurrent state. The
+        // cache is only locked around lookups, loads of different files build concurrently.
+        void loadModel(const std::string& path, std::shared_ptr<BaseModel>& obj) {
+            MappedFile file( path );
+            const CacheKey key{ Sha256::hash( file.data(), file.size() ), file.size() };
+            if (cloneCached( key, obj ))
+                return;
+
+            std::shared_ptr<BaseModel> prototype;
+            if (BinaryModel::isBinary( file.data(), file.size() ))
+                buildModel( BinaryModel( file.data(), file.size() ), prototype );
+            else {
+                const char* text = reinterpret_cast<const char*>( file.data() );
+                buildModel( JsonLoader::parse( text, text + file.size() ), prototype );
+            }
+            if (!prototype)
+                return;
+
+            obj = prototype->clone();
+            if (!obj) {
+                obj = prototype; // model does not support weight sharing
+                return;
+            }
+
+            // Another thread may have built the same content meanwhile: the first one stays cached
+            // (never run, kept only as a weights holder) and the clone shares its weights
+            std::shared_ptr<BaseModel> cached;
+            {
+                std::lock_guard<std::mutex> lock( m_cacheMutex );
+                cached = m_cache.emplace( key, prototype ).first->second;
+            }
+            if (cached != prototype)
+                obj = cached->clone();
+        }
+
+        // Drop cached weights, instances already created keep theirs
+        void clearCache() {
+            std::lock_guard<std::mutex> lock( m_cacheMutex );
+            m_cache.clear();
+        }
+
     private:
+        using BuildPtr = void(*)(const nlohmann::json&, std::shared_ptr<BaseModel>&);
+        using CacheKey = std::pair<Sha256::Digest, size_t>; // (SHA-256 digest, size) of the file content
+
+        bool cloneCached(const CacheKey& key, std::shared_ptr<BaseModel>& obj) {
+            std::shared_ptr<BaseModel> prototype;
+            {
+                std::lock_guard<std::mutex> lock( m_cacheMutex );
+                auto it = m_cache.find( key );
+                if (it == m_cache.end())
+                    return false;
+                prototype = it->second;
+            }
+            obj = prototype->clone();
+            return true;
+        }
+
         ModelBuilder() = default; // Private constructor for singleton
         ~ModelBuilder() = default;
         ModelBuilder(const ModelBuilder&) = delete; // Delete copy constructor
         ModelBuilder& operator=(const ModelBuilder&) = delete; // Delete assignment operator
 
         std::map<std::string, BuildFn> m_builders;
+        std::map<std::string, std::vector<std::pair<MatchFn, BuildFn>>> m_specializations;
+        std::map<CacheKey, std::shared_ptr<BaseModel>> m_cache;
+        std::mutex m_cacheMutex;
     };
 
     template<typename T>
@@ -47,4 +150,10 @@ namespace Nanoflare
         ModelBuilder::getInstance().registerBuilder(name, &T::build);
     }
 
+    // T provides static matches() and build(), see ModelBuilder::registerSpecialization
+    template<typename T>
+    inline bool registerSpecialization(const std::string& name) {
+        return ModelBuilder::getInstance().registerSpecialization(name, &T::matches, &T::build);
+    }
+
 }
\ No newline at end of file
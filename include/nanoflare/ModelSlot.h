@@ -0,0 +1,257 @@
+#pragma once
+
+#include <Eigen/Dense>
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include "nanoflare/ModelBuilder.h"
+#include "nanoflare/models/BaseModel.h"
+#include "nanoflare/utils.h"
+
+namespace Nanoflare
+{
+    // Real-time safe model holder for hot swapping. Models are loaded and warmed up
+    // on a worker thread, then published to the audio thread through an atomic
+    // pointer. process() crossfades from the previous model (or the dry input when
+    // none was loaded yet) over crossfade_samples, and hands the previous model back
+    // to the worker for destruction. process() never allocates, locks or frees.
+    class ModelSlot
+    {
+    public:
+        ModelSlot(size_t in_channels, size_t out_channels, size_t max_block_size, size_t crossfade_samples) :
+            m_inChannels(in_channels), m_outChannels(out_channels),
+            m_maxBlockSize(max_block_size), m_crossfadeSamples(std::max<size_t>(crossfade_samples, 1)),
+            m_fadeBuffer(RowMatrixXf::Zero(out_channels, max_block_size)),
+            m_worker([this] { run(); })
+        {
+            assert(max_block_size > 0);
+        }
+
+        ~ModelSlot()
+        {
+            {
+                std::lock_guard<std::mutex> lock( m_mutex );
+                m_stop = true;
+            }
+            m_condition.notify_one();
+            m_worker.join();
+            delete m_current;
+            delete m_next;
+            delete m_pending.exchange( nullptr );
+            collectRetired();
+        }
+
+        ModelSlot(const ModelSlot&) = delete;
+        ModelSlot& operator=(const ModelSlot&) = delete;
+
+        // Non real-time: load a model file (binary or JSON) on the worker thread
+        void load(const std::string& path)
+        {
+            request( [path]() {
+                std::shared_ptr<BaseModel> model;
+                ModelBuilder::getInstance().loadModel( path, model );
+                return model;
+            } );
+        }
+
+        // Non real-time: publish an already built model after warming it up on the worker thread.
+        // The slot takes ownership: the worker runs prepare() and resetState() on it, so the caller
+        // must not use the model (or share it with another slot) once it is handed over, clone() it
+        // to keep a copy.
+        void setModel(std::shared_ptr<BaseModel> model)
+        {
+            request( [model]() { return model; } );
+        }
+
+        // Real-time: process a block of any size with the active model(s), x and y may alias
+        void process( const Eigen::Ref<const RowMatrixXf>& x, Eigen::Ref<RowMatrixXf> y ) noexcept
+        {
+            assert(x.rows() == m_inChannels && "ModelSlot.process: Wrong input shape");
+            assert((y.rows() == m_outChannels && y.cols() == x.cols()) && "ModelSlot.process: Wrong output shape");
+
+            for(Eigen::Index start = 0; start < x.cols(); start += m_maxBlockSize)
+            {
+                const Eigen::Index len = std::min<Eigen::Index>( m_maxBlockSize, x.cols() - start );
+                processBlock( x.middleCols(start, len), y.middleCols(start, len) );
+            }
+        }
+
+        bool isCrossfading() const noexcept { return m_next != nullptr; }
+
+        // Whether a model was published by the worker and waits for the next process() call
+        bool isSwapPending() const noexcept { return m_pending.load( std::memory_order_acquire ) != nullptr; }
+
+        // Number of completed swaps, can be polled from any thread
+        size_t getSwapCount() const noexcept { return m_swapCount.load( std::memory_order_acquire ); }
+
+        // Message of the last failed load, empty if none
+        std::string getLastError() const
+        {
+            std::lock_guard<std::mutex> lock( m_mutex );
+            return m_lastError;
+        }
+
+    private:
+        struct Entry
+        {
+            std::shared_ptr<BaseModel> model;
+        };
+
+        static constexpr size_t RetireCapacity = 8;
+        static constexpr auto WorkerPeriod = std::chrono::milliseconds(20);
+        static_assert(std::atomic<Entry*>::is_always_lock_free, "ModelSlot requires lock-free atomic pointers");
+
+        inline void processBlock( const Eigen::Ref<const RowMatrixXf>& x, Eigen::Ref<RowMatrixXf> y ) noexcept
+        {
+            // Pick up a newly published model, unless a crossfade is already running or the
+            // worker has not yet collected enough retired models to accept another one
+            if (m_next == nullptr && canRetire())
+                m_next = m_pending.exchange( nullptr, std::memory_order_acq_rel );
+
+            // The incoming model runs first: in-place calls overwrite x with the current output
+            auto fade = m_fadeBuffer.leftCols( x.cols() );
+            if (m_next != nullptr)
+                m_next->model->forward( x, fade );
+
+            if (m_current != nullptr)
+                m_current->model->forward( x, y );
+            else
+                bypass( x, y );
+
+            if (m_next == nullptr)
+                return;
+
+            const float step = 1.f / static_cast<float>( m_crossfadeSamples );
+            for(Eigen::Index n = 0; n < x.cols(); ++n)
+            {
+                const float gain = std::min( 1.f, static_cast<float>( m_fadePosition + n + 1 ) * step );
+                y.col(n) = (1.f - gain) * y.col(n) + gain * fade.col(n);
+            }
+
+            m_fadePosition += x.cols();
+            if (m_fadePosition >= m_crossfadeSamples)
+            {
+                if (m_current != nullptr)
+                    retire( m_current );
+                m_current = m_next;
+                m_next = nullptr;
+                m_fadePosition = 0;
+                m_swapCount.fetch_add( 1, std::memory_order_release );
+            }
+        }
+
+        inline void bypass( const Eigen::Ref<const RowMatrixXf>& x, Eigen::Ref<RowMatrixXf> y ) noexcept
+        {
+            if (m_inChannels == m_outChannels)
+                y = x;
+            else
+                y.setZero();
+        }
+
+        // Single producer (audio thread), single consumer (worker thread) ring of retired models
+        inline bool canRetire() const noexcept
+        {
+            return m_retireWrite.load( std::memory_order_relaxed ) - m_retireRead.load( std::memory_order_acquire ) < RetireCapacity;
+        }
+
+        inline void retire( Entry* entry ) noexcept
+        {
+            const size_t write = m_retireWrite.load( std::memory_order_relaxed );
+            m_retired[write % RetireCapacity] = entry;
+            m_retireWrite.store( write + 1, std::memory_order_release );
+        }
+
+        void collectRetired()
+        {
+            size_t read = m_retireRead.load( std::memory_order_relaxed );
+            while (read != m_retireWrite.load( std::memory_order_acquire ))
+            {
+                delete m_retired[read % RetireCapacity];
+                m_retireRead.store( ++read, std::memory_order_release );
+            }
+        }
+
+        void request( std::function<std::shared_ptr<BaseModel>()> factory )
+        {
+            {
+                std::lock_guard<std::mutex> lock( m_mutex );
+                m_requests.push_back( std::move(factory) );
+            }
+            m_condition.notify_one();
+        }
+
+        void run()
+        {
+            std::unique_lock<std::mutex> lock( m_mutex );
+            while (!m_stop)
+            {
+                m_condition.wait_for( lock, WorkerPeriod, [this] { return m_stop || !m_requests.empty(); } );
+                collectRetired();
+                if (m_stop || m_requests.empty())
+                    continue;
+
+                auto factory = std::move( m_requests.front() );
+                m_requests.pop_front();
+                lock.unlock();
+                publish( factory );
+                lock.lock();
+            }
+        }
+
+        void publish( const std::function<std::shared_ptr<BaseModel>()>& factory )
+        {
+            std::string error;
+            try
+            {
+                auto model = factory();
+                if (!model)
+                    throw std::runtime_error("ModelSlot: unknown model type");
+                if (model->getInChannels() != m_inChannels || model->getOutChannels() != m_outChannels)
+                    throw std::runtime_error("ModelSlot: model channels do not match the slot");
+
+                // Allocate every scratch buffer here rather than on the audio thread
+                model->prepare( m_maxBlockSize );
+                model->resetState();
+
+                // A model published earlier but never picked up is replaced and freed here
+                delete m_pending.exchange( new Entry{ std::move(model) }, std::memory_order_acq_rel );
+            }
+            catch (const std::exception& e)
+            {
+                error = e.what();
+            }
+            std::lock_guard<std::mutex> lock( m_mutex );
+            m_lastError = error;
+        }
+
+        size_t m_inChannels, m_outChannels, m_maxBlockSize, m_crossfadeSamples;
+
+        // Audio thread only
+        Entry* m_current = nullptr;
+        Entry* m_next = nullptr;
+        size_t m_fadePosition = 0;
+        RowMatrixXf m_fadeBuffer;
+
+        // Shared between audio and worker threads
+        std::atomic<Entry*> m_pending{ nullptr };
+        Entry* m_retired[RetireCapacity] = {};
+        std::atomic<size_t> m_retireWrite{ 0 }, m_retireRead{ 0 };
+        std::atomic<size_t> m_swapCount{ 0 };
+
+        // Worker thread
+        mutable std::mutex m_mutex;
+        std::condition_variable m_condition;
+        std::deque<std::function<std::shared_ptr<BaseModel>()>> m_requests;
+        std::string m_lastError;
+        bool m_stop = false;
+        std::thread m_worker;
+    };
+
+}
@@ -0,0 +1,220 @@
+#pragma once
+
+#include <Eigen/Dense>
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#if defined(__AVX512VNNI__) && defined(__AVX512BW__)
+#include <immintrin.h>
+#define NANOFLARE_VNNI
+#endif
+#include "nanoflare/Epilogue.h"
+#include "nanoflare/utils.h"
+
+namespace Nanoflare
+{
+    // Integer inference of the Linear and convolutional layers, see BaseModel::quantize(). Weights
+    // are always int8, the value names the width inputs are quantized to.
+    enum class Quantization { None, Int8, Int16 };
+
+    // y = w x + b as an integer product: symmetric int8 weights with one scale per output channel,
+    // inputs quantized with a single scale from their calibrated range, int32 accumulation and
+    // requantization into float once per output. Depth values are packed by groups of 4 int8 or 2
+    // int16 per 32-bit word, which one AVX-512 VNNI instruction (vpdpbusd, vpdpwssd) multiplies
+    // and adds into the accumulators of 16 time steps. vpdpbusd multiplies unsigned inputs: int8
+    // inputs are stored with a zero point of 128, whose contribution is folded into the bias.
+    // Without VNNI the same integer arithmetic runs as plain loops, exact but not faster than float.
+    class QuantizedGemm
+    {
+    public:
+        static constexpr int Width = 16; // time steps per accumulator
+        static constexpr int Rows = 8;   // output channels per register block
+
+        struct Weights
+        {
+            Quantization mode = Quantization::None;
+            Eigen::Index rows = 0, depth = 0;
+            Eigen::Matrix<int32_t, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> w; // (rows padded to Rows, groups)
+            Eigen::VectorXf scale, bias; // requantization of every output channel
+            float inputScale = 1.f;      // quantized input = round(x * inputScale)
+        };
+
+        static constexpr int groupSize(Quantization mode) noexcept { return mode == Quantization::Int16 ? 2 : 4; }
+        static constexpr Eigen::Index numGroups(Eigen::Index depth, Quantization mode) noexcept { return (depth + groupSize(mode) - 1) / groupSize(mode); }
+        static constexpr Eigen::Index paddedCols(Eigen::Index cols) noexcept { return (cols + Width - 1) / Width * Width; }
+
+        // 32-bit words of packed input for a (depth, cols) x
+        static constexpr Eigen::Index packedSize(Eigen::Index depth, Eigen::Index cols, Quantization mode) noexcept
+        {
+            return numGroups(depth, mode) * paddedCols(cols);
+        }
+
+        // w (rows, depth) and b (rows, or empty) for inputs within +-input_range
+        static Weights quantize(const Eigen::Ref<const RowMatrixXf>& w, const Eigen::Ref<const Eigen::VectorXf>& b, float input_range, Quantization mode)
+        {
+            assert(mode != Quantization::None && (b.size() == 0 || b.size() == w.rows()) && "QuantizedGemm.quantize: Wrong shape");
+            const int group = groupSize(mode);
+            const Eigen::Index groups = numGroups(w.cols(), mode);
+
+            Weights q;
+            q.mode = mode;
+            q.rows = w.rows();
+            q.depth = w.cols();
+            q.w = decltype(q.w)::Zero((w.rows() + Rows - 1) / Rows * Rows, groups);
+            q.scale.resize(w.rows());
+            q.bias = b.size() > 0 ? Eigen::VectorXf(b) : Eigen::VectorXf::Zero(w.rows());
+            q.inputScale = input_range > 0.f ? maxInput(mode) / input_range : 1.f;
+
+            for (Eigen::Index o = 0; o < w.rows(); ++o)
+            {
+                const float max_weight = w.row(o).cwiseAbs().maxCoeff();
+                const float weight_scale = max_weight > 0.f ? max_weight / 127.f : 1.f;
+                int32_t sum = 0;
+                for (Eigen::Index d = 0; d < w.cols(); ++d)
+                {
+                    const int32_t v = static_cast<int32_t>(std::clamp(std::nearbyint(w(o, d) / weight_scale), -127.f, 127.f));
+                    const int shift = (d % group) * (32 / group);
+                    const uint32_t bits = static_cast<uint32_t>(v) & (group == 4 ? 0xffu : 0xffffu);
+                    q.w(o, d / group) = static_cast<int32_t>(static_cast<uint32_t>(q.w(o, d / group)) | (bits << shift));
+                    sum += v;
+                }
+                q.scale(o) = weight_scale / q.inputScale;
+                if (mode == Quantization::Int8)
+                    q.bias(o) -= q.scale(o) * ZeroPoint * sum;
+            }
+            return q;
+        }
+
+        // y = w x + b, or y += w x + b when Accumulate. x is (depth, y.cols()), any expression,
+        // packed is scratch of packedSize() words. The activation, scale and residual of the
+        // epilogue apply to every block of output as it is stored, its bias is ignored for b.
+        template<bool Accumulate = false, typename Derived>
+        static inline void forward(const Weights& q, const Eigen::MatrixBase<Derived>& x, int32_t* packed, Eigen::Ref<RowMatrixXf> y,
+            const Epilogue& epilogue = Epilogue()) noexcept
+        {
+            assert(x.rows() == q.depth && y.rows() == q.rows && y.cols() == x.cols() && "QuantizedGemm.forward: Wrong shape");
+            pack(x, q.inputScale, q.mode, packed);
+            if (q.mode == Quantization::Int8)
+                product<Quantization::Int8, Accumulate>(q, packed, y, epilogue);
+            else
+                product<Quantization::Int16, Accumulate>(q, packed, y, epilogue);
+        }
+
+    private:
+        static constexpr int ZeroPoint = 128;
+
+        static constexpr float maxInput(Quantization mode) noexcept { return mode == Quantization::Int16 ? 32767.f : 127.f; }
+
+        // Word (g, t) of the packed input holds x(g * group + i, t) in its bits [i * 32 / group, (i + 1) * 32 / group)
+        template<typename Derived>
+        static inline void pack(const Eigen::MatrixBase<Derived>& x, float scale, Quantization mode, int32_t* packed) noexcept
+        {
+            using Words = Eigen::Array<uint32_t, 1, Eigen::Dynamic>;
+            const int group = groupSize(mode);
+            const Eigen::Index cols = x.cols(), stride = paddedCols(cols);
+            const float max_input = maxInput(mode);
+            for (Eigen::Index g = 0; g < numGroups(x.rows(), mode); ++g)
+            {
+                Eigen::Map<Words> words(reinterpret_cast<uint32_t*>(packed) + g * stride, stride);
+                words.setZero();
+                for (int i = 0; i < group && g * group + i < x.rows(); ++i)
+                {
+                    const auto v = (x.row(g * group + i).array() * scale).rint().cwiseMax(-max_input).cwiseMin(max_input).template cast<int32_t>();
+                    if (mode == Quantization::Int8)
+                        words.head(cols) += (v + ZeroPoint).template cast<uint32_t>() * (1u << (8 * i));
+                    else if (i == 0)
+                        words.head(cols) += v.template cast<uint32_t>().template shiftLeft<16>().template shiftRight<16>();
+                    else
+                        words.head(cols) += v.template cast<uint32_t>().template shiftLeft<16>();
+                }
+            }
+        }
+
+        template<Quantization Mode, bool Accumulate>
+        static inline void product(const Weights& q, const int32_t* packed, Eigen::Ref<RowMatrixXf> y, const Epilogue& epilogue) noexcept
+        {
+            const Eigen::Index groups = q.w.cols(), cols = y.cols(), stride = paddedCols(cols);
+            const bool finishes = epilogue.finishes();
+            for (Eigen::Index o = 0; o < q.rows; o += Rows)
+                for (Eigen::Index t = 0; t < cols; t += Width)
+                {
+                    block<Mode, Accumulate>(q, q.w.data() + o * groups, groups, packed + t, stride, o, t, y);
+                    if (finishes)
+                    {
+                        // The block was just stored and is still in L1
+                        const Eigen::Index rows = std::min<Eigen::Index>(Rows, q.rows - o), lanes = std::min<Eigen::Index>(Width, cols - t);
+                        for (Eigen::Index r = 0; r < rows; ++r)
+                            epilogue.finish(Eigen::Map<Eigen::Array<float, 1, Eigen::Dynamic>>(y.data() + (o + r) * y.outerStride() + t, lanes), o + r, t);
+                    }
+                }
+        }
+
+        // Output channels [o, o + Rows) by time steps [t, t + Width), rows and time steps past
+        // the end of y are computed on padding and not stored
+        template<Quantization Mode, bool Accumulate>
+        static inline void block(const Weights& q, const int32_t* w, Eigen::Index groups, const int32_t* x, Eigen::Index stride,
+            Eigen::Index o, Eigen::Index t, Eigen::Ref<RowMatrixXf>& y) noexcept
+        {
+            const int rows = static_cast<int>(std::min<Eigen::Index>(Rows, q.rows - o));
+            const int lanes = static_cast<int>(std::min<Eigen::Index>(Width, y.cols() - t));
+#ifdef NANOFLARE_VNNI
+            __m512i acc[Rows];
+            for (int r = 0; r < Rows; ++r)
+                acc[r] = _mm512_setzero_si512();
+            for (Eigen::Index g = 0; g < groups; ++g)
+            {
+                const __m512i input = _mm512_loadu_si512(x + g * stride);
+                for (int r = 0; r < Rows; ++r)
+                {
+                    const __m512i weights = _mm512_set1_epi32(w[r * groups + g]);
+                    if constexpr (Mode == Quantization::Int8)
+                        acc[r] = _mm512_dpbusd_epi32(acc[r], input, weights);
+                    else
+                        acc[r] = _mm512_dpwssd_epi32(acc[r], input, weights);
+                }
+            }
+
+            const __mmask16 mask = static_cast<__mmask16>((1u << lanes) - 1);
+            for (int r = 0; r < rows; ++r)
+            {
+                float* out = y.data() + (o + r) * y.outerStride() + t;
+                __m512 v = _mm512_fmadd_ps(_mm512_cvtepi32_ps(acc[r]), _mm512_set1_ps(q.scale(o + r)), _mm512_set1_ps(q.bias(o + r)));
+                if constexpr (Accumulate)
+                    v = _mm512_add_ps(v, _mm512_maskz_loadu_ps(mask, out));
+                _mm512_mask_storeu_ps(out, mask, v);
+            }
+#else
+            int32_t acc[Rows][Width] = {};
+            for (Eigen::Index g = 0; g < groups; ++g)
+                for (int r = 0; r < Rows; ++r)
+                    for (int l = 0; l < Width; ++l)
+                        acc[r][l] += dot<Mode>(static_cast<uint32_t>(x[g * stride + l]), static_cast<uint32_t>(w[r * groups + g]));
+
+            for (int r = 0; r < rows; ++r)
+                for (int l = 0; l < lanes; ++l)
+                {
+                    float& out = y(o + r, t + l);
+                    const float v = static_cast<float>(acc[r][l]) * q.scale(o + r) + q.bias(o + r);
+                    out = Accumulate ? out + v : v;
+                }
+#endif
+        }
+
+#ifndef NANOFLARE_VNNI
+        // Unsigned int8 by signed int8, or int16 by int16, dot product of the values in two words
+        template<Quantization Mode>
+        static inline int32_t dot(uint32_t input, uint32_t weights) noexcept
+        {
+            int32_t sum = 0;
+            if constexpr (Mode == Quantization::Int8)
+                for (int i = 0; i < 4; ++i)
+                    sum += static_cast<int32_t>((input >> (8 * i)) & 0xffu) * static_cast<int8_t>((weights >> (8 * i)) & 0xffu);
+            else
+                for (int i = 0; i < 2; ++i)
+                    sum += static_cast<int16_t>((input >> (16 * i)) & 0xffffu) * static_cast<int16_t>((weights >> (16 * i)) & 0xffffu);
+            return sum;
+        }
+#endif
+    };
+}
@@ -0,0 +1,160 @@
+#pragma once
+
+#include <Eigen/Dense>
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <vector>
+#include "nanoflare/utils.h"
+
+namespace Nanoflare
+{
+    // Contiguous scratch memory of a model, shared by every layer through a ScratchPlanner
+    class ScratchArena
+    {
+    public:
+        ScratchArena() = default;
+        ~ScratchArena() = default;
+
+        // Copies (and so cloned models) start empty, their buffers are planned again by prepare()
+        ScratchArena(const ScratchArena&) {}
+        ScratchArena& operator=(const ScratchArena&) { return *this; }
+
+        // Bytes of the arena, and of all its buffers if none shared memory
+        size_t getSize() const { return static_cast<size_t>(m_data.size()) * sizeof(float); }
+        size_t getUnsharedSize() const { return m_unsharedSize * sizeof(float); }
+
+    private:
+        friend class ScratchPlanner;
+
+        Eigen::VectorXf m_data;
+        size_t m_unsharedSize = 0;
+    };
+
+    // Scratch tensor of a layer. Once planned it is a slice of the model's ScratchArena,
+    // otherwise (or for blocks larger than planned) it uses its own grow-only storage.
+    // Contents never survive from one forward() call to the next.
+    class ScratchBuffer
+    {
+    public:
+        ScratchBuffer() = default;
+        ~ScratchBuffer() = default;
+
+        // Copies are unplanned: the copy of a slice would alias the original model's arena
+        ScratchBuffer(const ScratchBuffer&) {}
+        ScratchBuffer& operator=(const ScratchBuffer&) { m_data = nullptr; m_capacity = 0; return *this; }
+
+        inline Eigen::Map<RowMatrixXf> view(Eigen::Index rows, Eigen::Index cols)
+        {
+            if (m_data != nullptr && rows * cols <= m_capacity)
+                return Eigen::Map<RowMatrixXf>(m_data, rows, cols);
+            return scratchView(m_storage, rows, cols);
+        }
+
+        // The same memory as size 32-bit integers, see QuantizedGemm
+        inline int32_t* words(Eigen::Index size)
+        {
+            static_assert(sizeof(int32_t) == sizeof(float), "ScratchBuffer: Words do not have the size of a float");
+            return reinterpret_cast<int32_t*>(view(1, size).data());
+        }
+
+    private:
+        friend class ScratchPlanner;
+
+        float* m_data = nullptr;
+        Eigen::Index m_capacity = 0;
+        RowMatrixXf m_storage;
+    };
+
+    // Assigns the scratch buffers of a model to a single arena from their lifetimes.
+    // Layers declare their buffers in plan(), in the order forward() uses them: a
+    // buffer is live from acquire() to release(), and buffers whose lifetimes do not
+    // overlap may share memory. bind() then places the largest buffers first, each at
+    // the lowest offset free of every overlapping buffer already placed.
+    class ScratchPlanner
+    {
+    public:
+        ScratchPlanner() = default;
+        ~ScratchPlanner() = default;
+
+        void acquire(ScratchBuffer& buffer, size_t size)
+        {
+            m_requests.push_back( Request{ &buffer, roundUp(size), m_time, NotReleased, 0 } );
+            ++m_time;
+        }
+
+        void release(ScratchBuffer& buffer)
+        {
+            for (auto it = m_requests.rbegin(); it != m_requests.rend(); ++it)
+                if (it->buffer == &buffer && it->last == NotReleased)
+                {
+                    it->last = m_time++;
+                    return;
+                }
+            assert(false && "ScratchPlanner.release: Buffer was not acquired");
+        }
+
+        // Solves the offsets, sizes the arena and points every planned buffer into it
+        void bind(ScratchArena& arena)
+        {
+            std::vector<size_t> order( m_requests.size() );
+            for (size_t i = 0; i < order.size(); ++i)
+                order[i] = i;
+            std::stable_sort( order.begin(), order.end(), [this](size_t a, size_t b) { return m_requests[a].size > m_requests[b].size; } );
+
+            size_t arena_size = 0, unshared_size = 0;
+            std::vector<size_t> placed, overlapping;
+            for (size_t i: order)
+            {
+                auto& request = m_requests[i];
+                overlapping.clear();
+                for (size_t j: placed)
+                    if (overlap( request, m_requests[j] ))
+                        overlapping.push_back( j );
+                std::sort( overlapping.begin(), overlapping.end(), [this](size_t a, size_t b) { return m_requests[a].offset < m_requests[b].offset; } );
+
+                // First gap large enough between the live buffers, sorted by offset
+                size_t offset = 0;
+                for (size_t j: overlapping)
+                {
+                    if (offset + request.size <= m_requests[j].offset)
+                        break;
+                    offset = std::max( offset, m_requests[j].offset + m_requests[j].size );
+                }
+                request.offset = offset;
+                placed.push_back( i );
+                arena_size = std::max( arena_size, offset + request.size );
+                unshared_size += request.size;
+            }
+
+            arena.m_data = Eigen::VectorXf::Zero( arena_size );
+            arena.m_unsharedSize = unshared_size;
+            for (const auto& request: m_requests)
+            {
+                request.buffer->m_data = arena.m_data.data() + request.offset;
+                request.buffer->m_capacity = static_cast<Eigen::Index>( request.size );
+            }
+        }
+
+    private:
+        static constexpr size_t NotReleased = static_cast<size_t>(-1);
+        static constexpr size_t Alignment = 16; // floats, one cache line
+
+        struct Request
+        {
+            ScratchBuffer* buffer;
+            size_t size, first, last, offset;
+        };
+
+        static size_t roundUp(size_t size) { return (size + Alignment - 1) / Alignment * Alignment; }
+
+        // Buffers never released stay live until the end of the plan
+        static bool overlap(const Request& a, const Request& b)
+        {
+            return a.first <= b.last && b.first <= a.last;
+        }
+
+        std::vector<Request> m_requests;
+        size_t m_time = 0;
+    };
+}
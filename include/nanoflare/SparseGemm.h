@@ -0,0 +1,91 @@
+#pragma once
+
+#include <Eigen/Dense>
+#include <cassert>
+#include "nanoflare/Epilogue.h"
+#include "nanoflare/utils.h"
+
+namespace Nanoflare
+{
+    // y = w x + b for a sparse w (pruned weights) as compressed rows: every non-zero weight adds
+    // one row of x to its output row, Width time steps at a time in registers. Only faster than
+    // the dense product from SparseThreshold zeros and over whole blocks of Width time steps:
+    // 1.3-2.4x at 70% zeros and 3.5-6x at 90% for 32 to 128 channels, slower on single samples.
+    class SparseGemm
+    {
+    public:
+        static constexpr int Width = 64; // time steps per accumulator
+        static constexpr double SparseThreshold = 0.7;
+
+        struct Weights
+        {
+            Eigen::VectorXf values;  // non-zero weights, row after row
+            Eigen::VectorXi columns; // their columns
+            Eigen::VectorXi offsets; // row o is [offsets(o), offsets(o + 1)), empty when w is stored dense
+            Eigen::VectorXf bias;
+
+            bool empty() const noexcept { return offsets.size() == 0; }
+        };
+
+        static double sparsity(const Eigen::Ref<const RowMatrixXf>& w) noexcept
+        {
+            return w.size() > 0 ? static_cast<double>((w.array() == 0.f).count()) / static_cast<double>(w.size()) : 0.0;
+        }
+
+        // w (rows, depth) and b (rows, or empty)
+        static Weights sparsify(const Eigen::Ref<const RowMatrixXf>& w, const Eigen::Ref<const Eigen::VectorXf>& b)
+        {
+            assert((b.size() == 0 || b.size() == w.rows()) && "SparseGemm.sparsify: Wrong shape");
+            Weights s;
+            const Eigen::Index count = (w.array() != 0.f).count();
+            s.values.resize(count);
+            s.columns.resize(count);
+            s.offsets.resize(w.rows() + 1);
+            s.bias = b.size() > 0 ? Eigen::VectorXf(b) : Eigen::VectorXf::Zero(w.rows());
+
+            int k = 0;
+            for (Eigen::Index o = 0; o < w.rows(); ++o)
+            {
+                s.offsets(o) = k;
+                for (Eigen::Index d = 0; d < w.cols(); ++d)
+                    if (w(o, d) != 0.f)
+                    {
+                        s.values(k) = w(o, d);
+                        s.columns(k++) = static_cast<int>(d);
+                    }
+            }
+            s.offsets(w.rows()) = k;
+            return s;
+        }
+
+        // x (depth, cols) with cols a multiple of Width. The activation, scale and residual of the
+        // epilogue apply to the accumulators, its bias is ignored for the one of the weights.
+        static inline void forward(const Weights& s, const Eigen::Ref<const RowMatrixXf>& x, Eigen::Ref<RowMatrixXf> y,
+            const Epilogue& epilogue = Epilogue()) noexcept
+        {
+            assert(y.rows() == s.bias.size() && y.cols() == x.cols() && x.cols() % Width == 0 && "SparseGemm.forward: Wrong shape");
+            using Chunk = Eigen::Array<float, 1, Width>;
+            const bool finishes = epilogue.finishes();
+            // Every output row reads the same Width columns of x, that stay in cache
+            for (Eigen::Index t = 0; t < x.cols(); t += Width)
+                for (Eigen::Index o = 0; o < y.rows(); ++o)
+                {
+                    // Two accumulators over even and odd weights keep enough FMAs in flight
+                    Chunk even = Chunk::Constant(s.bias(o)), odd = Chunk::Zero();
+                    int k = s.offsets(o);
+                    const int end = s.offsets(o + 1);
+                    for (; k + 2 <= end; k += 2)
+                    {
+                        even += s.values(k) * Eigen::Map<const Chunk>(x.data() + s.columns(k) * x.outerStride() + t);
+                        odd += s.values(k + 1) * Eigen::Map<const Chunk>(x.data() + s.columns(k + 1) * x.outerStride() + t);
+                    }
+                    if (k < end)
+                        even += s.values(k) * Eigen::Map<const Chunk>(x.data() + s.columns(k) * x.outerStride() + t);
+                    even += odd;
+                    if (finishes)
+                        epilogue.finish(even, o, t);
+                    Eigen::Map<Chunk>(y.data() + o * y.outerStride() + t) = even;
+                }
+        }
+    };
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <Eigen/Dense>
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#ifdef __F16C__
+#include <immintrin.h>
+#endif
+#include "nanoflare/utils.h"
+
+namespace Nanoflare
+{
+    // Precision layer weights are stored at, see BaseModel::setWeightPrecision(). The reduced
+    // ones halve the memory and the memory traffic of the weights: a layer widens its weights
+    // to float right before using them (F16C when the target has it, integer operations for
+    // bfloat16) into scratch memory that all the layers of a model share and so keep in cache,
+    // and computes in float from there. Relative rounding error of a weight:
+    //  - Float32:  6e-8
+    //  - Float16:  5e-4, overflows beyond 65504 and loses precision below 6e-5
+    //  - BFloat16: 4e-3, same range as float
+    enum class WeightPrecision { Float32, Float16, BFloat16 };
+
+    typedef Eigen::Matrix<Eigen::half, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> RowMatrixXh;
+    typedef Eigen::Matrix<Eigen::bfloat16, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> RowMatrixXbf;
+
+    // Reduced precision copy of a float weight matrix w, that is freed while the copy is in use.
+    // Kept next to w in the layer's SharedWeights.
+    struct ReducedWeights
+    {
+        WeightPrecision precision = WeightPrecision::Float32;
+        RowMatrixXh f16;
+        RowMatrixXbf bf16;
+
+        bool isReduced() const noexcept { return precision != WeightPrecision::Float32; }
+
+        // Stores w at another precision. Widening back to Float32 does not restore the bits
+        // that narrowing dropped.
+        void convert(RowMatrixXf& w, WeightPrecision to)
+        {
+            if (to == precision)
+                return;
+            if (precision == WeightPrecision::Float16)
+                w = f16.cast<float>();
+            else if (precision == WeightPrecision::BFloat16)
+                w = bf16.cast<float>();
+            f16.resize(0, 0);
+            bf16.resize(0, 0);
+
+            if (to == WeightPrecision::Float16)
+                f16 = w.cast<Eigen::half>();
+            else if (to == WeightPrecision::BFloat16)
+                bf16 = w.cast<Eigen::bfloat16>();
+            if (to != WeightPrecision::Float32)
+                w.resize(0, 0);
+            precision = to;
+        }
+
+        // Float copy of the reduced weights, into out of the same shape
+        inline void widen(Eigen::Ref<RowMatrixXf> out) const noexcept
+        {
+            assert(out.rows() == f16.rows() + bf16.rows() && out.cols() == f16.cols() + bf16.cols() && "ReducedWeights.widen: Wrong output shape");
+            if (precision == WeightPrecision::Float16)
+                widen(f16.data(), out.data(), f16.size());
+            else if (precision == WeightPrecision::BFloat16)
+                widen(bf16.data(), out.data(), bf16.size());
+        }
+
+        // Eigen casts half and bfloat16 one element at a time
+        static inline void widen(const Eigen::half* in, float* out, Eigen::Index size) noexcept
+        {
+            Eigen::Index i = 0;
+#ifdef __F16C__
+            for (; i + 8 <= size; i += 8)
+                _mm256_storeu_ps(out + i, _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i))));
+#endif
+            for (; i < size; ++i)
+                out[i] = static_cast<float>(in[i]);
+        }
+
+        static inline void widen(const Eigen::bfloat16* in, float* out, Eigen::Index size) noexcept
+        {
+            // A bfloat16 is the upper half of a float, this loop vectorises
+            const uint16_t* bits = reinterpret_cast<const uint16_t*>(in);
+            for (Eigen::Index i = 0; i < size; ++i)
+            {
+                const uint32_t value = static_cast<uint32_t>(bits[i]) << 16;
+                std::memcpy(out + i, &value, sizeof(float));
+            }
+        }
+
+        // Bytes of the weights, w included
+        size_t getSize(const RowMatrixXf& w) const noexcept
+        {
+            return w.size() * sizeof(float) + f16.size() * sizeof(Eigen::half) + bf16.size() * sizeof(Eigen::bfloat16);
+        }
+    };
+}
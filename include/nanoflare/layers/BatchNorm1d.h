@@ -12,19 +12,20 @@ namespace Nanoflare
         EIGEN_MAKE_ALIGNED_OPERATOR_NEW
         
         BatchNorm1d(size_t num_channels) : 
-            m_numChannels(num_channels), m_w(Eigen::RowVectorXf::Ones(num_channels)), m_b(Eigen::RowVectorXf::Zero(num_channels)),
-            m_runningMean(Eigen::RowVectorXf::Zero(num_channels)), m_runningVar(Eigen::RowVectorXf::Ones(num_channels)),
-            m_factor(Eigen::RowVectorXf::Ones(num_channels)), m_bias(Eigen::RowVectorXf::Zero(num_channels))
+            m_numChannels(num_channels),
+            m_weights(Weights{ Eigen::RowVectorXf::Ones(num_channels), Eigen::RowVectorXf::Zero(num_channels),
+                Eigen::RowVectorXf::Zero(num_channels), Eigen::RowVectorXf::Ones(num_channels),
+                Eigen::RowVectorXf::Ones(num_channels), Eigen::RowVectorXf::Zero(num_channels) })
         {}
         ~BatchNorm1d() = default;
 
         inline void apply( Eigen::Ref<RowMatrixXf> x ) noexcept
         {
-            x.array().colwise() *= m_factor.transpose().eval().array();
-            x.array().colwise() += m_bias.transpose().eval().array();
+            x.array().colwise() *= m_weights->factor.transpose().array();
+            x.array().colwise() += m_weights->bias.transpose().array();
         }
 
-        void loadStateDict(std::map<std::string, nlohmann::json> state_dict)
+        void loadStateDict(const nlohmann::json& state_dict)
         {
             auto w = loadVector( std::string("weight"), state_dict );
             setWeight( w );
@@ -35,38 +36,49 @@ namespace Nanoflare
             auto running_var = loadVector( std::string("running_var"), state_dict );
             setRunningVar( running_var );
 
-            m_factor.array() = m_w.array() / (m_runningVar.array() + 1e-5).sqrt();
-            m_bias.array() = m_b.array() - m_runningMean.array() * m_factor.array();
+            auto& bn = m_weights.edit();
+            bn.factor.array() = bn.w.array() / (bn.runningVar.array() + 1e-5).sqrt();
+            bn.bias.array() = bn.b.array() - bn.runningMean.array() * bn.factor.array();
         }
 
+        // apply() is x * scale + shift per channel, that a preceding layer can fold into its
+        // weights instead (see CausalDilatedConv1d::foldAffine())
+        const Eigen::RowVectorXf& getScale() const { return m_weights->factor; }
+        const Eigen::RowVectorXf& getShift() const { return m_weights->bias; }
+
     private:
         
         void setRunningMean(const Eigen::Ref<Eigen::RowVectorXf>& v)
         {
             assert(v.size() == m_numChannels);
-            m_runningMean = v;
+            m_weights.edit().runningMean = v;
         }
 
         void setRunningVar(const Eigen::Ref<Eigen::RowVectorXf>& v)
         {
             assert(v.size() == m_numChannels);
-            m_runningVar= v;
+            m_weights.edit().runningVar = v;
         }
 
         void setWeight(const Eigen::Ref<Eigen::RowVectorXf>& v)
         {
             assert(v.size() == m_numChannels);
-            m_w = v;
+            m_weights.edit().w = v;
         }
 
         void setBias(const Eigen::Ref<Eigen::RowVectorXf>& v)
         {
             assert(v.size() == m_numChannels);
-            m_b = v;
+            m_weights.edit().b = v;
         }
 
+        struct Weights
+        {
+            Eigen::RowVectorXf w, b, runningMean, runningVar, factor, bias;
+        };
+
         size_t m_numChannels;
-        Eigen::RowVectorXf m_w, m_b, m_runningMean, m_runningVar, m_factor, m_bias;
+        SharedWeights<Weights> m_weights;
     };
 
 }
\ No newline at end of file
@@ -2,55 +2,49 @@
 
 #include <Eigen/Dense>
 #include <nlohmann/json.hpp>
+#include "nanoflare/layers/BiquadCascade.h"
 #include "nanoflare/utils.h"
 
 namespace Nanoflare
 {
+    // Single second-order section, see BiquadCascade for the filter itself
     class Biquad
     {
     public:
         EIGEN_MAKE_ALIGNED_OPERATOR_NEW
 
-        Biquad() : m_b0(1.0f), m_b1(0.0f), m_b2(0.0f), m_a1(0.0f), m_a2(0.0f) {}
+        Biquad() : m_cascade(1) {}
         ~Biquad() = default;
 
         inline void forward(const Eigen::Ref<const RowMatrixXf>& x, Eigen::Ref<RowMatrixXf> y) noexcept
         {
             assert(x.rows() == y.rows() && x.cols() == y.cols() && "Biquad.forward: Input and output must have same shape");
 
-            const size_t channels = x.rows();
-            const size_t samples = x.cols();
-
-            // Apply biquad filter to each channel independently
-            // Using Direct Form II Transposed
-            for (size_t ch = 0; ch < channels; ++ch)
-            {
-                float z1 = 0.0f;
-                float z2 = 0.0f;
-
-                for (size_t n = 0; n < samples; ++n)
-                {
-                    float input = x(ch, n);
-                    y(ch, n) = m_b0 * input + z1;
-                    z1 = m_b1 * input + z2 - m_a1 * y(ch, n);
-                    z2 = m_b2 * input - m_a2 * y(ch, n);
-                }
-            }
+            // Direct Form II Transposed, the state of every channel is kept across calls
+            m_cascade.forward(x, y);
         }
 
-        void loadStateDict(std::map<std::string, nlohmann::json> state_dict)
+        // Block state-space evaluation for long offline buffers, see BiquadCascade::forwardOffline
+        void forwardOffline(const Eigen::Ref<const RowMatrixXf>& x, Eigen::Ref<RowMatrixXf> y, Eigen::Index block_size = 32, unsigned num_threads = 1)
+        {
+            m_cascade.forwardOffline(x, y, block_size, num_threads);
+        }
+
+        void prepare(size_t max_block_size, size_t channels = 1) { m_cascade.prepare(max_block_size, channels); }
+
+        void resetState() { m_cascade.resetState(); }
+
+        // Samples until the impulse response decays below threshold (-60 dB by default),
+        // from the largest pole radius. Unstable filters have no finite tail.
+        size_t getTailLength(float threshold = 1e-3f) const { return m_cascade.getSectionTailLength(0, threshold); }
+
+        void loadStateDict(const nlohmann::json& state_dict)
         {
             // Load precomputed biquad coefficients
-            state_dict.at("b0").get_to(m_b0);
-            state_dict.at("b1").get_to(m_b1);
-            state_dict.at("b2").get_to(m_b2);
-            state_dict.at("a1").get_to(m_a1);
-            state_dict.at("a2").get_to(m_a2);
+            m_cascade.loadSection(0, state_dict);
         }
 
     private:
-        // Biquad coefficients
-        float m_b0, m_b1, m_b2;  // Numerator coefficients
-        float m_a1, m_a2;         // Denominator coefficients (a0 = 1.0 is implicit)
+        BiquadCascade m_cascade;
     };
 }
@@ -0,0 +1,341 @@
+#pragma once
+
+#include <Eigen/Dense>
+#include <nlohmann/json.hpp>
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <limits>
+#include <thread>
+#include <vector>
+#include "nanoflare/utils.h"
+
+namespace Nanoflare
+{
+    // Cascade of second-order sections (Direct Form II Transposed). The filter state of
+    // every channel is kept across calls. Channels are filtered in SIMD lanes of 16, 8
+    // and 4 channels over a time-major copy of the input, the remaining ones one by one.
+    class BiquadCascade
+    {
+    public:
+        EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+        BiquadCascade(size_t num_sections = 1) : m_coefs(Coefficients::Zero(5, num_sections))
+        {
+            m_coefs.row(0).setOnes(); // identity sections
+        }
+        ~BiquadCascade() = default;
+
+        inline void forward(const Eigen::Ref<const RowMatrixXf>& x, Eigen::Ref<RowMatrixXf> y) noexcept
+        {
+            assert(x.rows() == y.rows() && x.cols() == y.cols() && "BiquadCascade.forward: Input and output must have same shape");
+
+            const Eigen::Index channels = x.rows();
+            const Eigen::Index samples = x.cols();
+            initState(channels);
+
+            const Eigen::Index lane_channels = channels - channels % 4;
+            if (lane_channels > 0)
+            {
+                auto buffer = scratchView(m_buffer, samples, lane_channels);
+                buffer.noalias() = x.topRows(lane_channels).transpose();
+
+                Eigen::Index ch = 0;
+                for (; ch + 16 <= lane_channels; ch += 16)
+                    processLanes<16>(buffer, ch);
+                for (; ch + 8 <= lane_channels; ch += 8)
+                    processLanes<8>(buffer, ch);
+                for (; ch + 4 <= lane_channels; ch += 4)
+                    processLanes<4>(buffer, ch);
+
+                y.topRows(lane_channels).noalias() = buffer.transpose();
+            }
+
+            for (Eigen::Index ch = lane_channels; ch < channels; ++ch)
+                processRow(x.row(ch), y.row(ch), ch);
+        }
+
+        // Offline evaluation of long buffers. Each section is written in state-space form
+        // and computed on blocks of block_size samples with matrix products:
+        //   y_block = T x_block + O s,  s' = A^block_size s + R x_block
+        // where T is the lower-triangular Toeplitz matrix of the impulse response. Only the
+        // two state values are carried serially from one block to the next, so the work
+        // runs at GEMM throughput. The products are split by ranges of blocks across
+        // num_threads threads (0 for every hardware thread), the serial state scan between
+        // them stays on the calling thread. Shares its state with forward() and matches it
+        // within float rounding. Allocates, not to be called on the audio thread.
+        void forwardOffline(const Eigen::Ref<const RowMatrixXf>& x, Eigen::Ref<RowMatrixXf> y, Eigen::Index block_size = 32, unsigned num_threads = 1)
+        {
+            assert(x.rows() == y.rows() && x.cols() == y.cols() && "BiquadCascade.forwardOffline: Input and output must have same shape");
+            assert(block_size > 0);
+
+            const Eigen::Index channels = x.rows();
+            const Eigen::Index blocks = x.cols() / block_size;
+            const Eigen::Index blocked = blocks * block_size;
+            initState(channels);
+            if (x.data() != y.data())
+                y = x;
+
+            std::vector<BlockSection> sections;
+            for (Eigen::Index s = 0; s < m_coefs.cols(); ++s)
+                sections.push_back(blockSection(s, block_size));
+
+            // Threads only get ranges long enough to outweigh their start
+            if (num_threads == 0)
+                num_threads = std::max(1u, std::thread::hardware_concurrency());
+            const Eigen::Index ranges = std::max<Eigen::Index>(1, std::min<Eigen::Index>(num_threads, blocks / MinThreadBlocks));
+
+            Eigen::MatrixXf zero_state(2, blocks), start_state(2, blocks), output(block_size, blocks);
+            for (Eigen::Index ch = 0; ch < channels; ++ch)
+            {
+                // Column k holds samples [k * block_size, (k + 1) * block_size) of the channel
+                Eigen::Map<Eigen::MatrixXf> data(y.row(ch).data(), block_size, blocks);
+                if (blocks > 0 && !sections.empty())
+                    forRanges(blocks, ranges, [&](Eigen::Index k, Eigen::Index n) {
+                        zero_state.middleCols(k, n).noalias() = sections[0].R * data.middleCols(k, n);
+                    });
+
+                for (Eigen::Index s = 0; s < m_coefs.cols(); ++s)
+                {
+                    const auto& section = sections[s];
+                    Eigen::Vector2f state(m_z1(s, ch), m_z2(s, ch));
+                    if (blocks > 0)
+                    {
+                        for (Eigen::Index k = 0; k < blocks; ++k)
+                        {
+                            start_state.col(k) = state;
+                            state = section.AL * state + zero_state.col(k);
+                        }
+                        // Outputs of the section, then the zero-state responses of the next one to them
+                        forRanges(blocks, ranges, [&](Eigen::Index k, Eigen::Index n) {
+                            auto block_output = output.middleCols(k, n);
+                            auto block_data = data.middleCols(k, n);
+                            // A dense product is faster than Eigen's triangular one at these sizes
+                            block_output.noalias() = section.T * block_data;
+                            block_output.noalias() += section.O * start_state.middleCols(k, n);
+                            block_data = block_output;
+                            if (s + 1 < m_coefs.cols())
+                                zero_state.middleCols(k, n).noalias() = sections[s + 1].R * block_data;
+                        });
+                    }
+                    m_z1(s, ch) = state(0);
+                    m_z2(s, ch) = state(1);
+                }
+                if (blocked < x.cols())
+                {
+                    auto tail = y.row(ch).tail(x.cols() - blocked);
+                    processRow(tail, tail, ch);
+                }
+            }
+        }
+
+        // Allocates the state and workspace for blocks of up to max_block_size samples of channels
+        void prepare(size_t max_block_size, size_t channels)
+        {
+            initState(channels);
+            reserveScratch(m_buffer, max_block_size, channels - channels % 4);
+        }
+
+        void resetState()
+        {
+            m_z1.setZero();
+            m_z2.setZero();
+        }
+
+        size_t getNumSections() const { return m_coefs.cols(); }
+
+        // Sum of the tail lengths of every section, see getSectionTailLength
+        size_t getTailLength(float threshold = 1e-3f) const
+        {
+            size_t tail = 0;
+            for (Eigen::Index s = 0; s < m_coefs.cols(); ++s)
+            {
+                const size_t section_tail = getSectionTailLength(s, threshold);
+                if (section_tail == std::numeric_limits<size_t>::max())
+                    return section_tail;
+                tail += section_tail;
+            }
+            return tail;
+        }
+
+        // Samples until the impulse response of a section decays below threshold (-60 dB by
+        // default), from its largest pole radius. Unstable sections have no finite tail.
+        size_t getSectionTailLength(size_t section, float threshold = 1e-3f) const
+        {
+            const float a1 = m_coefs(3, section), a2 = m_coefs(4, section);
+
+            // Poles are the roots of z^2 + a1 z + a2
+            const float discriminant = a1 * a1 - 4.f * a2;
+            float radius;
+            if (discriminant < 0.f)
+                radius = std::sqrt(a2); // complex conjugate pair
+            else
+            {
+                const float root = std::sqrt(discriminant);
+                radius = 0.5f * std::max(std::abs(-a1 + root), std::abs(-a1 - root));
+            }
+
+            if (radius >= 1.f)
+                return std::numeric_limits<size_t>::max();
+            if (radius <= 0.f)
+                return 3; // FIR, three taps
+            return static_cast<size_t>(std::ceil(std::log(threshold) / std::log(radius))) + 3;
+        }
+
+        // Precomputed coefficients of one section {"b0", "b1", "b2", "a1", "a2"}, a0 = 1
+        void loadSection(size_t section, const nlohmann::json& state_dict)
+        {
+            assert(section < (size_t)m_coefs.cols());
+            state_dict.at("b0").get_to(m_coefs(0, section));
+            state_dict.at("b1").get_to(m_coefs(1, section));
+            state_dict.at("b2").get_to(m_coefs(2, section));
+            state_dict.at("a1").get_to(m_coefs(3, section));
+            state_dict.at("a2").get_to(m_coefs(4, section));
+        }
+
+        // {"sections": [section, ...]}, the number of sections follows the state dict
+        void loadStateDict(const nlohmann::json& state_dict)
+        {
+            const auto& sections = state_dict.at("sections");
+            m_coefs = Coefficients::Zero(5, sections.size());
+            for (size_t s = 0; s < sections.size(); ++s)
+                loadSection(s, sections.at(s));
+            m_z1.resize(0, 0);
+            m_z2.resize(0, 0);
+        }
+
+    private:
+        // Block state-space matrices of one section for the offline mode
+        struct BlockSection
+        {
+            Eigen::MatrixXf T;  // (block_size, block_size), impulse response Toeplitz
+            Eigen::MatrixXf O;  // (block_size, 2), output response to the initial state
+            Eigen::MatrixXf R;  // (2, block_size), final state response to the input
+            Eigen::Matrix2f AL; // state transition over a whole block
+        };
+
+        static constexpr Eigen::Index MinThreadBlocks = 256; // blocks per thread of forwardOffline()
+
+        // fn(first, count) over ranges contiguous ranges of [0, count), the first one on the calling thread
+        template<typename Fn>
+        static void forRanges(Eigen::Index count, Eigen::Index ranges, const Fn& fn)
+        {
+            std::vector<std::thread> threads;
+            for (Eigen::Index r = 1; r < ranges; ++r)
+            {
+                const Eigen::Index first = count * r / ranges, last = count * (r + 1) / ranges;
+                threads.emplace_back([&fn, first, last]() { fn(first, last - first); });
+            }
+            fn(0, count / ranges);
+            for (auto& thread : threads)
+                thread.join();
+        }
+
+        BlockSection blockSection(Eigen::Index s, Eigen::Index block_size) const
+        {
+            // DF2T with state (z1, z2): y = z1 + b0 x, s' = A s + B x. Powers are computed in double.
+            const double b0 = m_coefs(0, s), b1 = m_coefs(1, s), b2 = m_coefs(2, s);
+            const double a1 = m_coefs(3, s), a2 = m_coefs(4, s);
+            Eigen::Matrix2d A;
+            A << -a1, 1.0,
+                 -a2, 0.0;
+            const Eigen::Vector2d B(b1 - a1 * b0, b2 - a2 * b0);
+
+            // powers.col(n) = A^n B, O.row(n) = C A^n with C = (1, 0)
+            Eigen::MatrixXd powers(2, block_size), O(block_size, 2);
+            Eigen::Matrix2d An = Eigen::Matrix2d::Identity();
+            for (Eigen::Index n = 0; n < block_size; ++n)
+            {
+                powers.col(n) = An * B;
+                O.row(n) = An.row(0);
+                An = A * An;
+            }
+
+            // Decayed terms far below float precision are flushed to zero, their products with
+            // the input would otherwise be denormals and slow the products down considerably
+            const double cutoff = 1e-10 * std::max({ 1.0, std::abs(b0), powers.cwiseAbs().maxCoeff() });
+            auto flush = [cutoff](double v) { return std::abs(v) < cutoff ? 0.f : static_cast<float>(v); };
+            powers = powers.unaryExpr(flush).cast<double>();
+
+            BlockSection section;
+            section.T = Eigen::MatrixXf::Zero(block_size, block_size);
+            for (Eigen::Index n = 0; n < block_size; ++n)
+            {
+                section.T(n, n) = static_cast<float>(b0);
+                for (Eigen::Index m = 0; m < n; ++m)
+                    section.T(n, m) = static_cast<float>(powers(0, n - m - 1));
+            }
+            section.O = O.unaryExpr(flush);
+            section.R = powers.rowwise().reverse().cast<float>();
+            section.AL = An.unaryExpr(flush);
+            return section;
+        }
+
+        inline void initState(Eigen::Index channels)
+        {
+            if (m_z1.cols() != channels || m_z1.rows() != m_coefs.cols())
+            {
+                m_z1 = RowMatrixXf::Zero(m_coefs.cols(), channels);
+                m_z2 = RowMatrixXf::Zero(m_coefs.cols(), channels);
+            }
+        }
+
+        using Coefficients = Eigen::Matrix<float, 5, Eigen::Dynamic>; // rows b0, b1, b2, a1, a2
+
+        // Lanes consecutive channels of the time-major buffer filtered in place, one section after the other
+        template<int Lanes>
+        inline void processLanes(Eigen::Map<RowMatrixXf>& buffer, Eigen::Index ch) noexcept
+        {
+            using Lane = Eigen::Array<float, 1, Lanes>;
+
+            for (Eigen::Index s = 0; s < m_coefs.cols(); ++s)
+            {
+                const float b0 = m_coefs(0, s), b1 = m_coefs(1, s), b2 = m_coefs(2, s);
+                const float a1 = m_coefs(3, s), a2 = m_coefs(4, s);
+                Lane z1 = m_z1.row(s).template segment<Lanes>(ch).array();
+                Lane z2 = m_z2.row(s).template segment<Lanes>(ch).array();
+
+                for (Eigen::Index n = 0; n < buffer.rows(); ++n)
+                {
+                    auto io = buffer.row(n).template segment<Lanes>(ch);
+                    const Lane input = io.array();
+                    const Lane output = b0 * input + z1;
+                    z1 = b1 * input + z2 - a1 * output;
+                    z2 = b2 * input - a2 * output;
+                    io = output.matrix();
+                }
+
+                m_z1.row(s).template segment<Lanes>(ch) = z1.matrix();
+                m_z2.row(s).template segment<Lanes>(ch) = z2.matrix();
+            }
+        }
+
+        // One channel, in place or not, with the state of channel ch
+        inline void processRow(const Eigen::Ref<const Eigen::RowVectorXf>& x, Eigen::Ref<Eigen::RowVectorXf> y, Eigen::Index ch) noexcept
+        {
+            for (Eigen::Index s = 0; s < m_coefs.cols(); ++s)
+            {
+                const float b0 = m_coefs(0, s), b1 = m_coefs(1, s), b2 = m_coefs(2, s);
+                const float a1 = m_coefs(3, s), a2 = m_coefs(4, s);
+                float z1 = m_z1(s, ch), z2 = m_z2(s, ch);
+
+                // x may alias y, every sample is read before it is written
+                for (Eigen::Index n = 0; n < x.cols(); ++n)
+                {
+                    const float input = (s == 0) ? x(n) : y(n);
+                    const float output = b0 * input + z1;
+                    z1 = b1 * input + z2 - a1 * output;
+                    z2 = b2 * input - a2 * output;
+                    y(n) = output;
+                }
+
+                m_z1(s, ch) = z1;
+                m_z2(s, ch) = z2;
+            }
+        }
+
+        Coefficients m_coefs;
+        RowMatrixXf m_z1, m_z2;   // (sections, channels), lazily sized on the first call
+        RowMatrixXf m_buffer;     // (samples, lane channels), time-major copy of the input, grow-only
+    };
+}
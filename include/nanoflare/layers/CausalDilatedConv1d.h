@@ -1,91 +1,425 @@
 #pragma once
 
 #include <Eigen/Dense>
+#include <algorithm>
 #include <cassert>
+#include "nanoflare/Activations.h"
+#include "nanoflare/AffineFold.h"
+#include "nanoflare/DirectConv.h"
+#include "nanoflare/Epilogue.h"
+#include "nanoflare/LowRank.h"
+#include "nanoflare/QuantizedGemm.h"
+#include "nanoflare/ScratchArena.h"
+#include "nanoflare/WeightPrecision.h"
 #include "nanoflare/utils.h"
 
 namespace Nanoflare
 {
 
-    class CausalDilatedConv1d
+    // Shapes given as template arguments are known at compile time and unroll the direct
+    // convolution kernel, Eigen::Dynamic ones are only known at run time (see CausalDilatedConv1d)
+    template<int InChannels = Eigen::Dynamic, int OutChannels = Eigen::Dynamic, int KernelSize = Eigen::Dynamic>
+    class CausalDilatedConv1dT
     {
     public:
         EIGEN_MAKE_ALIGNED_OPERATOR_NEW
 
-        CausalDilatedConv1d(size_t in_channels, size_t out_channels, size_t kernel_size, bool bias, size_t dilation) :
+        CausalDilatedConv1dT(size_t in_channels, size_t out_channels, size_t kernel_size, bool bias, size_t dilation) :
             m_inChannels(in_channels), m_outChannels(out_channels),
             m_kernelSize(kernel_size), m_bias(bias), m_dilation(dilation),
-            m_wFused(RowMatrixXf::Zero(out_channels, in_channels * kernel_size)),
-            m_b(Eigen::VectorXf::Zero(out_channels))
-        {}
-        ~CausalDilatedConv1d() = default;
+            m_weights(Weights{ RowMatrixXf::Zero(out_channels, in_channels * kernel_size), Eigen::VectorXf::Zero(out_channels) }),
+            m_history(RowMatrixXf::Zero(in_channels, dilation * (kernel_size - 1))),
+            m_taps(Eigen::VectorXf::Zero(in_channels * kernel_size))
+        {
+            assert(matchesSize(InChannels, in_channels) && matchesSize(OutChannels, out_channels) && matchesSize(KernelSize, kernel_size)
+                && "CausalDilatedConv1d: Shape does not match the template arguments");
+        }
+        ~CausalDilatedConv1dT() = default;
+
+        // Convolution followed by the epilogue, whose bias is the layer's own, see Epilogue
+        inline void forward(const Eigen::Ref<const RowMatrixXf>& x, Eigen::Ref<RowMatrixXf> y, const Epilogue& epilogue = Epilogue()) noexcept
+        {
+            forwardActivated<DirectConv::Activation::None, ActivationPrecision::Exact>(x, y, epilogue);
+        }
 
-        inline void forward(const Eigen::Ref<const RowMatrixXf>& x, Eigen::Ref<RowMatrixXf> y) noexcept
+        // Convolution followed by an activation, see DirectConv::Activation. The direct kernel
+        // applies it to its accumulators, GEMMs as their epilogue or, gated, in a second pass.
+        template<DirectConv::Activation Act>
+        inline void forwardActivated(const Eigen::Ref<const RowMatrixXf>& x, Eigen::Ref<RowMatrixXf> y,
+            ActivationPrecision precision = ActivationPrecision::Exact) noexcept
         {
+            switch (precision)
+            {
+                case ActivationPrecision::Exact:      forwardActivated<Act, ActivationPrecision::Exact>(x, y); break;
+                case ActivationPrecision::Rational:   forwardActivated<Act, ActivationPrecision::Rational>(x, y); break;
+                case ActivationPrecision::Polynomial: forwardActivated<Act, ActivationPrecision::Polynomial>(x, y); break;
+            }
+        }
+
+        // Activations other than None take no epilogue
+        template<DirectConv::Activation Act, ActivationPrecision P>
+        inline void forwardActivated(const Eigen::Ref<const RowMatrixXf>& x, Eigen::Ref<RowMatrixXf> y, const Epilogue& epilogue = Epilogue()) noexcept
+        {
+            constexpr bool gated = Act == DirectConv::Activation::GatedTanh;
             assert(x.rows() == m_inChannels && "CausalDilatedConv1d.forward: Wrong input shape");
-            assert(y.rows() == m_outChannels && y.cols() == x.cols() && "CausalDilatedConv1d.forward: Wrong output shape");
+            assert(y.rows() * (gated ? 2 : 1) == m_outChannels && y.cols() == x.cols() && "CausalDilatedConv1d.forward: Wrong output shape");
+            assert((Act == DirectConv::Activation::None || epilogue.isIdentity()) && "CausalDilatedConv1d.forward: Activation and epilogue");
 
             const int out_len = x.cols();
-            if (m_im2col.rows() != (int)(m_inChannels * m_kernelSize) || m_im2col.cols() != out_len)
-                m_im2col.resize(m_inChannels * m_kernelSize, out_len);
+            if (m_calibrating && out_len > 0)
+                m_inputRange = std::max(m_inputRange, x.cwiseAbs().maxCoeff());
+            const Epilogue biased = (Act == DirectConv::Activation::Tanh ? epilogue.withTanh(P) : epilogue)
+                .withBias(m_bias ? m_weights->b.data() : nullptr);
+            if (isQuantized() || out_len == 1 || m_kernelSize == 1 || useIm2col())
+            {
+                if constexpr (gated)
+                {
+                    auto gates = m_gates.view(m_outChannels, out_len);
+                    forwardGemm(x, gates, biased);
+                    y = Activations::tanh<P>(gates.topRows(y.rows()).array()) * Activations::sigmoid<P>(gates.bottomRows(y.rows()).array());
+                }
+                else
+                    forwardGemm(x, y, biased);
+                return;
+            }
+
+            // [history | x] laid out contiguously: every output reads its taps in place
+            const int left_pad = (int)m_history.cols();
+            auto input = m_input.view(m_inChannels, left_pad + out_len);
+            input.leftCols(left_pad - m_head) = m_history.rightCols(left_pad - m_head);
+            input.middleCols(left_pad - m_head, m_head) = m_history.leftCols(m_head);
+            input.rightCols(out_len) = x;
+            updateHistory(x, out_len);
 
-            buildIm2col(x, out_len);
+            DirectConv::forward<Act, P, InChannels, OutChannels, KernelSize>(weights(), epilogue.withBias(biased.bias), m_kernelSize, m_dilation, input, y);
+        }
 
-            y.noalias() = m_wFused * m_im2col;
-            if (m_bias)
-                y.colwise() += m_b;
+        // Scratch is only live during the call, see ScratchPlanner. Gated forwardActivated() calls
+        // that do not run the direct kernel need all the output channels before gating them.
+        void plan(ScratchPlanner& planner, size_t max_block_size, bool gated = false)
+        {
+            const auto mode = m_weights->quantized.mode;
+            const bool factorized = !m_weights->factors.empty() && mode == Quantization::None;
+            const bool widened = m_weights->reduced.isReduced() && mode == Quantization::None && !factorized;
+            const bool im2col = m_kernelSize > 1 && (mode != Quantization::None || useIm2col());
+            if (widened)
+                planner.acquire(m_widened, m_outChannels * m_inChannels * m_kernelSize);
+            if (gated)
+                planner.acquire(m_gates, m_outChannels * max_block_size);
+            auto& scratch = im2col ? m_im2col : m_input;
+            planner.acquire(scratch, im2col ? m_inChannels * m_kernelSize * max_block_size
+                                            : m_inChannels * (m_history.cols() + max_block_size));
+            if (mode != Quantization::None)
+            {
+                planner.acquire(m_packed, QuantizedGemm::packedSize(m_inChannels * m_kernelSize, max_block_size, mode));
+                planner.release(m_packed);
+            }
+            else if (factorized)
+            {
+                planner.acquire(m_factored, m_weights->factors.rank() * max_block_size);
+                planner.release(m_factored);
+            }
+            planner.release(scratch);
+            if (gated)
+                planner.release(m_gates);
+            if (widened)
+                planner.release(m_widened);
+        }
+
+        // Forget the past input, the next block starts from silence: the input a folded
+        // normalisation takes to 0, see setInputAffine()
+        void resetState()
+        {
+            m_history.setConstant(m_weights->fold.getInputZero());
+            m_head = 0;
         }
 
         size_t getInChannels()  const { return m_inChannels; }
         size_t getOutChannels() const { return m_outChannels; }
         size_t getKernelSize()  const { return m_kernelSize; }
         size_t getDilation()    const { return m_dilation; }
+        size_t getReceptiveField() const { return m_dilation * (m_kernelSize - 1) + 1; }
         bool   useBias()        const { return m_bias; }
 
-        void loadStateDict(std::map<std::string, nlohmann::json> state_dict)
+        // Weights stored at a reduced precision are widened into scratch at every call, plan()
+        // again after changing it. Not real-time safe.
+        void setWeightPrecision(WeightPrecision precision)
         {
-            auto w = loadTensor(std::string("weight"), state_dict);
+            auto& w = m_weights.edit();
+            w.reduced.convert(w.wFused, precision);
+        }
+        WeightPrecision getWeightPrecision() const { return m_weights->reduced.precision; }
+
+        // Bytes of the weights and biases
+        size_t getWeightSize() const
+        {
+            const auto& w = *m_weights;
+            return w.reduced.getSize(w.wFused) + (w.b.size() + w.factors.u.size() + w.factors.v.size()) * sizeof(float) + w.fold.getSize();
+        }
+
+        // While calibrating, forward() records the range of its input that setQuantization()
+        // then quantizes it to. Enabling it forgets the range of the previous calibration.
+        void setCalibration(bool calibrating)
+        {
+            m_calibrating = calibrating;
+            if (calibrating)
+                m_inputRange = 0.f;
+        }
+
+        // Integer inference from the calibrated input range, see QuantizedGemm: single samples,
+        // im2col and pointwise products then all run the integer kernel. Quantization::None
+        // returns to the float weights, that are kept. plan() again after changing it. Not
+        // real-time safe.
+        void setQuantization(Quantization mode)
+        {
+            QuantizedGemm::Weights quantized;
+            if (mode != Quantization::None)
+                quantized = QuantizedGemm::quantize(weights(), m_weights->b, m_inputRange, mode);
+            m_weights.edit().quantized = std::move(quantized);
+        }
+        Quantization getQuantization() const { return m_weights->quantized.mode; }
+
+        // Truncated SVD of the weights, see LowRank: products then run on the two factors and
+        // the layer always takes the im2col path. Factors of an energy of 1 and no max_rank are
+        // the full weights, that are kept. Quantization takes precedence and quantizes the full
+        // weights. Reloading weights factorizes them again. plan() again after changing it. Not
+        // real-time safe.
+        void setLowRank(float energy, Eigen::Index max_rank = 0)
+        {
+            m_rankEnergy = energy;
+            m_maxRank = max_rank;
+            auto factors = LowRank::factorize(weights(), energy, max_rank);
+            m_weights.edit().factors = std::move(factors);
+        }
+
+        // Rank of the factors, 0 with the full weights, and their relative reconstruction error
+        Eigen::Index getRank() const { return m_weights->factors.rank(); }
+        float getLowRankError() const { return m_weights->factors.error; }
+
+        void loadStateDict(const nlohmann::json& state_dict)
+        {
+            // (out_ch, in_ch, kernel_size) row-major is exactly the wFused layout
             auto b = loadVector(std::string("bias"), state_dict);
-            for (size_t i = 0; i < m_outChannels; i++)
-                setWeight(i, w[i]);
-            setBias(b);
+            assert(b.size() == m_outChannels);
+            editWeights([&](Weights& w) {
+                loadTensorInto(std::string("weight"), state_dict, w.wFused);
+                w.b = b.transpose();
+            });
+        }
+
+        // Folds a per-channel y * scale + shift applied to the output, such as an inference
+        // BatchNorm1d, into the weights and bias. Call it after every loadStateDict(), the
+        // layer then has a bias. Not real-time safe.
+        void foldAffine(const Eigen::Ref<const Eigen::RowVectorXf>& scale, const Eigen::Ref<const Eigen::RowVectorXf>& shift)
+        {
+            assert(scale.size() == m_outChannels && shift.size() == m_outChannels && "CausalDilatedConv1d.foldAffine: Wrong shape");
+            editWeights([&](Weights& w) {
+                if (!m_bias)
+                    w.b.setZero();
+                w.wFused.array().colwise() *= scale.transpose().array();
+                w.b.array() = w.b.array() * scale.transpose().array() + shift.transpose().array();
+                m_bias = true;
+            });
+        }
+
+        // Folds the map x * scale + shift of every input sample, such as the normalisation of a
+        // model, into the weights and bias, see AffineFold. Kept through loadStateDict() and
+        // foldAffine(), (1, 0) removes it. Resets the state. Not real-time safe.
+        void setInputAffine(float scale, float shift)
+        {
+            editWeights([&](Weights& w) { w.fold.setInput(scale, shift); });
+            resetState();
         }
 
     private:
+        // Single sample: gather the kernel taps straight from the history ring into
+        // the wFused column order (j*ks+k) and run one GEMV, without im2col
+        inline void forwardSample(const Eigen::Ref<const RowMatrixXf>& x, Eigen::Ref<RowMatrixXf> y, const Epilogue& epilogue) noexcept
+        {
+            const int left_pad = (int)m_history.cols();
+            const int ks = (int)m_kernelSize;
+            for (int j = 0; j < (int)m_inChannels; ++j) {
+                for (int k = 0; k < ks - 1; ++k) {
+                    int pos = m_head + k * (int)m_dilation;
+                    if (pos >= left_pad)
+                        pos -= left_pad;
+                    m_taps(j * ks + k) = m_history(j, pos);
+                }
+                m_taps(j * ks + ks - 1) = x(j, 0);
+            }
+            if (left_pad > 0)
+            {
+                // x may alias y, so it is consumed before the product
+                m_history.col(m_head) = x.col(0);
+                if (++m_head == left_pad)
+                    m_head = 0;
+            }
+
+            product(m_taps, y, epilogue);
+        }
+
+        // Single samples, pointwise and large layers: a GEMV or a GEMM on the input or its im2col
+        inline void forwardGemm(const Eigen::Ref<const RowMatrixXf>& x, Eigen::Ref<RowMatrixXf> y, const Epilogue& epilogue) noexcept
+        {
+            const int out_len = x.cols();
+            if (out_len == 1)
+            {
+                forwardSample(x, y, epilogue);
+                return;
+            }
+
+            if (m_kernelSize > 1)
+            {
+                auto im2col = m_im2col.view(m_inChannels * m_kernelSize, out_len);
+
+                // x may alias y, so it is consumed entirely before the product
+                buildIm2col(x, im2col);
+                updateHistory(x, out_len);
+
+                product(im2col, y, epilogue);
+            }
+            else if (x.data() == y.data())
+            {
+                auto input = m_input.view(m_inChannels, out_len);
+                input = x;
+                product(input, y, epilogue);
+            }
+            else
+                product(x, y, epilogue);
+        }
+
+        // See Conv1d::product()
+        template<typename Derived>
+        inline void product(const Eigen::MatrixBase<Derived>& x, Eigen::Ref<RowMatrixXf> y, const Epilogue& epilogue) noexcept
+        {
+            const auto& quantized = m_weights->quantized;
+            if (quantized.mode != Quantization::None)
+            {
+                QuantizedGemm::forward(quantized, x, m_packed.words(QuantizedGemm::packedSize(x.rows(), x.cols(), quantized.mode)), y, epilogue);
+                return;
+            }
+            const auto& factors = m_weights->factors;
+            if (!factors.empty())
+                epilogue.run(y, [&](Eigen::Index t, Eigen::Index n) {
+                    LowRank::forward(factors, x.middleCols(t, n), m_factored.view(factors.rank(), n), y.middleCols(t, n));
+                });
+            else
+            {
+                const auto w = weights();
+                epilogue.run(y, [&](Eigen::Index t, Eigen::Index n) { y.middleCols(t, n).noalias() = w * x.middleCols(t, n); });
+            }
+        }
+
+        inline bool isQuantized() const noexcept { return m_weights->quantized.mode != Quantization::None; }
+
+        // Large and factorized layers run im2col + GEMM, smaller ones the direct kernel (see DirectConv)
+        inline bool useIm2col() const noexcept
+        {
+            return m_kernelSize > 1 && (!m_weights->factors.empty() || !DirectConv::isFaster(m_outChannels * m_inChannels * m_kernelSize));
+        }
+
+        // Float weights, reduced precision ones are widened into scratch first
+        inline Eigen::Map<const RowMatrixXf> weights() noexcept
+        {
+            const auto& weights = *m_weights;
+            if (!weights.reduced.isReduced())
+                return Eigen::Map<const RowMatrixXf>(weights.wFused.data(), weights.wFused.rows(), weights.wFused.cols());
+            auto widened = m_widened.view(m_outChannels, m_inChannels * m_kernelSize);
+            weights.reduced.widen(widened);
+            return Eigen::Map<const RowMatrixXf>(widened.data(), widened.rows(), widened.cols());
+        }
+
         // im2col layout: row j*ks+k holds the time-shifted x.row(j) for kernel tap k.
-        // Causal zero-padding: left_pad = dilation*(kernel_size-1) implicit zeros prepended.
-        inline void buildIm2col(const Eigen::Ref<const RowMatrixXf>& x, int out_len) noexcept
+        // The left_pad = dilation*(kernel_size-1) samples preceding the block are read
+        // from the history ring, so that consecutive blocks match a single forward pass.
+        inline void buildIm2col(const Eigen::Ref<const RowMatrixXf>& x, Eigen::Map<RowMatrixXf>& im2col) noexcept
         {
-            const int left_pad = (int)m_dilation * ((int)m_kernelSize - 1);
-            m_im2col.setZero();
+            const int out_len = (int)im2col.cols();
+            const int left_pad = (int)m_history.cols();
             for (int j = 0; j < (int)m_inChannels; ++j) {
                 for (int k = 0; k < (int)m_kernelSize; ++k) {
-                    const int src_offset = k * (int)m_dilation - left_pad; // always <= 0
-                    const int t_start = -src_offset;                        // first valid output sample
-                    const int len = out_len - t_start;
-                    if (len > 0)
-                        m_im2col.row(j * m_kernelSize + k).tail(len).noalias() = x.row(j).head(len);
+                    const int offset = k * (int)m_dilation;                        // tap position in [history | x]
+                    const int from_history = std::min(out_len, left_pad - offset); // always >= 0
+                    auto row = im2col.row(j * m_kernelSize + k);
+                    if (from_history > 0)
+                    {
+                        // The ring may wrap around once within the segment
+                        const int start = (m_head + offset) % left_pad;
+                        const int first = std::min(from_history, left_pad - start);
+                        row.head(first) = m_history.row(j).segment(start, first);
+                        if (from_history > first)
+                            row.segment(first, from_history - first) = m_history.row(j).head(from_history - first);
+                    }
+                    if (out_len > from_history)
+                        row.tail(out_len - from_history) = x.row(j).head(out_len - from_history);
                 }
             }
         }
 
-        void setWeight(size_t i, const Eigen::Ref<RowMatrixXf>& m)
+        // Keep the last left_pad input samples of every channel, overwriting the oldest ones
+        inline void updateHistory(const Eigen::Ref<const RowMatrixXf>& x, int out_len) noexcept
         {
-            assert(m.rows() == m_inChannels && m.cols() == m_kernelSize && i < m_outChannels);
-            m_wFused.row(i) = Eigen::Map<const Eigen::RowVectorXf>(m.data(), m_inChannels * m_kernelSize);
+            const int left_pad = (int)m_history.cols();
+            if (left_pad == 0)
+                return;
+            if (out_len >= left_pad)
+            {
+                m_history = x.rightCols(left_pad);
+                m_head = 0;
+                return;
+            }
+            const int first = std::min(out_len, left_pad - m_head);
+            m_history.middleCols(m_head, first) = x.leftCols(first);
+            if (out_len > first)
+                m_history.leftCols(out_len - first) = x.rightCols(out_len - first);
+            m_head = (m_head + out_len) % left_pad;
         }
 
-        void setBias(const Eigen::Ref<Eigen::RowVectorXf>& v)
+        struct Weights
+        {
+            RowMatrixXf     wFused;  // (out_ch, in_ch * kernel_size), empty while reduced
+            Eigen::VectorXf b;
+            ReducedWeights  reduced;
+            QuantizedGemm::Weights quantized; // with b folded in
+            LowRank::Factors factors;         // of the float weights, without b
+            AffineFold      fold;             // folded into wFused and b
+        };
+
+        // Edits the float weights and bias without the folded maps, then folds them again, reduces
+        // the weights back to their precision and updates their factors and quantization
+        template<typename Edit>
+        void editWeights(Edit&& edit)
         {
-            assert(v.size() == m_outChannels);
-            m_b = v.transpose();
+            auto& w = m_weights.edit();
+            const auto precision = w.reduced.precision;
+            w.reduced.convert(w.wFused, WeightPrecision::Float32);
+            w.fold.restore(w.wFused, w.b);
+            edit(w);
+            w.fold.apply(w.wFused, w.b);
+            w.reduced.convert(w.wFused, precision);
+            m_bias = m_bias || !w.fold.isIdentity();
+            setLowRank(m_rankEnergy, m_maxRank);
+            setQuantization(getQuantization());
         }
 
         size_t m_inChannels, m_outChannels, m_kernelSize, m_dilation;
         bool m_bias;
-        RowMatrixXf     m_wFused;  // (out_ch, in_ch * kernel_size)
-        Eigen::VectorXf m_b;
-        RowMatrixXf     m_im2col;  // (in_ch * kernel_size, out_len), lazily resized
+        SharedWeights<Weights> m_weights;
+        ScratchBuffer   m_im2col;  // (in_ch * kernel_size, out_len)
+        ScratchBuffer   m_input;   // (in_ch, left_pad + out_len), history followed by the input
+        ScratchBuffer   m_gates;   // (out_ch, out_len), convolution output before gating
+        ScratchBuffer   m_widened; // (out_ch, in_ch * kernel_size), float copy of reduced precision weights
+        ScratchBuffer   m_packed;  // quantized input, see QuantizedGemm
+        ScratchBuffer   m_factored; // (rank, out_len), v x of factorized weights
+        RowMatrixXf     m_history; // (in_ch, dilation * (kernel_size - 1)), ring of the last input samples
+        int             m_head = 0; // oldest sample in m_history
+        Eigen::VectorXf m_taps;    // (in_ch * kernel_size), single sample im2col
+        bool            m_calibrating = false;
+        float           m_inputRange = 0.f; // largest input magnitude seen while calibrating
+        float           m_rankEnergy = 1.f; // truncation of setLowRank()
+        Eigen::Index    m_maxRank = 0;
     };
 
+    using CausalDilatedConv1d = CausalDilatedConv1dT<>;
+
 }
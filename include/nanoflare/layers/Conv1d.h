@@ -1,41 +1,101 @@
 #pragma once
 
 #include <Eigen/Dense>
+#include <algorithm>
 #include <cassert>
+#include "nanoflare/AffineFold.h"
+#include "nanoflare/DirectConv.h"
+#include "nanoflare/Epilogue.h"
+#include "nanoflare/LowRank.h"
+#include "nanoflare/QuantizedGemm.h"
+#include "nanoflare/ScratchArena.h"
+#include "nanoflare/WeightPrecision.h"
 #include "nanoflare/utils.h"
 
 namespace Nanoflare
 {
 
-    class Conv1d
+    // Shapes given as template arguments are known at compile time and unroll the direct
+    // convolution kernel, Eigen::Dynamic ones are only known at run time (see Conv1d)
+    template<int InChannels = Eigen::Dynamic, int OutChannels = Eigen::Dynamic, int KernelSize = Eigen::Dynamic>
+    class Conv1dT
     {
     public:
         EIGEN_MAKE_ALIGNED_OPERATOR_NEW
 
-        Conv1d(size_t in_channels, size_t out_channels, size_t kernel_size, bool bias) :
+        Conv1dT(size_t in_channels, size_t out_channels, size_t kernel_size, bool bias) :
             m_inChannels(in_channels), m_outChannels(out_channels),
             m_kernelSize(kernel_size), m_bias(bias),
-            m_wFused(RowMatrixXf::Zero(out_channels, in_channels * kernel_size)),
-            m_b(Eigen::VectorXf::Zero(out_channels))
-        {}
-        ~Conv1d() = default;
+            m_weights(Weights{ RowMatrixXf::Zero(out_channels, in_channels * kernel_size), Eigen::VectorXf::Zero(out_channels) }),
+            m_taps(Eigen::VectorXf::Zero(in_channels * kernel_size))
+        {
+            assert(matchesSize(InChannels, in_channels) && matchesSize(OutChannels, out_channels) && matchesSize(KernelSize, kernel_size)
+                && "Conv1d: Shape does not match the template arguments");
+        }
+        ~Conv1dT() = default;
 
         inline size_t getOutputLength(size_t in_length) const { return in_length - (m_kernelSize - 1); }
 
-        inline void forward(const Eigen::Ref<const RowMatrixXf>& x, Eigen::Ref<RowMatrixXf> y) noexcept
+        // Convolution followed by the epilogue, whose bias is the layer's own, see Epilogue
+        inline void forward(const Eigen::Ref<const RowMatrixXf>& x, Eigen::Ref<RowMatrixXf> y, const Epilogue& epilogue = Epilogue()) noexcept
         {
             assert(x.rows() == m_inChannels && "Conv1d.forward: Wrong input shape");
             const int out_len = (int)x.cols() - (int)m_kernelSize + 1;
             assert(y.rows() == m_outChannels && y.cols() == out_len && "Conv1d.forward: Wrong output shape");
 
-            if (m_im2col.rows() != (int)(m_inChannels * m_kernelSize) || m_im2col.cols() != out_len)
-                m_im2col.resize(m_inChannels * m_kernelSize, out_len);
+            if (m_calibrating && x.size() > 0)
+                m_inputRange = std::max(m_inputRange, x.cwiseAbs().maxCoeff());
+            const Epilogue biased = epilogue.withBias(m_bias ? m_weights->b.data() : nullptr);
+            if (out_len == 1)
+            {
+                forwardSample(x, y, biased);
+                return;
+            }
+
+            if (m_kernelSize > 1 && (isQuantized() || useIm2col()))
+            {
+                auto im2col = m_im2col.view(m_inChannels * m_kernelSize, out_len);
+                buildIm2col(x, im2col);
+                product(im2col, y, biased);
+                return;
+            }
 
-            buildIm2col(x, out_len);
+            // The quantized product packs the whole input before writing the output, the
+            // direct and float pointwise paths write the output while still reading the input
+            if (x.data() == y.data() && !isQuantized())
+            {
+                auto input = m_input.view(m_inChannels, x.cols());
+                input = x;
+                forwardDirect(input, y, biased);
+            }
+            else
+                forwardDirect(x, y, biased);
+        }
 
-            y.noalias() = m_wFused * m_im2col;
-            if (m_bias)
-                y.colwise() += m_b;
+        // Scratch is only live during the call, see ScratchPlanner
+        void plan(ScratchPlanner& planner, size_t max_block_size)
+        {
+            const auto mode = m_weights->quantized.mode;
+            const bool factorized = !m_weights->factors.empty() && mode == Quantization::None;
+            const bool widened = m_weights->reduced.isReduced() && mode == Quantization::None && !factorized;
+            const bool im2col = m_kernelSize > 1 && (mode != Quantization::None || useIm2col());
+            if (widened)
+                planner.acquire(m_widened, m_outChannels * m_inChannels * m_kernelSize);
+            auto& scratch = im2col ? m_im2col : m_input;
+            planner.acquire(scratch, (im2col ? m_inChannels * m_kernelSize : m_inChannels) * max_block_size);
+            if (mode != Quantization::None)
+            {
+                planner.acquire(m_packed, QuantizedGemm::packedSize(m_inChannels * m_kernelSize, max_block_size, mode));
+                planner.release(m_packed);
+            }
+            else if (factorized)
+            {
+                planner.acquire(m_factored, m_weights->factors.rank() * max_block_size);
+                planner.release(m_factored);
+            }
+            planner.release(scratch);
+            if (widened)
+                planner.release(m_widened);
         }
 
         size_t getInChannels()  const { return m_inChannels; }
@@ -43,43 +103,181 @@ namespace Nanoflare
         size_t getKernelSize()  const { return m_kernelSize; }
         bool   useBias()        const { return m_bias; }
 
-        void loadStateDict(std::map<std::string, nlohmann::json> state_dict)
+        // See CausalDilatedConv1d::setWeightPrecision()
+        void setWeightPrecision(WeightPrecision precision)
+        {
+            auto& w = m_weights.edit();
+            w.reduced.convert(w.wFused, precision);
+        }
+        WeightPrecision getWeightPrecision() const { return m_weights->reduced.precision; }
+
+        // Bytes of the weights and biases
+        size_t getWeightSize() const
+        {
+            const auto& w = *m_weights;
+            return w.reduced.getSize(w.wFused) + (w.b.size() + w.factors.u.size() + w.factors.v.size()) * sizeof(float) + w.fold.getSize();
+        }
+
+        // See CausalDilatedConv1d::setCalibration()
+        void setCalibration(bool calibrating)
+        {
+            m_calibrating = calibrating;
+            if (calibrating)
+                m_inputRange = 0.f;
+        }
+
+        // See CausalDilatedConv1d::setQuantization()
+        void setQuantization(Quantization mode)
+        {
+            QuantizedGemm::Weights quantized;
+            if (mode != Quantization::None)
+                quantized = QuantizedGemm::quantize(weights(), m_weights->b, m_inputRange, mode);
+            m_weights.edit().quantized = std::move(quantized);
+        }
+        Quantization getQuantization() const { return m_weights->quantized.mode; }
+
+        // See CausalDilatedConv1d::setLowRank()
+        void setLowRank(float energy, Eigen::Index max_rank = 0)
+        {
+            m_rankEnergy = energy;
+            m_maxRank = max_rank;
+            auto factors = LowRank::factorize(weights(), energy, max_rank);
+            m_weights.edit().factors = std::move(factors);
+        }
+
+        // Rank of the factors, 0 with the full weights, and their relative reconstruction error
+        Eigen::Index getRank() const { return m_weights->factors.rank(); }
+        float getLowRankError() const { return m_weights->factors.error; }
+
+        void loadStateDict(const nlohmann::json& state_dict)
         {
-            auto w = loadTensor(std::string("weight"), state_dict);
+            // (out_ch, in_ch, kernel_size) row-major is exactly the wFused layout
             auto b = loadVector(std::string("bias"), state_dict);
-            for (size_t i = 0; i < m_outChannels; i++)
-                setWeight(i, w[i]);
-            setBias(b);
+            assert(b.size() == m_outChannels);
+            editWeights([&](Weights& w) {
+                loadTensorInto(std::string("weight"), state_dict, w.wFused);
+                w.b = b.transpose();
+            });
         }
 
+        // Fold the maps x * scale + shift of every input and output sample, such as the
+        // normalisation and denormalisation of a model, into the weights and bias, see
+        // AffineFold. Kept through loadStateDict(), (1, 0) removes them. Not real-time safe.
+        void setInputAffine(float scale, float shift) { editWeights([&](Weights& w) { w.fold.setInput(scale, shift); }); }
+        void setOutputAffine(float scale, float shift) { editWeights([&](Weights& w) { w.fold.setOutput(scale, shift); }); }
+
     private:
+        // Single output sample: the whole input is one im2col column, run one GEMV
+        inline void forwardSample(const Eigen::Ref<const RowMatrixXf>& x, Eigen::Ref<RowMatrixXf> y, const Epilogue& epilogue) noexcept
+        {
+            for (int j = 0; j < (int)m_inChannels; ++j)
+                m_taps.segment(j * m_kernelSize, m_kernelSize) = x.row(j).transpose();
+
+            product(m_taps, y, epilogue);
+        }
+
+        // y = epilogue(w x), by the integer kernel once quantized, that has the bias folded in, or
+        // as u (v x) once factorized
+        template<typename Derived>
+        inline void product(const Eigen::MatrixBase<Derived>& x, Eigen::Ref<RowMatrixXf> y, const Epilogue& epilogue) noexcept
+        {
+            const auto& quantized = m_weights->quantized;
+            if (quantized.mode != Quantization::None)
+            {
+                QuantizedGemm::forward(quantized, x, m_packed.words(QuantizedGemm::packedSize(x.rows(), x.cols(), quantized.mode)), y, epilogue);
+                return;
+            }
+            const auto& factors = m_weights->factors;
+            if (!factors.empty())
+                epilogue.run(y, [&](Eigen::Index t, Eigen::Index n) {
+                    LowRank::forward(factors, x.middleCols(t, n), m_factored.view(factors.rank(), n), y.middleCols(t, n));
+                });
+            else
+            {
+                const auto w = weights();
+                epilogue.run(y, [&](Eigen::Index t, Eigen::Index n) { y.middleCols(t, n).noalias() = w * x.middleCols(t, n); });
+            }
+        }
+
+        inline bool isQuantized() const noexcept { return m_weights->quantized.mode != Quantization::None; }
+
+        // Large and factorized layers run im2col + GEMM, smaller ones the direct kernel (see DirectConv)
+        inline bool useIm2col() const noexcept
+        {
+            return m_kernelSize > 1 && (!m_weights->factors.empty() || !DirectConv::isFaster(m_outChannels * m_inChannels * m_kernelSize));
+        }
+
+        // Float weights, reduced precision ones are widened into scratch first
+        inline Eigen::Map<const RowMatrixXf> weights() noexcept
+        {
+            const auto& weights = *m_weights;
+            if (!weights.reduced.isReduced())
+                return Eigen::Map<const RowMatrixXf>(weights.wFused.data(), weights.wFused.rows(), weights.wFused.cols());
+            auto widened = m_widened.view(m_outChannels, m_inChannels * m_kernelSize);
+            weights.reduced.widen(widened);
+            return Eigen::Map<const RowMatrixXf>(widened.data(), widened.rows(), widened.cols());
+        }
+
+        // Pointwise convolutions are a single GEMM on the input, wider kernels run DirectConv
+        inline void forwardDirect(const Eigen::Ref<const RowMatrixXf>& x, Eigen::Ref<RowMatrixXf> y, const Epilogue& epilogue) noexcept
+        {
+            if (m_kernelSize == 1)
+                product(x, y, epilogue);
+            else
+                DirectConv::forward<DirectConv::Activation::None, ActivationPrecision::Exact, InChannels, OutChannels, KernelSize>(
+                    weights(), epilogue, m_kernelSize, 1, x, y);
+        }
+
         // im2col layout: row j*ks+k holds x.row(j) shifted by k, length out_len
-        inline void buildIm2col(const Eigen::Ref<const RowMatrixXf>& x, int out_len) noexcept
+        inline void buildIm2col(const Eigen::Ref<const RowMatrixXf>& x, Eigen::Map<RowMatrixXf>& im2col) noexcept
         {
+            const int out_len = (int)im2col.cols();
             for (int j = 0; j < (int)m_inChannels; ++j)
                 for (int k = 0; k < (int)m_kernelSize; ++k)
-                    m_im2col.row(j * m_kernelSize + k).noalias() = x.row(j).segment(k, out_len);
+                    im2col.row(j * m_kernelSize + k).noalias() = x.row(j).segment(k, out_len);
         }
 
-        void setWeight(size_t i, const Eigen::Ref<RowMatrixXf>& m)
+        struct Weights
         {
-            assert(m.rows() == m_inChannels && m.cols() == m_kernelSize && i < m_outChannels);
-            // RowMatrixXf memory: [w(j=0,k=0..ks-1) | w(j=1,k=0..ks-1) | ...]
-            // matches im2col row layout j*ks+k -> w(j,k)
-            m_wFused.row(i) = Eigen::Map<const Eigen::RowVectorXf>(m.data(), m_inChannels * m_kernelSize);
-        }
+            RowMatrixXf     wFused;  // (out_ch, in_ch * kernel_size), empty while reduced
+            Eigen::VectorXf b;
+            ReducedWeights  reduced;
+            QuantizedGemm::Weights quantized; // with b folded in
+            LowRank::Factors factors;         // of the float weights, without b
+            AffineFold      fold;             // folded into wFused and b
+        };
 
-        void setBias(const Eigen::Ref<Eigen::RowVectorXf>& v)
+        // See CausalDilatedConv1d::editWeights()
+        template<typename Edit>
+        void editWeights(Edit&& edit)
         {
-            assert(v.size() == m_outChannels);
-            m_b = v.transpose();
+            auto& w = m_weights.edit();
+            const auto precision = w.reduced.precision;
+            w.reduced.convert(w.wFused, WeightPrecision::Float32);
+            w.fold.restore(w.wFused, w.b);
+            edit(w);
+            w.fold.apply(w.wFused, w.b);
+            w.reduced.convert(w.wFused, precision);
+            m_bias = m_bias || !w.fold.isIdentity();
+            setLowRank(m_rankEnergy, m_maxRank);
+            setQuantization(getQuantization());
         }
 
         size_t m_inChannels, m_outChannels, m_kernelSize;
         bool m_bias;
-        RowMatrixXf     m_wFused;  // (out_ch, in_ch * kernel_size)
-        Eigen::VectorXf m_b;
-        RowMatrixXf     m_im2col;  // (in_ch * kernel_size, out_len), lazily resized
+        SharedWeights<Weights> m_weights;
+        ScratchBuffer   m_im2col;  // (in_ch * kernel_size, out_len)
+        ScratchBuffer   m_input;   // (in_ch, in_len), copy of an input aliasing the output
+        ScratchBuffer   m_widened; // (out_ch, in_ch * kernel_size), float copy of reduced precision weights
+        ScratchBuffer   m_packed;  // quantized input, see QuantizedGemm
+        ScratchBuffer   m_factored; // (rank, out_len), v x of factorized weights
+        Eigen::VectorXf m_taps;    // (in_ch * kernel_size), single sample im2col
+        bool            m_calibrating = false;
+        float           m_inputRange = 0.f; // largest input magnitude seen while calibrating
+        float           m_rankEnergy = 1.f; // truncation of setLowRank()
+        Eigen::Index    m_maxRank = 0;
     };
 
+    using Conv1d = Conv1dT<>;
+
 }
@@ -31,8 +31,7 @@ namespace Nanoflare
             m_shift.forward(params, m_beta);
 
             // x: (time, feature_dim) gamma: (1, feature_dim)
-            y.noalias() = (x.array().rowwise() * m_gamma.array()).matrix();
-            y.rowwise() += m_beta;
+            y.array() = x.array().rowwise() * m_gamma.array() + m_beta.replicate( x.rows(), 1 ).array();
         }
         
         inline void forwardTranspose(const Eigen::Ref<const RowMatrixXf>& x, 
@@ -43,21 +42,15 @@ namespace Nanoflare
             m_scale.forward(params, m_gamma);
             m_shift.forward(params, m_beta);
             
-            const Eigen::VectorXf gamma_t = m_gamma.transpose();
-            const Eigen::VectorXf beta_t = m_beta.transpose();
-            
             // x: (feature_dim, time) gamma: (1, feature_dim)
-            y.noalias() = (x.array().colwise() * gamma_t.array()).matrix();
-            y.colwise() += beta_t;
+            y.array() = x.array().colwise() * m_gamma.transpose().array() + m_beta.transpose().replicate( 1, x.cols() ).array();
         }
 
-        void loadStateDict(const std::map<std::string, nlohmann::json>& state_dict)
+        void loadStateDict(const nlohmann::json& state_dict)
         {
-            auto scale_state_dict = state_dict.at("scale").get<std::map<std::string, nlohmann::json>>();
-            m_scale.loadStateDict(scale_state_dict);
+            m_scale.loadStateDict( state_dict.at("scale") );
             
-            auto shift_state_dict = state_dict.at("shift").get<std::map<std::string, nlohmann::json>>();
-            m_shift.loadStateDict(shift_state_dict);
+            m_shift.loadStateDict( state_dict.at("shift") );
         }
 
         size_t getFeatureDim() const { return m_feature_dim; }
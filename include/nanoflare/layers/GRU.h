@@ -3,32 +3,51 @@
 #include <Eigen/Dense>
 #include <cassert>
 #include "nanoflare/layers/GRUCell.h"
+#include "nanoflare/ScratchArena.h"
 
 namespace Nanoflare
 {
 
-    class GRU
+    // Input and hidden sizes given as template arguments are known at compile time, see GRUCellT
+    template<int InputSize = Eigen::Dynamic, int HiddenSize = Eigen::Dynamic>
+    class GRUT
     {
     public:
         EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+        static constexpr int FixedInputSize = InputSize, FixedHiddenSize = HiddenSize;
         
-        GRU(size_t input_size, size_t hidden_size, bool bias) : m_cell(input_size, hidden_size, bias), m_h(Eigen::VectorXf::Zero(hidden_size)) {}
-        ~GRU() = default;
+        GRUT(size_t input_size, size_t hidden_size, bool bias) : m_cell(input_size, hidden_size, bias), m_h(Eigen::VectorXf::Zero(m_cell.getPaddedSize())) {}
+        ~GRUT() = default;
 
         void resetState() { m_h.setZero(); }
 
+        void setActivationPrecision(ActivationPrecision precision) { m_cell.setActivationPrecision(precision); }
+
+        // See GRUCell::setInputAffine()
+        void setInputAffine(float scale, float shift) { m_cell.setInputAffine(scale, shift); }
+
+        // Whether the pruned W_hh runs the sparse kernel, see RecurrentKernel::SparseBlocks
+        bool isSparse() const { return m_cell.isSparse(); }
+
         inline void forward( const Eigen::Ref<const RowMatrixXf>& x, Eigen::Ref<RowMatrixXf> y ) noexcept
         {
             assert((y.rows() == x.rows() && y.cols() == m_cell.getHiddenSize()) && "GRU.forward: Wrong output shape");
 
-            for(auto i = 0; i < x.rows(); i++)
-            {
-                m_cell.forward( x.row(i), m_h );
-                y.row(i) = m_h; // Assign h to output
-            }
+            // The input half of every time step in one GEMM, only W_hh * h is left in the recurrence
+            auto proj = m_proj.view( x.rows(), m_cell.getProjectionSize() );
+            m_cell.project( x, proj );
+            m_cell.forward( proj, m_h, y );
         }
 
-        void loadStateDict(std::map<std::string, nlohmann::json> state_dict)
+        // Scratch is only live during the call, see ScratchPlanner
+        void plan(ScratchPlanner& planner, size_t max_block_size)
+        {
+            planner.acquire( m_proj, max_block_size * m_cell.getProjectionSize() );
+            planner.release( m_proj );
+        }
+
+        void loadStateDict(const nlohmann::json& state_dict)
         {
             auto wih = loadMatrix( std::string("weight_ih_l0"), state_dict );
             auto whh = loadMatrix( std::string("weight_hh_l0"), state_dict );
@@ -45,9 +64,11 @@ namespace Nanoflare
         }
         
     private:
-        Eigen::VectorXf m_h;
-        RowMatrixXf m_y;
-        GRUCell m_cell;
+        GRUCellT<InputSize, HiddenSize> m_cell;
+        Eigen::VectorXf m_h;   // padded to whole kernel blocks, see GRUCell::getPaddedSize()
+        ScratchBuffer m_proj;  // (time, 3 * padded hidden size), projected input
     };
 
+    using GRU = GRUT<>;
+
 }
\ No newline at end of file
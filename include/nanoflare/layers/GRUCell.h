@@ -2,89 +2,186 @@
 
 #include <Eigen/Dense>
 #include <cassert>
-#include "nanoflare/Functional.h"
+#include "nanoflare/Activations.h"
+#include "nanoflare/AffineFold.h"
+#include "nanoflare/RecurrentKernel.h"
 #include "nanoflare/utils.h"
 
 namespace Nanoflare
 {
-    class GRUCell
+    // Sizes given as template arguments are known at compile time: the input projection and
+    // the recurrent kernel loops are unrolled for them (see GRUCell)
+    template<int InputSize = Eigen::Dynamic, int HiddenSize = Eigen::Dynamic>
+    class GRUCellT
     {
     public:
         EIGEN_MAKE_ALIGNED_OPERATOR_NEW
 
-        GRUCell(size_t input_size, size_t hidden_size, bool bias) :
+        using Kernel = RecurrentKernel<3>;
+
+        GRUCellT(size_t input_size, size_t hidden_size, bool bias) :
             m_hiddenSize(hidden_size), m_inputSize(input_size), m_bias(bias),
-            m_wCombined(Eigen::MatrixXf::Zero(3*hidden_size, input_size+1)),
-            m_uCombined(Eigen::MatrixXf::Zero(3*hidden_size, hidden_size+1)),
-            m_extX(Eigen::VectorXf::Zero(input_size+1)),
-            m_extH(Eigen::VectorXf::Zero(hidden_size+1)),
-            m_alpha(Eigen::VectorXf::Zero(3*hidden_size)),
-            m_beta(Eigen::VectorXf::Zero(3*hidden_size)),
-            m_r(Eigen::VectorXf::Zero(hidden_size)),
-            m_z(Eigen::VectorXf::Zero(hidden_size)),
-            m_n(Eigen::VectorXf::Zero(hidden_size))
+            m_weights(Weights{
+                RowMatrixXf::Zero(input_size, 3 * Kernel::paddedSize(hidden_size)),
+                Eigen::RowVectorXf::Zero(3 * Kernel::paddedSize(hidden_size)),
+                RowMatrixXf::Zero(Kernel::numBlocks(hidden_size), hidden_size * 3 * Kernel::Width),
+                Eigen::VectorXf::Zero(Kernel::paddedSize(hidden_size)),
+                Eigen::VectorXf::Zero(3 * hidden_size), Eigen::VectorXf::Zero(3 * hidden_size) }),
+            m_proj(Eigen::RowVectorXf::Zero(3 * Kernel::paddedSize(hidden_size))),
+            m_h(Eigen::VectorXf::Zero(Kernel::paddedSize(hidden_size))),
+            m_hNext(Eigen::VectorXf::Zero(Kernel::paddedSize(hidden_size)))
         {
-            m_extX(input_size)  = 1.0f;
-            m_extH(hidden_size) = 1.0f;
+            assert(matchesSize(InputSize, input_size) && matchesSize(HiddenSize, hidden_size) && "GRUCell: Shape does not match the template arguments");
         }
-        ~GRUCell() = default;
+        ~GRUCellT() = default;
 
         void setWeightIH(const Eigen::Ref<RowMatrixXf>& m)
         {
             assert(m.rows() == 3 * m_hiddenSize && m.cols() == m_inputSize);
-            m_wCombined.leftCols(m_inputSize) = m;
+            editInput([&](Weights& w) { Kernel::interleaveColumns(m, m_hiddenSize, w.wih); });
         }
 
         void setWeightHH(const Eigen::Ref<RowMatrixXf>& m)
         {
             assert(m.rows() == 3 * m_hiddenSize && m.cols() == m_hiddenSize);
-            m_uCombined.leftCols(m_hiddenSize) = m;
+            auto& w = m_weights.edit();
+            Kernel::interleaveBlocks(m, m_hiddenSize, w.whh);
+            w.sparse = Kernel::sparsity(w.whh, m_hiddenSize) >= Kernel::SparseThreshold ? Kernel::sparsify(w.whh, m_hiddenSize) : typename Kernel::SparseBlocks{};
         }
 
         void setBiasIH(const Eigen::Ref<Eigen::VectorXf>& v)
         {
             assert(v.size() == 3 * m_hiddenSize);
-            m_wCombined.col(m_inputSize) = v;
+            editInput([&](Weights& w) { w.bih = v; fuseBiases(w); });
         }
 
         void setBiasHH(const Eigen::Ref<Eigen::VectorXf>& v)
         {
             assert(v.size() == 3 * m_hiddenSize);
-            m_uCombined.col(m_hiddenSize) = v;
+            editInput([&](Weights& w) { w.bhh = v; fuseBiases(w); });
         }
 
+        // Folds the map x * scale + shift of every input into W_ih and the biases, see AffineFold.
+        // Kept through the setters, (1, 0) removes it. Not real-time safe.
+        void setInputAffine(float scale, float shift) { editInput([&](Weights& w) { w.fold.setInput(scale, shift); }); }
+
         size_t getInputSize()  const { return m_inputSize; }
         size_t getHiddenSize() const { return m_hiddenSize; }
         bool   isBiased()      const { return m_bias; }
 
+        // Hidden states are padded with zeros to whole kernel blocks, projections hold 3 of them
+        size_t getPaddedSize()     const { return Kernel::paddedSize(m_hiddenSize); }
+        size_t getProjectionSize() const { return 3 * getPaddedSize(); }
+
+        // Whether W_hh has enough zero packets to run the sparse kernel, see RecurrentKernel::SparseBlocks
+        bool isSparse() const { return !m_weights->sparse.empty(); }
+
+        void setActivationPrecision(ActivationPrecision precision) { m_precision = precision; }
+        ActivationPrecision getActivationPrecision() const { return m_precision; }
+
+        // Single time step
         inline void forward(const Eigen::Ref<const Eigen::VectorXf>& x, Eigen::Ref<Eigen::VectorXf> h) noexcept
         {
-            m_extX.head(m_inputSize)  = x;
-            m_extH.head(m_hiddenSize) = h;
+            m_proj.noalias() = x.transpose() * m_weights->wih;
+            m_proj += m_weights->bias;
+            m_h.head(m_hiddenSize) = h;
+            forward(m_proj, m_h, Eigen::Map<RowMatrixXf>(h.data(), 1, m_hiddenSize));
+        }
 
-            m_alpha.noalias() = m_wCombined * m_extX;
-            m_beta.noalias()  = m_uCombined * m_extH;
+        // Input to hidden half of every time step of x (time, in) as one GEMM: proj (time, getProjectionSize())
+        inline void project(const Eigen::Ref<const RowMatrixXf>& x, Eigen::Ref<RowMatrixXf> proj) noexcept
+        {
+            assert(x.cols() == m_inputSize && proj.rows() == x.rows() && proj.cols() == getProjectionSize() && "GRUCell.project: Wrong shape");
+            const auto& w = *m_weights;
+            const Eigen::Map<const Eigen::Matrix<float, InputSize, ProjectionSize, Eigen::RowMajor>> wih(w.wih.data(), m_inputSize, getProjectionSize());
+            const Eigen::Map<const Eigen::Matrix<float, 1, ProjectionSize>> bias(w.bias.data(), getProjectionSize());
+            proj.noalias() = x * wih;
+            proj.rowwise() += bias;
+        }
+
+        // Recurrence over the projected input, h (getPaddedSize()) is the state carried from one
+        // block to the next, y (time, hidden) receives it at every time step
+        inline void forward(const Eigen::Ref<const RowMatrixXf>& proj, Eigen::Ref<Eigen::VectorXf> h, Eigen::Ref<RowMatrixXf> y) noexcept
+        {
+            assert(proj.cols() == getProjectionSize() && h.size() == getPaddedSize() && "GRUCell.forward: Wrong input shape");
+            assert(y.rows() == proj.rows() && y.cols() == m_hiddenSize && "GRUCell.forward: Wrong output shape");
+            switch (m_precision)
+            {
+                case ActivationPrecision::Exact:      forward<ActivationPrecision::Exact>(proj, h, y); break;
+                case ActivationPrecision::Rational:   forward<ActivationPrecision::Rational>(proj, h, y); break;
+                case ActivationPrecision::Polynomial: forward<ActivationPrecision::Polynomial>(proj, h, y); break;
+            }
+        }
 
-            m_r.noalias() = m_alpha.head(m_hiddenSize)                    + m_beta.head(m_hiddenSize);
-            m_z.noalias() = m_alpha.segment(m_hiddenSize, m_hiddenSize)   + m_beta.segment(m_hiddenSize, m_hiddenSize);
-            m_n.noalias() = m_alpha.tail(m_hiddenSize);
+        template<ActivationPrecision P>
+        inline void forward(const Eigen::Ref<const RowMatrixXf>& proj, Eigen::Ref<Eigen::VectorXf> h, Eigen::Ref<RowMatrixXf> y) noexcept
+        {
+            using Lane = typename Kernel::Lane;
+            constexpr int W = Kernel::Width;
+            const auto& weights = *m_weights;
 
-            Functional::Sigmoid(m_r);
-            Functional::Sigmoid(m_z);
-            m_n.array() += m_r.array() * m_beta.tail(m_hiddenSize).array();
-            m_n = m_n.array().tanh();
+            const Eigen::Index num_blocks = HiddenSize == Eigen::Dynamic ? weights.whh.rows() : Kernel::numBlocks(HiddenSize);
+            for (Eigen::Index t = 0; t < proj.rows(); ++t)
+            {
+                for (Eigen::Index b = 0; b < num_blocks; ++b)
+                {
+                    // r and z start from their fused biases, n from b_hn that r scales
+                    const float* p = proj.row(t).data() + b * 3 * W;
+                    Lane acc[3] = { Eigen::Map<const Lane>(p), Eigen::Map<const Lane>(p + W), weights.bhn.template segment<W>(b * W).array() };
+                    if (weights.sparse.empty())
+                        Kernel::template accumulate<HiddenSize>(weights.whh.row(b).data(), h.data(), m_hiddenSize, acc);
+                    else
+                        Kernel::accumulate(weights.sparse, b, h.data(), acc);
 
-            // reuse m_r as scratch to avoid aliasing on h
-            m_r.array() = (1.f - m_z.array()) * m_n.array() + m_z.array() * h.array();
-            h = m_r;
+                    const Lane r = Activations::sigmoid<P>(acc[0]);
+                    const Lane z = Activations::sigmoid<P>(acc[1]);
+                    const Lane n = Activations::tanh<P>(Eigen::Map<const Lane>(p + 2 * W) + r * acc[2]);
+                    m_hNext.template segment<W>(b * W) = ((1.f - z) * n + z * h.template segment<W>(b * W).array()).matrix();
+                }
+                h = m_hNext;
+                y.row(t) = h.head(m_hiddenSize).transpose();
+            }
         }
 
     private:
+        static constexpr int ProjectionSize = Kernel::projectionSize(HiddenSize);
+
+        struct Weights
+        {
+            RowMatrixXf        wih;   // W_ih^T, shape (in, 3Hp) gate-interleaved, see RecurrentKernel
+            Eigen::RowVectorXf bias;  // b_ih + b_hh for r and z, b_ih for n, shape (3Hp) gate-interleaved
+            RowMatrixXf        whh;   // W_hh per block of hidden units, see RecurrentKernel
+            Eigen::VectorXf    bhn;   // b_hh of n, scaled by r, shape (Hp)
+            Eigen::VectorXf    bih, bhh; // kept to correctly fuse when set independently
+            typename Kernel::SparseBlocks sparse; // non-zero packets of whh when it is sparse enough
+            AffineFold         fold;  // folded into wih and bias
+        };
+
+        // Edits the input projection without the input map, then folds it again
+        template<typename Edit>
+        void editInput(Edit&& edit)
+        {
+            auto& w = m_weights.edit();
+            w.fold.restore(w.wih.transpose(), w.bias);
+            edit(w);
+            w.fold.apply(w.wih.transpose(), w.bias);
+        }
+
+        void fuseBiases(Weights& w)
+        {
+            Eigen::VectorXf b = w.bih;
+            b.head(2 * m_hiddenSize) += w.bhh.head(2 * m_hiddenSize);
+            Kernel::interleaveVector(b, m_hiddenSize, w.bias);
+            w.bhn.head(m_hiddenSize) = w.bhh.tail(m_hiddenSize);
+        }
+
         size_t m_inputSize, m_hiddenSize;
         bool m_bias;
-        Eigen::MatrixXf m_wCombined; // [W_ih | b_ih], shape (3H, in+1)
-        Eigen::MatrixXf m_uCombined; // [W_hh | b_hh], shape (3H, H+1)
-        Eigen::VectorXf m_extX, m_extH;               // extended input/hidden with trailing 1
-        Eigen::VectorXf m_alpha, m_beta, m_r, m_z, m_n; // pre-allocated scratch
+        SharedWeights<Weights> m_weights;
+        Eigen::RowVectorXf m_proj;     // single time step projection
+        Eigen::VectorXf m_h, m_hNext;  // padded hidden states
+        ActivationPrecision m_precision = ActivationPrecision::Exact;
     };
+
+    using GRUCell = GRUCellT<>;
 }
@@ -3,21 +3,26 @@
 #include <Eigen/Dense>
 #include <cassert>
 #include "nanoflare/layers/LSTMCell.h"
+#include "nanoflare/ScratchArena.h"
 
 namespace Nanoflare
 {
 
-    class LSTM
+    // Input and hidden sizes given as template arguments are known at compile time, see LSTMCellT
+    template<int InputSize = Eigen::Dynamic, int HiddenSize = Eigen::Dynamic>
+    class LSTMT
     {
     public:
         EIGEN_MAKE_ALIGNED_OPERATOR_NEW
 
-        LSTM(size_t input_size, size_t hidden_size, bool bias) : 
+        static constexpr int FixedInputSize = InputSize, FixedHiddenSize = HiddenSize;
+
+        LSTMT(size_t input_size, size_t hidden_size, bool bias) : 
             m_cell(input_size, hidden_size, bias), 
-            m_h(Eigen::VectorXf::Zero(hidden_size)),
-            m_c(Eigen::VectorXf::Zero(hidden_size))
+            m_h(Eigen::VectorXf::Zero(m_cell.getPaddedSize())),
+            m_c(Eigen::VectorXf::Zero(m_cell.getPaddedSize()))
         {}
-        ~LSTM() = default;
+        ~LSTMT() = default;
 
         void resetState()
         {
@@ -25,18 +30,32 @@ namespace Nanoflare
             m_c.setZero();
         }
 
+        void setActivationPrecision(ActivationPrecision precision) { m_cell.setActivationPrecision(precision); }
+
+        // See LSTMCell::setInputAffine()
+        void setInputAffine(float scale, float shift) { m_cell.setInputAffine(scale, shift); }
+
+        // Whether the pruned W_hh runs the sparse kernel, see RecurrentKernel::SparseBlocks
+        bool isSparse() const { return m_cell.isSparse(); }
+
         inline void forward( const Eigen::Ref<const RowMatrixXf>& x, Eigen::Ref<RowMatrixXf> y ) noexcept
         {
             assert((y.rows() == x.rows() && y.cols() == m_cell.getHiddenSize()) && "LSTM.forward: Wrong output shape");
 
-            for(auto i = 0; i < x.rows(); i++)
-            {
-                m_cell.forward( x.row(i), m_h, m_c );
-                y.row(i) = m_h; // Assign h to output
-            }
+            // The input half of every time step in one GEMM, only W_hh * h is left in the recurrence
+            auto proj = m_proj.view( x.rows(), m_cell.getProjectionSize() );
+            m_cell.project( x, proj );
+            m_cell.forward( proj, m_h, m_c, y );
         }
 
-        void loadStateDict(std::map<std::string, nlohmann::json> state_dict)
+        // Scratch is only live during the call, see ScratchPlanner
+        void plan(ScratchPlanner& planner, size_t max_block_size)
+        {
+            planner.acquire( m_proj, max_block_size * m_cell.getProjectionSize() );
+            planner.release( m_proj );
+        }
+
+        void loadStateDict(const nlohmann::json& state_dict)
         {
             auto wih = loadMatrix( std::string("weight_ih_l0"), state_dict );
             auto whh = loadMatrix( std::string("weight_hh_l0"), state_dict );
@@ -53,9 +72,11 @@ namespace Nanoflare
         }
         
     private:
-        Eigen::VectorXf m_h, m_c;
-        RowMatrixXf m_y;
-        LSTMCell m_cell;
+        LSTMCellT<InputSize, HiddenSize> m_cell;
+        Eigen::VectorXf m_h, m_c; // padded to whole kernel blocks, see LSTMCell::getPaddedSize()
+        ScratchBuffer m_proj;     // (time, 4 * padded hidden size), projected input
     };
 
+    using LSTM = LSTMT<>;
+
 }
\ No newline at end of file
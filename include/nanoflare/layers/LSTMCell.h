@@ -2,85 +2,188 @@
 
 #include <Eigen/Dense>
 #include <cassert>
+#include "nanoflare/Activations.h"
+#include "nanoflare/AffineFold.h"
+#include "nanoflare/RecurrentKernel.h"
 #include "nanoflare/utils.h"
 
 namespace Nanoflare
 {
-    class LSTMCell
+    // Sizes given as template arguments are known at compile time: the input projection and
+    // the recurrent kernel loops are unrolled for them (see LSTMCell)
+    template<int InputSize = Eigen::Dynamic, int HiddenSize = Eigen::Dynamic>
+    class LSTMCellT
     {
     public:
         EIGEN_MAKE_ALIGNED_OPERATOR_NEW
 
-        LSTMCell(size_t input_size, size_t hidden_size, bool bias) :
+        using Kernel = RecurrentKernel<4>;
+
+        LSTMCellT(size_t input_size, size_t hidden_size, bool bias) :
             m_hiddenSize(hidden_size), m_inputSize(input_size), m_bias(bias),
-            m_wCombined(Eigen::MatrixXf::Zero(4*hidden_size, input_size + hidden_size + 1)),
-            m_extXH(Eigen::VectorXf::Zero(input_size + hidden_size + 1)),
-            m_gates(Eigen::VectorXf::Zero(4*hidden_size)),
-            m_cNew(Eigen::VectorXf::Zero(hidden_size)),
-            m_bih(Eigen::VectorXf::Zero(4*hidden_size)),
-            m_bhh(Eigen::VectorXf::Zero(4*hidden_size))
+            m_weights(Weights{
+                RowMatrixXf::Zero(input_size, 4 * Kernel::paddedSize(hidden_size)),
+                Eigen::RowVectorXf::Zero(4 * Kernel::paddedSize(hidden_size)),
+                RowMatrixXf::Zero(Kernel::numBlocks(hidden_size), hidden_size * 4 * Kernel::Width),
+                Eigen::VectorXf::Zero(4 * hidden_size), Eigen::VectorXf::Zero(4 * hidden_size) }),
+            m_proj(Eigen::RowVectorXf::Zero(4 * Kernel::paddedSize(hidden_size))),
+            m_h(Eigen::VectorXf::Zero(Kernel::paddedSize(hidden_size))),
+            m_c(Eigen::VectorXf::Zero(Kernel::paddedSize(hidden_size))),
+            m_hNext(Eigen::VectorXf::Zero(Kernel::paddedSize(hidden_size)))
         {
-            m_extXH(input_size + hidden_size) = 1.0f;
+            assert(matchesSize(InputSize, input_size) && matchesSize(HiddenSize, hidden_size) && "LSTMCell: Shape does not match the template arguments");
         }
-        ~LSTMCell() = default;
+        ~LSTMCellT() = default;
 
         void setWeightIH(const Eigen::Ref<RowMatrixXf>& m)
         {
             assert(m.rows() == 4 * m_hiddenSize && m.cols() == m_inputSize);
-            m_wCombined.leftCols(m_inputSize) = m;
+            editInput([&](Weights& w) { Kernel::interleaveColumns(m, m_hiddenSize, w.wih); });
         }
 
         void setWeightHH(const Eigen::Ref<RowMatrixXf>& m)
         {
             assert(m.rows() == 4 * m_hiddenSize && m.cols() == m_hiddenSize);
-            m_wCombined.middleCols(m_inputSize, m_hiddenSize) = m;
+            auto& w = m_weights.edit();
+            Kernel::interleaveBlocks(m, m_hiddenSize, w.whh);
+            w.sparse = Kernel::sparsity(w.whh, m_hiddenSize) >= Kernel::SparseThreshold ? Kernel::sparsify(w.whh, m_hiddenSize) : typename Kernel::SparseBlocks{};
         }
 
         void setBiasIH(const Eigen::Ref<Eigen::VectorXf>& v)
         {
             assert(v.size() == 4 * m_hiddenSize);
-            m_bih = v;
-            m_wCombined.col(m_inputSize + m_hiddenSize) = m_bih + m_bhh;
+            editInput([&](Weights& w) { w.bih = v; Kernel::interleaveVector(w.bih + w.bhh, m_hiddenSize, w.bias); });
         }
 
         void setBiasHH(const Eigen::Ref<Eigen::VectorXf>& v)
         {
             assert(v.size() == 4 * m_hiddenSize);
-            m_bhh = v;
-            m_wCombined.col(m_inputSize + m_hiddenSize) = m_bih + m_bhh;
+            editInput([&](Weights& w) { w.bhh = v; Kernel::interleaveVector(w.bih + w.bhh, m_hiddenSize, w.bias); });
         }
 
+        // Folds the map x * scale + shift of every input into W_ih and the biases, see AffineFold.
+        // Kept through the setters, (1, 0) removes it. Not real-time safe.
+        void setInputAffine(float scale, float shift) { editInput([&](Weights& w) { w.fold.setInput(scale, shift); }); }
+
         size_t getInputSize()  const { return m_inputSize; }
         size_t getHiddenSize() const { return m_hiddenSize; }
         bool   isBiased()      const { return m_bias; }
 
+        // Hidden and cell states are padded with zeros to whole kernel blocks, projections hold 4 of them
+        size_t getPaddedSize()     const { return Kernel::paddedSize(m_hiddenSize); }
+        size_t getProjectionSize() const { return 4 * getPaddedSize(); }
+
+        // Whether W_hh has enough zero packets to run the sparse kernel, see RecurrentKernel::SparseBlocks
+        bool isSparse() const { return !m_weights->sparse.empty(); }
+
+        void setActivationPrecision(ActivationPrecision precision) { m_precision = precision; }
+        ActivationPrecision getActivationPrecision() const { return m_precision; }
+
+        // Single time step
         inline void forward(const Eigen::Ref<const Eigen::VectorXf>& x,
                             Eigen::Ref<Eigen::VectorXf> h,
                             Eigen::Ref<Eigen::VectorXf> c) noexcept
         {
-            m_extXH.head(m_inputSize)                          = x;
-            m_extXH.segment(m_inputSize, m_hiddenSize)         = h;
-            // trailing 1 is set once in constructor and never changes
+            m_proj.noalias() = x.transpose() * m_weights->wih;
+            m_proj += m_weights->bias;
+            m_h.head(m_hiddenSize) = h;
+            m_c.head(m_hiddenSize) = c;
+            forward(m_proj, m_h, m_c, Eigen::Map<RowMatrixXf>(h.data(), 1, m_hiddenSize));
+            c = m_c.head(m_hiddenSize);
+        }
+
+        // Input to hidden half of every time step of x (time, in) as one GEMM: proj (time, getProjectionSize())
+        inline void project(const Eigen::Ref<const RowMatrixXf>& x, Eigen::Ref<RowMatrixXf> proj) noexcept
+        {
+            assert(x.cols() == m_inputSize && proj.rows() == x.rows() && proj.cols() == getProjectionSize() && "LSTMCell.project: Wrong shape");
+            const auto& w = *m_weights;
+            const Eigen::Map<const Eigen::Matrix<float, InputSize, ProjectionSize, Eigen::RowMajor>> wih(w.wih.data(), m_inputSize, getProjectionSize());
+            const Eigen::Map<const Eigen::Matrix<float, 1, ProjectionSize>> bias(w.bias.data(), getProjectionSize());
+            proj.noalias() = x * wih;
+            proj.rowwise() += bias;
+        }
+
+        // Recurrence over the projected input, h and c (getPaddedSize()) are the states carried
+        // from one block to the next, y (time, hidden) receives h at every time step
+        inline void forward(const Eigen::Ref<const RowMatrixXf>& proj,
+                            Eigen::Ref<Eigen::VectorXf> h,
+                            Eigen::Ref<Eigen::VectorXf> c,
+                            Eigen::Ref<RowMatrixXf> y) noexcept
+        {
+            assert(proj.cols() == getProjectionSize() && h.size() == getPaddedSize() && c.size() == getPaddedSize() && "LSTMCell.forward: Wrong input shape");
+            assert(y.rows() == proj.rows() && y.cols() == m_hiddenSize && "LSTMCell.forward: Wrong output shape");
+            switch (m_precision)
+            {
+                case ActivationPrecision::Exact:      forward<ActivationPrecision::Exact>(proj, h, c, y); break;
+                case ActivationPrecision::Rational:   forward<ActivationPrecision::Rational>(proj, h, c, y); break;
+                case ActivationPrecision::Polynomial: forward<ActivationPrecision::Polynomial>(proj, h, c, y); break;
+            }
+        }
 
-            m_gates.noalias() = m_wCombined * m_extXH;
+        template<ActivationPrecision P>
+        inline void forward(const Eigen::Ref<const RowMatrixXf>& proj,
+                            Eigen::Ref<Eigen::VectorXf> h,
+                            Eigen::Ref<Eigen::VectorXf> c,
+                            Eigen::Ref<RowMatrixXf> y) noexcept
+        {
+            using Lane = typename Kernel::Lane;
+            constexpr int W = Kernel::Width;
+            const auto& weights = *m_weights;
 
-            auto i_gate = m_gates.head(m_hiddenSize);
-            auto f_gate = m_gates.segment(m_hiddenSize, m_hiddenSize);
-            auto g_gate = m_gates.segment(2 * m_hiddenSize, m_hiddenSize);
-            auto o_gate = m_gates.tail(m_hiddenSize);
+            const Eigen::Index num_blocks = HiddenSize == Eigen::Dynamic ? weights.whh.rows() : Kernel::numBlocks(HiddenSize);
+            for (Eigen::Index t = 0; t < proj.rows(); ++t)
+            {
+                for (Eigen::Index b = 0; b < num_blocks; ++b)
+                {
+                    // Gates i, f, g, o start from the projected input and the fused biases
+                    const float* p = proj.row(t).data() + b * 4 * W;
+                    Lane acc[4] = { Eigen::Map<const Lane>(p), Eigen::Map<const Lane>(p + W),
+                                    Eigen::Map<const Lane>(p + 2 * W), Eigen::Map<const Lane>(p + 3 * W) };
+                    if (weights.sparse.empty())
+                        Kernel::template accumulate<HiddenSize>(weights.whh.row(b).data(), h.data(), m_hiddenSize, acc);
+                    else
+                        Kernel::accumulate(weights.sparse, b, h.data(), acc);
 
-            m_cNew.array() = f_gate.array().logistic() * c.array()
-                           + i_gate.array().logistic() * g_gate.array().tanh();
-            c = m_cNew;
-            h = o_gate.array().logistic() * m_cNew.array().tanh();
+                    // c is only read by its own block, h by all of them and is double buffered
+                    auto c_block = c.template segment<W>(b * W).array();
+                    c_block = Activations::sigmoid<P>(acc[1]) * c_block + Activations::sigmoid<P>(acc[0]) * Activations::tanh<P>(acc[2]);
+                    m_hNext.template segment<W>(b * W) = (Activations::sigmoid<P>(acc[3]) * Activations::tanh<P>(c_block)).matrix();
+                }
+                h = m_hNext;
+                y.row(t) = h.head(m_hiddenSize).transpose();
+            }
         }
 
     private:
+        static constexpr int ProjectionSize = Kernel::projectionSize(HiddenSize);
+
+        struct Weights
+        {
+            RowMatrixXf        wih;   // W_ih^T, shape (in, 4Hp) gate-interleaved, see RecurrentKernel
+            Eigen::RowVectorXf bias;  // b_ih + b_hh, shape (4Hp) gate-interleaved
+            RowMatrixXf        whh;   // W_hh per block of hidden units, see RecurrentKernel
+            Eigen::VectorXf    bih, bhh; // kept to correctly fuse when set independently
+            typename Kernel::SparseBlocks sparse; // non-zero packets of whh when it is sparse enough
+            AffineFold         fold;  // folded into wih and bias
+        };
+
+        // Edits the input projection without the input map, then folds it again
+        template<typename Edit>
+        void editInput(Edit&& edit)
+        {
+            auto& w = m_weights.edit();
+            w.fold.restore(w.wih.transpose(), w.bias);
+            edit(w);
+            w.fold.apply(w.wih.transpose(), w.bias);
+        }
+
         size_t m_inputSize, m_hiddenSize;
         bool m_bias;
-        Eigen::MatrixXf m_wCombined;  // [W_ih | W_hh | (b_ih+b_hh)], shape (4H, in+H+1)
-        Eigen::VectorXf m_extXH;      // [x; h; 1], trailing 1 fixed at construction
-        Eigen::VectorXf m_gates, m_cNew;
-        Eigen::VectorXf m_bih, m_bhh; // kept to correctly fuse when set independently
+        SharedWeights<Weights> m_weights;
+        Eigen::RowVectorXf m_proj;         // single time step projection
+        Eigen::VectorXf m_h, m_c, m_hNext; // padded states
+        ActivationPrecision m_precision = ActivationPrecision::Exact;
     };
+
+    using LSTMCell = LSTMCellT<>;
 }
@@ -1,7 +1,13 @@
 #pragma once
 
 #include <Eigen/Dense>
+#include <algorithm>
 #include <cassert>
+#include "nanoflare/Epilogue.h"
+#include "nanoflare/LowRank.h"
+#include "nanoflare/QuantizedGemm.h"
+#include "nanoflare/ScratchArena.h"
+#include "nanoflare/SparseGemm.h"
 #include "nanoflare/utils.h"
 
 namespace Nanoflare
@@ -12,59 +18,148 @@ namespace Nanoflare
         EIGEN_MAKE_ALIGNED_OPERATOR_NEW
 
         Linear(size_t in_channels, size_t out_channels, bool bias) : m_inChannels(in_channels), m_outChannels(out_channels), m_bias(bias),
-            m_w(RowMatrixXf::Zero(out_channels,in_channels)),
-            m_transW(RowMatrixXf::Zero(in_channels,out_channels)),
-            m_b(Eigen::RowVectorXf::Zero(out_channels))
+            m_weights(Weights{ RowMatrixXf::Zero(out_channels,in_channels), RowMatrixXf::Zero(in_channels,out_channels), Eigen::RowVectorXf::Zero(out_channels) })
         {}
         ~Linear() = default;
         
-        inline void forward( const Eigen::Ref<const RowMatrixXf>& x, Eigen::Ref<RowMatrixXf> y ) const noexcept
+        // Time-major y (time, out) = x (time, in) w^T followed by the epilogue, whose bias is the
+        // layer's own, in one pass over the output, see Epilogue::applyTransposed()
+        inline void forward( const Eigen::Ref<const RowMatrixXf>& x, Eigen::Ref<RowMatrixXf> y, const Epilogue& epilogue = Epilogue() ) const noexcept
         {
-            assert(x.cols() == m_transW.rows() && "Linear.forward: Wrong input shape");
-            assert((y.rows() == x.rows() && y.cols() == m_transW.cols()) && "Linear.forward: Wrong output shape");
+            const auto& w = *m_weights;
+            assert(x.cols() == w.transW.rows() && "Linear.forward: Wrong input shape");
+            assert((y.rows() == x.rows() && y.cols() == w.transW.cols()) && "Linear.forward: Wrong output shape");
 
-            if(x.data() == y.data())
+            if(m_calibrating && x.size() > 0)
+                m_inputRange = std::max( m_inputRange, x.cwiseAbs().maxCoeff() );
+            if(w.quantized.mode != Quantization::None)
             {
-                RowMatrixXf temp(y.rows(), y.cols());
-                temp.noalias() = x * m_transW;
-                if( m_bias )
-                    temp.rowwise() += m_b;
-                y = std::move(temp);
+                // Time steps are columns of the integer kernel, that has the bias folded in
+                auto temp = scratchView( m_temp, y.cols(), y.rows() );
+                QuantizedGemm::forward( w.quantized, x.transpose(), m_packed.words( QuantizedGemm::packedSize(x.cols(), x.rows(), w.quantized.mode) ), temp );
+                y = temp.transpose();
+                epilogue.withBias( nullptr ).applyTransposed( y );
+                return;
             }
-            else
+
+            if(!w.factors.empty())
             {
-                y.noalias() = x * m_transW;
-                if( m_bias )
-                    y.rowwise() += m_b;
+                // x is read entirely before y is written
+                auto t = m_factored.view( x.rows(), w.factors.rank() );
+                t.noalias() = x * w.factors.v.transpose();
+                y.noalias() = t * w.factors.u.transpose();
             }
+            else if(x.data() == y.data())
+            {
+                auto temp = scratchView( m_temp, y.rows(), y.cols() );
+                temp.noalias() = x * w.transW;
+                y = temp;
+            }
+            else
+                y.noalias() = x * w.transW;
+            epilogue.withBias( m_bias ? w.b.data() : nullptr ).applyTransposed( y );
         }
 
-        inline void forwardTranspose(const Eigen::Ref<const RowMatrixXf>& x, Eigen::Ref<RowMatrixXf> y ) const noexcept
+        // Channel-major y (out, time) = w x (in, time) followed by the epilogue, whose bias is the
+        // layer's own, applied to the output as it is computed, see Epilogue
+        inline void forwardTranspose(const Eigen::Ref<const RowMatrixXf>& x, Eigen::Ref<RowMatrixXf> y, const Epilogue& epilogue = Epilogue() ) const noexcept
         {
-            assert(x.rows() == m_w.cols() && "Linear.forwardTranspose: Wrong input shape");
-            assert((y.rows() == m_w.rows() && y.cols() == x.cols()) && "Linear.forwardTranspose: Wrong output shape");
+            const auto& w = *m_weights;
+            assert(x.rows() == w.w.cols() && "Linear.forwardTranspose: Wrong input shape");
+            assert((y.rows() == w.w.rows() && y.cols() == x.cols()) && "Linear.forwardTranspose: Wrong output shape");
 
-            if(x.data() == y.data())
+            if(m_calibrating && x.size() > 0)
+                m_inputRange = std::max( m_inputRange, x.cwiseAbs().maxCoeff() );
+            if(w.quantized.mode != Quantization::None)
+                QuantizedGemm::forward( w.quantized, x, m_packed.words( QuantizedGemm::packedSize(x.rows(), x.cols(), w.quantized.mode) ), y, epilogue );
+            else if(x.data() == y.data())
             {
-                RowMatrixXf temp(y.rows(), y.cols());
-                temp.noalias() = m_w * x;
-                if( m_bias )
-                    temp.colwise() += m_b.transpose();
-                y = std::move(temp);
+                auto temp = scratchView( m_temp, y.rows(), y.cols() );
+                product( w, x, temp, epilogue );
+                y = temp;
             }
             else
+                product( w, x, y, epilogue );
+        }
+
+        // Allocates the workspace of in-place calls over up to max_block_size rows (forward)
+        // or columns (forwardTranspose)
+        void prepare(size_t max_block_size) { reserveScratch(m_temp, max_block_size, m_outChannels); }
+
+        // Scratch of the quantized and factorized products over up to max_block_size time steps, see ScratchPlanner
+        void plan(ScratchPlanner& planner, size_t max_block_size)
+        {
+            const auto mode = m_weights->quantized.mode;
+            if(mode != Quantization::None)
+            {
+                planner.acquire( m_packed, QuantizedGemm::packedSize(m_inChannels, max_block_size, mode) );
+                planner.release( m_packed );
+            }
+            else if(!m_weights->factors.empty())
             {
-                y.noalias() = m_w * x;
-                if (m_bias)
-                    y.colwise() += m_b.transpose(); // broadcast bias across time
+                planner.acquire( m_factored, m_weights->factors.rank() * max_block_size );
+                planner.release( m_factored );
             }
         }
 
+        // See CausalDilatedConv1d::setCalibration()
+        void setCalibration(bool calibrating)
+        {
+            m_calibrating = calibrating;
+            if(calibrating)
+                m_inputRange = 0.f;
+        }
+
+        // See CausalDilatedConv1d::setQuantization()
+        void setQuantization(Quantization mode)
+        {
+            QuantizedGemm::Weights quantized;
+            if(mode != Quantization::None)
+                quantized = QuantizedGemm::quantize( m_weights->w, m_weights->b.transpose(), m_inputRange, mode );
+            m_weights.edit().quantized = std::move( quantized );
+        }
+        Quantization getQuantization() const { return m_weights->quantized.mode; }
+
+        // See CausalDilatedConv1d::setLowRank(), factors take precedence over sparse weights
+        void setLowRank(float energy, Eigen::Index max_rank = 0)
+        {
+            m_rankEnergy = energy;
+            m_maxRank = max_rank;
+            auto factors = LowRank::factorize( m_weights->w, energy, max_rank );
+            m_weights.edit().factors = std::move( factors );
+        }
+
+        // Rank of the factors, 0 with the full weights, and their relative reconstruction error
+        Eigen::Index getRank() const { return m_weights->factors.rank(); }
+        float getLowRankError() const { return m_weights->factors.error; }
+
+        // Weights of a and b side by side, so that one product over the stacked inputs [x_a; x_b]
+        // gives a(x_a) + b(x_b), keeping the low rank and quantization settings of this layer
+        void stack(const Linear& a, const Linear& b)
+        {
+            assert(a.m_outChannels == m_outChannels && b.m_outChannels == m_outChannels && "Linear.stack: Wrong output channels");
+            assert(a.m_inChannels + b.m_inChannels == m_inChannels && m_bias && "Linear.stack: Wrong input channels");
+            RowMatrixXf w( m_outChannels, m_inChannels );
+            w << a.m_weights->w, b.m_weights->w;
+            Eigen::RowVectorXf bias = Eigen::RowVectorXf::Zero( m_outChannels );
+            if(a.m_bias)
+                bias += a.m_weights->b;
+            if(b.m_bias)
+                bias += b.m_weights->b;
+            setWeight( w );
+            setBias( bias );
+            setLowRank( m_rankEnergy, m_maxRank );
+            setQuantization( getQuantization() );
+        }
+
+        // Whether forwardTranspose() uses the sparse kernel, see SparseGemm
+        bool isSparse() const { return !m_weights->sparse.empty(); }
+
         size_t getInChannels() const { return m_inChannels; }
         size_t getOutChannels() const { return m_outChannels; }
         bool useBias() const { return m_bias; }
         
-        void loadStateDict(std::map<std::string, nlohmann::json> state_dict)
+        void loadStateDict(const nlohmann::json& state_dict)
         {
             auto w = loadMatrix( std::string("weight"), state_dict );
             setWeight( w );
@@ -73,27 +168,80 @@ namespace Nanoflare
                 auto b = loadVector( std::string("bias"), state_dict );
                 setBias( b );
             }
+            setLowRank( m_rankEnergy, m_maxRank );
+            setQuantization( getQuantization() );
         }
 
     private:
 
+        struct Weights
+        {
+            RowMatrixXf w, transW;
+            Eigen::RowVectorXf b;
+            QuantizedGemm::Weights quantized; // with b folded in
+            SparseGemm::Weights sparse;       // of pruned w, with b
+            LowRank::Factors factors;         // of w, without b
+        };
+
+        // y = epilogue(w x + b) of forwardTranspose(): factorized, or sparse over the whole blocks of time steps when w is
+        inline void product( const Weights& w, const Eigen::Ref<const RowMatrixXf>& x, Eigen::Ref<RowMatrixXf> y, const Epilogue& epilogue ) const noexcept
+        {
+            const Epilogue biased = epilogue.withBias( m_bias ? w.b.data() : nullptr );
+            if(!w.factors.empty())
+            {
+                biased.run( y, [&](Eigen::Index t, Eigen::Index n) {
+                    LowRank::forward( w.factors, x.middleCols(t, n), m_factored.view(w.factors.rank(), n), y.middleCols(t, n) );
+                });
+                return;
+            }
+
+            const Eigen::Index sparse_cols = w.sparse.empty() ? 0 : x.cols() / SparseGemm::Width * SparseGemm::Width;
+            if(sparse_cols > 0)
+                SparseGemm::forward( w.sparse, x.leftCols(sparse_cols), y.leftCols(sparse_cols), epilogue );
+
+            const Eigen::Index dense_cols = x.cols() - sparse_cols;
+            if(dense_cols > 0)
+            {
+                auto dense = y.rightCols(dense_cols);
+                biased.fromTimeStep( sparse_cols ).run( dense, [&](Eigen::Index t, Eigen::Index n) {
+                    dense.middleCols(t, n).noalias() = w.w * x.middleCols(sparse_cols + t, n);
+                });
+            }
+        }
+
         void setWeight(const Eigen::Ref<RowMatrixXf>& m)
         {
             assert(m.rows() == m_outChannels);
             assert(m.cols() == m_inChannels);
-            m_w = m;
-            m_transW = m.transpose();
+            auto& w = m_weights.edit();
+            w.w = m;
+            w.transW = m.transpose();
+            sparsify( w );
         }
 
         void setBias(const Eigen::Ref<Eigen::RowVectorXf>& v)
         {
             assert(v.size() == m_outChannels);
-            m_b = v;
+            auto& w = m_weights.edit();
+            w.b = v;
+            sparsify( w );
+        }
+
+        // Pruned weights (see loadMatrix()) with enough zeros run the sparse kernel in forwardTranspose()
+        static void sparsify(Weights& w)
+        {
+            w.sparse = SparseGemm::sparsity(w.w) >= SparseGemm::SparseThreshold ? SparseGemm::sparsify(w.w, w.b.transpose()) : SparseGemm::Weights{};
         }
 
-        RowMatrixXf m_w, m_transW;
-        Eigen::RowVectorXf m_b;
+        SharedWeights<Weights> m_weights;
         size_t m_inChannels, m_outChannels;
         bool m_bias;
+        mutable RowMatrixXf m_temp; // product buffer when x and y alias or of quantized forward(), grow-only
+        mutable ScratchBuffer m_packed; // quantized input, see QuantizedGemm
+        mutable ScratchBuffer m_factored; // v x of factorized weights
+        bool m_calibrating = false;
+        mutable float m_inputRange = 0.f; // largest input magnitude seen while calibrating
+        float m_rankEnergy = 1.f; // truncation of setLowRank()
+        Eigen::Index m_maxRank = 0;
     };
 }
\ No newline at end of file
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <Eigen/Dense>
+#include "nanoflare/Epilogue.h"
 #include "nanoflare/utils.h"
 
 namespace Nanoflare
@@ -13,13 +14,13 @@ namespace Nanoflare
         PReLU(size_t num_channels) : m_numChannels(num_channels), m_w(Eigen::RowVectorXf::Zero(num_channels)) {}
         ~PReLU() = default;
 
-        inline void apply( Eigen::Ref<RowMatrixXf> x ) const noexcept
-        {
-            for( auto col: x.colwise() )
-                col = col.cwiseMax( 0.f ) + col.cwiseMin( 0.f ).cwiseProduct( m_w.transpose() );
-        }
+        // x (channels, time)
+        inline void apply( Eigen::Ref<RowMatrixXf> x ) const noexcept { getEpilogue().apply( x ); }
+
+        // The activation as the epilogue of the layer before, see Epilogue
+        Epilogue getEpilogue() const noexcept { return Epilogue().withPReLU( m_w->data() ); }
 
-        void loadStateDict(std::map<std::string, nlohmann::json> state_dict)
+        void loadStateDict(const nlohmann::json& state_dict)
         {
             auto w = loadVector( std::string("weight"), state_dict );
             setWeight( w );
@@ -30,10 +31,10 @@ namespace Nanoflare
         void setWeight(const Eigen::Ref<Eigen::RowVectorXf>& v)
         {
             assert(v.size() == m_numChannels);
-            m_w = v;
+            m_w.edit() = v;
         }
 
-        Eigen::RowVectorXf m_w;
+        SharedWeights<Eigen::RowVectorXf> m_w;
         size_t m_numChannels;
     };
 }
\ No newline at end of file
@@ -1,6 +1,10 @@
 #pragma once
 
-#include "nanoflare/Functional.h"
+#include <algorithm>
+#include <cassert>
+#include <utility>
+#include "nanoflare/Epilogue.h"
+#include "nanoflare/ScratchArena.h"
 #include "nanoflare/layers/Linear.h"
 
 namespace Nanoflare
@@ -11,9 +15,9 @@ namespace Nanoflare
     public:
         PlainSequential(size_t in_channels, size_t out_channels, size_t hidden_channels, size_t num_hidden_layers, float negative_slope = 0.01f) 
             : m_inChannels(in_channels), m_outChannels(out_channels), m_hiddenChannels(hidden_channels),
-            m_directLinear(in_channels, out_channels, false),
+            m_stackedChannels(in_channels != out_channels ? in_channels : 0),
             m_inputLinear(in_channels, hidden_channels, true),
-            m_outputLinear(hidden_channels, out_channels, true),
+            m_outputLinear(hidden_channels + m_stackedChannels, out_channels, true),
             m_negativeSlope(negative_slope)
         {
             for(int i = 0; i < num_hidden_layers; i++)
@@ -21,81 +25,107 @@ namespace Nanoflare
         }
         ~PlainSequential() = default;
 
+        // x (time, in) and y (time, out), see forwardTranspose()
         inline void forward( const Eigen::Ref<const RowMatrixXf>& x, Eigen::Ref<RowMatrixXf> y ) noexcept
         {
-            if (m_temp.rows() != x.rows() || m_temp.cols() != m_hiddenChannels)
-                m_temp.resize(x.rows(), m_hiddenChannels);
-
-            m_inputLinear.forward( x, m_temp );
-            Functional::LeakyReLU( m_temp, m_negativeSlope );
-            for(auto& linear: m_hiddenLinear)
+            assert(x.cols() == m_inChannels && y.cols() == m_outChannels && y.rows() == x.rows() && "PlainSequential.forward: Wrong shape");
+            if(x.data() == y.data())
             {
-                linear.forward( m_temp, m_temp );
-                Functional::LeakyReLU( m_temp, m_negativeSlope );
+                auto y_temp = m_y.view( x.rows(), m_outChannels );
+                forward( x, y_temp );
+                y = y_temp;
+                return;
             }
-
-            if(m_y.rows() != x.rows() || m_y.cols() != m_outChannels)
-                m_y.resize(x.rows(), m_outChannels);
-        
-            m_outputLinear.forward( m_temp, m_y );
-
-            if(m_inChannels == m_outChannels)
-                m_y += x;
-            else
+            const Eigen::Index tile = tileWidth( x.rows() );
+            for(Eigen::Index t = 0; t < x.rows(); t += tile)
             {
-                if (m_temp.rows() != x.rows() || m_temp.cols() != m_outChannels)
-                    m_temp.resize(x.rows(), m_outChannels);
-                m_directLinear.forward( x, m_temp );
-                m_y += m_temp;
+                const Eigen::Index n = std::min( tile, x.rows() - t );
+                forwardTile( x.middleRows(t, n), y.middleRows(t, n) );
             }
-
-            y = m_y;
         }
 
+        // x (in, time) and y (out, time). The whole MLP runs over tiles of time steps whose hidden
+        // activations fit in L1 and writes straight into y, only in-place calls go through scratch.
         inline void forwardTranspose( const Eigen::Ref<const RowMatrixXf>& x, Eigen::Ref<RowMatrixXf> y ) noexcept
         {
-            if (m_temp.rows() != m_hiddenChannels || m_temp.cols() != x.cols())
-                m_temp.resize(m_hiddenChannels, x.cols());
-
-            m_inputLinear.forwardTranspose( x, m_temp );
-            Functional::LeakyReLU( m_temp, m_negativeSlope );
-            for(auto& linear: m_hiddenLinear)
+            assert(x.rows() == m_inChannels && y.rows() == m_outChannels && y.cols() == x.cols() && "PlainSequential.forwardTranspose: Wrong shape");
+            if(x.data() == y.data())
+            {
+                auto y_temp = m_y.view( m_outChannels, x.cols() );
+                forwardTranspose( x, y_temp );
+                y = y_temp;
+                return;
+            }
+            const Eigen::Index tile = tileWidth( x.cols() );
+            for(Eigen::Index t = 0; t < x.cols(); t += tile)
             {
-                linear.forwardTranspose( m_temp, m_temp );
-                Functional::LeakyReLU( m_temp, m_negativeSlope );
+                const Eigen::Index n = std::min( tile, x.cols() - t );
+                forwardTransposeTile( x.middleCols(t, n), y.middleCols(t, n) );
             }
+        }
 
-            if(m_y.rows() != m_outChannels || m_y.cols() != x.cols())
-                m_y.resize(m_outChannels, x.cols());
+        // Scratch lifetimes of forward() and forwardTranspose() for up to max_block_size time
+        // steps, see ScratchPlanner. Linear layers never run in place here, in-place calls
+        // of this layer grow a buffer of their own on first use.
+        void plan(ScratchPlanner& planner, size_t max_block_size)
+        {
+            const size_t tile = static_cast<size_t>( tileWidth( max_block_size ) );
+            planner.acquire( m_hiddenA, (m_hiddenChannels + m_stackedChannels) * tile );
+            planner.acquire( m_hiddenB, (m_hiddenChannels + m_stackedChannels) * tile );
+            m_inputLinear.plan( planner, tile );
+            for(auto& linear: m_hiddenLinear)
+                linear.plan( planner, tile );
+            m_outputLinear.plan( planner, tile );
+            planner.release( m_hiddenA );
+            planner.release( m_hiddenB );
+        }
 
-            m_outputLinear.forwardTranspose( m_temp, m_y );
+        // See CausalDilatedConv1d::setCalibration()
+        void setCalibration(bool calibrating)
+        {
+            m_inputLinear.setCalibration( calibrating );
+            m_outputLinear.setCalibration( calibrating );
+            for(auto& linear: m_hiddenLinear)
+                linear.setCalibration( calibrating );
+        }
 
-            if(m_inChannels == m_outChannels)
-                m_y += x;
-            else
-            {
-                if (m_temp.rows() != m_outChannels || m_temp.cols() != x.cols())
-                    m_temp.resize(m_outChannels, x.cols());
-                m_directLinear.forwardTranspose( x, m_temp );
-                m_y += m_temp;
-            }
+        // See CausalDilatedConv1d::setQuantization()
+        void setQuantization(Quantization mode)
+        {
+            m_inputLinear.setQuantization( mode );
+            m_outputLinear.setQuantization( mode );
+            for(auto& linear: m_hiddenLinear)
+                linear.setQuantization( mode );
+        }
+        Quantization getQuantization() const { return m_inputLinear.getQuantization(); }
 
-            y = m_y;
+        // See CausalDilatedConv1d::setLowRank()
+        void setLowRank(float energy, Eigen::Index max_rank = 0)
+        {
+            m_inputLinear.setLowRank( energy, max_rank );
+            m_outputLinear.setLowRank( energy, max_rank );
+            for(auto& linear: m_hiddenLinear)
+                linear.setLowRank( energy, max_rank );
         }
 
-        void loadStateDict(std::map<std::string, nlohmann::json> state_dict)
+        // With different input and output channels, the direct linear is stacked into the output
+        // linear, see Linear::stack()
+        void loadStateDict(const nlohmann::json& state_dict)
         {
             state_dict.at("negative_slope").get_to(m_negativeSlope);
-            auto direct_linear_state_dict = state_dict[std::string("direct_linear")].get<std::map<std::string, nlohmann::json>>();
-            m_directLinear.loadStateDict( direct_linear_state_dict );
-            auto input_linear_state_dict = state_dict[std::string("input_linear")].get<std::map<std::string, nlohmann::json>>();
-            m_inputLinear.loadStateDict( input_linear_state_dict );
-            auto output_linear_state_dict = state_dict[std::string("output_linear")].get<std::map<std::string, nlohmann::json>>();
-            m_outputLinear.loadStateDict( output_linear_state_dict );
+            m_inputLinear.loadStateDict( state_dict.at("input_linear") );
+            if(m_stackedChannels == 0)
+                m_outputLinear.loadStateDict( state_dict.at("output_linear") );
+            else
+            {
+                Linear output_linear(m_hiddenChannels, m_outChannels, true), direct_linear(m_inChannels, m_outChannels, false);
+                output_linear.loadStateDict( state_dict.at("output_linear") );
+                direct_linear.loadStateDict( state_dict.at("direct_linear") );
+                m_outputLinear.stack( output_linear, direct_linear );
+            }
             for(int i = 0; i < m_hiddenLinear.size(); i++)
             {
-                auto hidden_linear_state_dict = state_dict[std::string("hidden_linear.") + std::to_string(i)].get<std::map<std::string, nlohmann::json>>();
-                m_hiddenLinear[i].loadStateDict( hidden_linear_state_dict );
+                m_hiddenLinear[i].loadStateDict( state_dict.at(std::string("hidden_linear.") + std::to_string(i)) );
             }
         }
 
@@ -103,10 +133,74 @@ namespace Nanoflare
         size_t getOutChannels() { return m_outChannels; }
         
     private:
-        Linear m_directLinear, m_inputLinear, m_outputLinear;
-        std::vector<Linear> m_hiddenLinear;
+        // Time steps per tile: the two hidden buffers fill at most half of a 32 KB L1. Wide
+        // layers, whose tiles would be too narrow for the GEMMs, run whole blocks.
+        inline Eigen::Index tileWidth(Eigen::Index len) const noexcept
+        {
+            const Eigen::Index tile = 2048 / (Eigen::Index)(m_hiddenChannels + m_stackedChannels) / 16 * 16;
+            return tile < MinTileWidth ? std::max<Eigen::Index>( len, 1 ) : std::max<Eigen::Index>( std::min( tile, len ), 1 );
+        }
+
+        // Hidden layers ping-pong between two scratch buffers, so Linear never runs in place. The
+        // activations and the residual add are epilogues of the Linear layers, see Epilogue.
+        // Stacked, the last hidden buffer gets a copy of x next to the hidden channels for the
+        // output linear.
+        inline void forwardTile( const Eigen::Ref<const RowMatrixXf>& x, Eigen::Ref<RowMatrixXf> y ) noexcept
+        {
+            auto a = m_hiddenA.view( x.rows(), m_hiddenChannels + m_stackedChannels );
+            auto b = m_hiddenB.view( x.rows(), m_hiddenChannels + m_stackedChannels );
+            auto* in = &a;
+            auto* out = &b;
+            const Epilogue activation = Epilogue().withActivation( Epilogue::Activation::LeakyReLU, m_negativeSlope );
+
+            m_inputLinear.forward( x, in->leftCols(m_hiddenChannels), activation );
+            for(auto& linear: m_hiddenLinear)
+            {
+                linear.forward( in->leftCols(m_hiddenChannels), out->leftCols(m_hiddenChannels), activation );
+                std::swap( in, out );
+            }
+
+            if(m_stackedChannels == 0)
+                m_outputLinear.forward( *in, y, Epilogue().withResidual( x ) );
+            else
+            {
+                in->rightCols(m_stackedChannels) = x;
+                m_outputLinear.forward( *in, y );
+            }
+        }
+
+        // See forwardTile()
+        inline void forwardTransposeTile( const Eigen::Ref<const RowMatrixXf>& x, Eigen::Ref<RowMatrixXf> y ) noexcept
+        {
+            auto a = m_hiddenA.view( m_hiddenChannels + m_stackedChannels, x.cols() );
+            auto b = m_hiddenB.view( m_hiddenChannels + m_stackedChannels, x.cols() );
+            auto* in = &a;
+            auto* out = &b;
+            const Epilogue activation = Epilogue().withActivation( Epilogue::Activation::LeakyReLU, m_negativeSlope );
+
+            m_inputLinear.forwardTranspose( x, in->topRows(m_hiddenChannels), activation );
+            for(auto& linear: m_hiddenLinear)
+            {
+                linear.forwardTranspose( in->topRows(m_hiddenChannels), out->topRows(m_hiddenChannels), activation );
+                std::swap( in, out );
+            }
+
+            if(m_stackedChannels == 0)
+                m_outputLinear.forwardTranspose( *in, y, Epilogue().withResidual( x ) );
+            else
+            {
+                in->bottomRows(m_stackedChannels) = x;
+                m_outputLinear.forwardTranspose( *in, y );
+            }
+        }
+
+        static constexpr Eigen::Index MinTileWidth = 32;
+
         size_t m_inChannels, m_outChannels, m_hiddenChannels;
+        size_t m_stackedChannels; // input channels stacked into m_outputLinear, 0 when the residual is x itself
+        Linear m_inputLinear, m_outputLinear;
+        std::vector<Linear> m_hiddenLinear;
         float m_negativeSlope;
-        RowMatrixXf m_temp, m_y;
+        ScratchBuffer m_hiddenA, m_hiddenB, m_y;
     };
 }
\ No newline at end of file
@@ -1,9 +1,13 @@
 #pragma once
 
+#include <algorithm>
 #include <cassert>
-#include "nanoflare/layers/Conv1d.h"
 #include "nanoflare/layers/CausalDilatedConv1d.h"
-#include "nanoflare/Functional.h"
+#include "nanoflare/DirectConv.h"
+#include "nanoflare/LowRank.h"
+#include "nanoflare/QuantizedGemm.h"
+#include "nanoflare/ScratchArena.h"
+#include "nanoflare/WeightPrecision.h"
 #include "nanoflare/utils.h"
 
 namespace Nanoflare
@@ -12,73 +16,221 @@ namespace Nanoflare
     class ResidualBlock
     {
     public:
-        ResidualBlock(size_t num_channels, size_t kernel_size, size_t dilation, bool gated) 
+        ResidualBlock(size_t num_channels, size_t kernel_size, size_t dilation, bool gated)
             : m_numChannels(num_channels), m_kernelSize(kernel_size), m_gated(gated),
             m_inputConv(num_channels,
                 gated ? 2 * num_channels : num_channels,
-                kernel_size, true, dilation), 
-            m_residualConv(num_channels, num_channels, 1, true),
-            m_skipConv(num_channels, num_channels, 1, true)
+                kernel_size, true, dilation),
+            m_outputWeights(OutputWeights{ RowMatrixXf::Zero(2 * num_channels, num_channels + 1) })
         {}
         ~ResidualBlock() = default;
 
+        // state (2 * num_channels, time): rows [0, num_channels) hold the residual stream, the
+        // input of the block updated in place, rows [num_channels, 2 * num_channels) the sum of
+        // the skip outputs that the block adds its own to
+        inline void forward( Eigen::Ref<RowMatrixXf> state ) noexcept
+        {
+            assert(state.rows() == 2 * m_numChannels && "ResidualBlock.forward: Wrong state shape");
+
+            // Gated activation straight from the dilated conv, z gets a last row of ones for the biases
+            auto z = m_z.view( m_numChannels + 1, state.cols() );
+            if(m_gated)
+                m_inputConv.forwardActivated<DirectConv::Activation::GatedTanh>( state.topRows(m_numChannels), z.topRows(m_numChannels), m_precision );
+            else
+                m_inputConv.forwardActivated<DirectConv::Activation::Tanh>( state.topRows(m_numChannels), z.topRows(m_numChannels), m_precision );
+            z.row(m_numChannels).setOnes();
+            if(m_calibrating && state.cols() > 0)
+                m_outputRange = std::max( m_outputRange, z.topRows(m_numChannels).cwiseAbs().maxCoeff() );
+
+            // Residual and skip 1x1 convs stacked into one GEMM, that accumulates into the state
+            const auto& output_weights = *m_outputWeights;
+            const auto& quantized = output_weights.quantized;
+            if(quantized.mode != Quantization::None)
+            {
+                int32_t* packed = m_packed.words( QuantizedGemm::packedSize(m_numChannels, state.cols(), quantized.mode) );
+                QuantizedGemm::forward<true>( quantized, z.topRows(m_numChannels), packed, state );
+            }
+            else if(!output_weights.factors.empty())
+            {
+                const auto& factors = output_weights.factors;
+                LowRank::forward<true>( factors, z.topRows(m_numChannels), m_factored.view(factors.rank(), state.cols()), state );
+                state.colwise() += output_weights.bias;
+            }
+            else if(output_weights.reduced.isReduced())
+            {
+                auto w = m_widened.view( 2 * m_numChannels, m_numChannels + 1 );
+                output_weights.reduced.widen( w );
+                state.noalias() += w * z;
+            }
+            else
+                state.noalias() += output_weights.w * z;
+        }
+
         inline void forward( const Eigen::Ref<const RowMatrixXf>& x, Eigen::Ref<RowMatrixXf> residual, Eigen::Ref<RowMatrixXf> skip ) noexcept
-        {   
+        {
             assert((skip.rows() == m_numChannels && skip.cols() == x.cols()) && "ResidualBlock.forward: Wrong skip shape");
             assert((residual.rows() == m_numChannels && residual.cols() == x.cols()) && "ResidualBlock.forward: Wrong residual shape");
 
-            if (m_z.rows() != m_numChannels || m_z.cols() != x.cols())
-                m_z.resize(m_numChannels, x.cols());
+            auto state = m_state.view( 2 * m_numChannels, x.cols() );
+            state.topRows(m_numChannels) = x;
+            state.bottomRows(m_numChannels).setZero();
+            forward( state );
+            residual = state.topRows(m_numChannels);
+            skip = state.bottomRows(m_numChannels);
+        }
 
-            if (m_y_inner.rows() != (m_gated ? 2*m_numChannels : m_numChannels) || m_y_inner.cols() != x.cols())
-                m_y_inner.resize(m_gated ? 2*m_numChannels : m_numChannels, x.cols());
-            
-            // Dilated causal conv
-            m_inputConv.forward( x, m_y_inner );
+        void loadStateDict(const nlohmann::json& state_dict)
+        {
+            m_inputConv.loadStateDict( state_dict.at("input_conv") );
 
-            if(m_gated)
+            // [residual_conv; skip_conv] weights, with their biases as the last column, loaded at full precision
+            auto& output_weights = m_outputWeights.edit();
+            const auto precision = output_weights.reduced.precision;
+            output_weights.reduced.convert( output_weights.w, WeightPrecision::Float32 );
+            auto& w = output_weights.w;
+            RowMatrixXf conv_w( m_numChannels, m_numChannels );
+            loadTensorInto( std::string("weight"), state_dict.at("residual_conv"), conv_w );
+            w.topLeftCorner(m_numChannels, m_numChannels) = conv_w;
+            loadTensorInto( std::string("weight"), state_dict.at("skip_conv"), conv_w );
+            w.bottomLeftCorner(m_numChannels, m_numChannels) = conv_w;
+            w.col(m_numChannels) << loadVector( std::string("bias"), state_dict.at("residual_conv") ),
+                                    loadVector( std::string("bias"), state_dict.at("skip_conv") );
+            output_weights.reduced.convert( w, precision );
+            setOutputLowRank( m_rankEnergy, m_maxRank );
+            setOutputQuantization( output_weights.quantized.mode );
+        }
+
+        // Scratch lifetimes of forward(state), see ScratchPlanner
+        void plan(ScratchPlanner& planner, size_t max_block_size)
+        {
+            planner.acquire( m_z, (m_numChannels + 1) * max_block_size );
+            m_inputConv.plan( planner, max_block_size, m_gated );
+            const auto mode = m_outputWeights->quantized.mode;
+            if(mode != Quantization::None)
             {
-                auto y_f = m_y_inner.topRows(m_numChannels);
-                auto y_g = m_y_inner.bottomRows(m_numChannels);
-                m_z = y_f.array().tanh() * y_g.array().logistic();
+                planner.acquire( m_packed, QuantizedGemm::packedSize(m_numChannels, max_block_size, mode) );
+                planner.release( m_packed );
             }
-            else
-                m_z = m_y_inner.array().tanh();
-            
-            // skip connection                
-            m_skipConv.forward(m_z, skip);
-
-            // residual connection
-            if(x.data() == residual.data())
+            else if(!m_outputWeights->factors.empty())
             {
-                if (m_temp.rows() != m_numChannels || m_temp.cols() != x.cols())
-                    m_temp.resize(m_numChannels, x.cols());
-                m_residualConv.forward(m_z, m_temp);
-                m_temp += x;
-                residual = m_temp;
+                planner.acquire( m_factored, m_outputWeights->factors.rank() * max_block_size );
+                planner.release( m_factored );
             }
-            else
+            else if(m_outputWeights->reduced.isReduced())
             {
-                m_residualConv.forward(m_z, residual);
-                residual += x;
-            }   
+                planner.acquire( m_widened, 2 * m_numChannels * (m_numChannels + 1) );
+                planner.release( m_widened );
+            }
+            planner.release( m_z );
+        }
+
+        void resetState() { m_inputConv.resetState(); }
+
+        void setActivationPrecision(ActivationPrecision precision) { m_precision = precision; }
+
+        // See CausalDilatedConv1d::setWeightPrecision()
+        void setWeightPrecision(WeightPrecision precision)
+        {
+            m_inputConv.setWeightPrecision( precision );
+            auto& output_weights = m_outputWeights.edit();
+            output_weights.reduced.convert( output_weights.w, precision );
         }
 
-        void loadStateDict(std::map<std::string, nlohmann::json> state_dict)
+        // Bytes of the weights and biases
+        size_t getWeightSize() const
         {
-            auto input_state_dict = state_dict[std::string("input_conv")].get<std::map<std::string, nlohmann::json>>();
-            m_inputConv.loadStateDict( input_state_dict );
-            auto residual_state_dict = state_dict[std::string("residual_conv")].get<std::map<std::string, nlohmann::json>>();
-            m_residualConv.loadStateDict(residual_state_dict);
-            auto skip_state_dict = state_dict[std::string("skip_conv")].get<std::map<std::string, nlohmann::json>>();
-            m_skipConv.loadStateDict(skip_state_dict);
+            const auto& output_weights = *m_outputWeights;
+            const size_t factors_size = output_weights.factors.u.size() + output_weights.factors.v.size() + output_weights.bias.size();
+            return m_inputConv.getWeightSize() + output_weights.reduced.getSize( output_weights.w ) + factors_size * sizeof(float);
         }
 
+        // See CausalDilatedConv1d::setCalibration(), the output convs record the range of the gated activation
+        void setCalibration(bool calibrating)
+        {
+            m_inputConv.setCalibration( calibrating );
+            m_calibrating = calibrating;
+            if(calibrating)
+                m_outputRange = 0.f;
+        }
+
+        // See CausalDilatedConv1d::setQuantization()
+        void setQuantization(Quantization mode)
+        {
+            m_inputConv.setQuantization( mode );
+            setOutputQuantization( mode );
+        }
+
+        // See CausalDilatedConv1d::setLowRank(), the stacked residual and skip convs are factorized together
+        void setLowRank(float energy, Eigen::Index max_rank = 0)
+        {
+            m_inputConv.setLowRank( energy, max_rank );
+            setOutputLowRank( energy, max_rank );
+        }
+
+        // Of the output convs, see CausalDilatedConv1d::getRank()
+        Eigen::Index getRank() const { return m_outputWeights->factors.rank(); }
+        float getLowRankError() const { return m_outputWeights->factors.error; }
+
+        size_t getReceptiveField() const { return m_inputConv.getReceptiveField(); }
+
     private:
-        CausalDilatedConv1d m_inputConv;
-        Conv1d m_residualConv, m_skipConv;
-        bool m_gated;
+        // Float copy of the output weights, widened when reduced
+        RowMatrixXf floatOutputWeights() const
+        {
+            RowMatrixXf w = m_outputWeights->w;
+            if(m_outputWeights->reduced.isReduced())
+            {
+                w.resize( 2 * m_numChannels, m_numChannels + 1 );
+                m_outputWeights->reduced.widen( w );
+            }
+            return w;
+        }
+
+        // The bias column is kept apart and exact
+        void setOutputLowRank(float energy, Eigen::Index max_rank)
+        {
+            m_rankEnergy = energy;
+            m_maxRank = max_rank;
+            const RowMatrixXf w = floatOutputWeights();
+            auto factors = LowRank::factorize( w.leftCols(m_numChannels), energy, max_rank );
+            auto& output_weights = m_outputWeights.edit();
+            output_weights.bias = factors.empty() ? Eigen::VectorXf() : Eigen::VectorXf( w.col(m_numChannels) );
+            output_weights.factors = std::move( factors );
+        }
+
+        // The output convs are quantized without their bias column, that stays in float
+        void setOutputQuantization(Quantization mode)
+        {
+            QuantizedGemm::Weights quantized;
+            if(mode != Quantization::None)
+            {
+                const RowMatrixXf w = floatOutputWeights();
+                quantized = QuantizedGemm::quantize( w.leftCols(m_numChannels), w.col(m_numChannels), m_outputRange, mode );
+            }
+            m_outputWeights.edit().quantized = std::move( quantized );
+        }
+
+        struct OutputWeights
+        {
+            RowMatrixXf w; // (2 * num_channels, num_channels + 1), empty while reduced
+            ReducedWeights reduced;
+            QuantizedGemm::Weights quantized;
+            LowRank::Factors factors; // of the weights without their bias column
+            Eigen::VectorXf bias;     // bias column while factorized
+        };
+
         size_t m_numChannels, m_kernelSize;
-        RowMatrixXf m_z, m_y_inner, m_temp;
+        bool m_gated;
+        CausalDilatedConv1d m_inputConv;
+        SharedWeights<OutputWeights> m_outputWeights;
+        ScratchBuffer m_z, m_state;
+        ScratchBuffer m_widened; // float copy of reduced precision output weights
+        ScratchBuffer m_packed;  // quantized gated activation, see QuantizedGemm
+        ScratchBuffer m_factored; // v z of factorized output weights
+        ActivationPrecision m_precision = ActivationPrecision::Exact;
+        bool m_calibrating = false;
+        float m_outputRange = 0.f; // largest gated activation magnitude seen while calibrating
+        float m_rankEnergy = 1.f;  // truncation of setLowRank()
+        Eigen::Index m_maxRank = 0;
     };
-}
\ No newline at end of file
+}
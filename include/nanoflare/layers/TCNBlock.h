@@ -1,54 +1,118 @@
 #pragma once
 
 #include <cassert>
-#include "nanoflare/Functional.h"
+#include "nanoflare/Epilogue.h"
 #include "nanoflare/layers/Conv1d.h"
 #include "nanoflare/layers/CausalDilatedConv1d.h"
 #include "nanoflare/layers/BatchNorm1d.h"
+#include "nanoflare/ScratchArena.h"
 
 namespace Nanoflare
 {
 
-    class TCNBlock
+    // Shapes given as template arguments are known at compile time, see CausalDilatedConv1dT
+    template<int InChannels = Eigen::Dynamic, int OutChannels = Eigen::Dynamic, int KernelSize = Eigen::Dynamic>
+    class TCNBlockT
     {
     public:
-        TCNBlock(size_t in_channels, size_t out_channels, size_t kernel_size, size_t dilation, bool use_batchnorm) noexcept
+        TCNBlockT(size_t in_channels, size_t out_channels, size_t kernel_size, size_t dilation, bool use_batchnorm) noexcept
             : m_inChannels(in_channels), m_outChannels(out_channels), m_useBatchNorm(use_batchnorm),
             m_conv1( in_channels, out_channels, kernel_size, true, dilation ),
             m_conv2( out_channels, out_channels, kernel_size, true, 1 ),
-            m_bn1( out_channels ),
-            m_bn2( out_channels ),
             m_conv( in_channels, out_channels, 1, true )
         {}
-        ~TCNBlock() = default;
+        ~TCNBlockT() = default;
 
         inline void forward( const Eigen::Ref<const RowMatrixXf>& x, Eigen::Ref<RowMatrixXf> y ) noexcept
         {
             assert(x.rows() == m_inChannels && "TCNBlock.forward: Wrong input shape");
             assert((y.rows() == m_outChannels && y.cols() == x.cols()) && "TCNBlock.forward: Wrong output shape");
 
+            // In place: x is read until the end of process(), the block runs into a scratch buffer
             if(x.data() == y.data())
             {
-                RowMatrixXf temp( m_outChannels, x.cols());
+                auto temp = scratchView( m_block_temp, m_outChannels, x.cols() );
                 process( x, temp );
-                y = std::move( temp );
+                y = temp;
             }
             else
                 process( x, y );
         }
         
-        void loadStateDict(std::map<std::string, nlohmann::json> state_dict)
+        void loadStateDict(const nlohmann::json& state_dict)
         {
-            auto conv_state_dict = state_dict[std::string("conv")].get<std::map<std::string, nlohmann::json>>();
-            m_conv.loadStateDict( conv_state_dict );
-            auto conv1_state_dict = state_dict[std::string("conv1")].get<std::map<std::string, nlohmann::json>>();
-            m_conv1.loadStateDict( conv1_state_dict );
-            auto conv2_state_dict = state_dict[std::string("conv2")].get<std::map<std::string, nlohmann::json>>();
-            m_conv2.loadStateDict( conv2_state_dict );
-            auto bn1_state_dict = state_dict[std::string("bn1")].get<std::map<std::string, nlohmann::json>>();
-            m_bn1.loadStateDict( bn1_state_dict );
-            auto bn2_state_dict = state_dict[std::string("bn2")].get<std::map<std::string, nlohmann::json>>();
-            m_bn2.loadStateDict( bn2_state_dict );
+            m_conv.loadStateDict( state_dict.at("conv") );
+            m_conv1.loadStateDict( state_dict.at("conv1") );
+            m_conv2.loadStateDict( state_dict.at("conv2") );
+            if(m_useBatchNorm)
+            {
+                // Inference batch norms are folded into the convolutions they follow
+                BatchNorm1d bn( m_outChannels );
+                bn.loadStateDict( state_dict.at("bn1") );
+                m_conv1.foldAffine( bn.getScale(), bn.getShift() );
+                bn.loadStateDict( state_dict.at("bn2") );
+                m_conv2.foldAffine( bn.getScale(), bn.getShift() );
+            }
+        }
+
+        // Scratch lifetimes of an out-of-place forward(), see ScratchPlanner. In-place calls
+        // additionally run into a buffer of their own, grown on first use.
+        void plan(ScratchPlanner& planner, size_t max_block_size)
+        {
+            if(m_inChannels != m_outChannels)
+            {
+                planner.acquire( m_temp, m_outChannels * max_block_size );
+                m_conv.plan( planner, max_block_size );
+            }
+            m_conv1.plan( planner, max_block_size );
+            m_conv2.plan( planner, max_block_size );
+            if(m_inChannels != m_outChannels)
+                planner.release( m_temp );
+        }
+
+        void resetState()
+        {
+            m_conv1.resetState();
+            m_conv2.resetState();
+        }
+
+        // See CausalDilatedConv1d::setCalibration()
+        void setCalibration(bool calibrating)
+        {
+            m_conv1.setCalibration( calibrating );
+            m_conv2.setCalibration( calibrating );
+            m_conv.setCalibration( calibrating );
+        }
+
+        // See CausalDilatedConv1d::setQuantization()
+        void setQuantization(Quantization mode)
+        {
+            m_conv1.setQuantization( mode );
+            m_conv2.setQuantization( mode );
+            m_conv.setQuantization( mode );
+        }
+        Quantization getQuantization() const { return m_conv1.getQuantization(); }
+
+        // See CausalDilatedConv1d::setLowRank()
+        void setLowRank(float energy, Eigen::Index max_rank = 0)
+        {
+            m_conv1.setLowRank( energy, max_rank );
+            m_conv2.setLowRank( energy, max_rank );
+            m_conv.setLowRank( energy, max_rank );
+        }
+
+        // Both convolutions are causal, their past samples add up
+        size_t getReceptiveField() const { return m_conv1.getReceptiveField() + m_conv2.getReceptiveField() - 1; }
+
+        // Folds the map x * scale + shift of the input into the convolutions that read it, see
+        // CausalDilatedConv1d::setInputAffine(). Blocks with as many input as output channels add
+        // their input itself to the output and cannot. Resets the state. Not real-time safe.
+        bool canFoldInput() const { return m_inChannels != m_outChannels; }
+        void setInputAffine(float scale, float shift)
+        {
+            assert(canFoldInput() && "TCNBlock.setInputAffine: Identity residual");
+            m_conv1.setInputAffine( scale, shift );
+            m_conv.setInputAffine( scale, shift );
         }
 
         size_t getInChannels() { return m_inChannels; }
@@ -56,32 +120,30 @@ namespace Nanoflare
 
     private:
 
+        // The activations and the residual add are the epilogues of the convolutions, the 1x1
+        // residual conv runs first so that the last one adds it as it stores its output
         inline void process( const Eigen::Ref<const RowMatrixXf>& x, Eigen::Ref<RowMatrixXf> mat ) noexcept
         {
-            m_conv1.forward( x, mat );
-            if(m_useBatchNorm)
-                m_bn1.apply( mat );
-            Functional::LeakyReLU( mat, 0.2f );
-            m_conv2.forward( mat, mat );
-            if(m_useBatchNorm)
-                m_bn2.apply( mat );
-            Functional::LeakyReLU( mat, 0.2f );
-            if(m_inChannels == m_outChannels)
-                mat += x;
-            else
+            const Epilogue activation = Epilogue().withActivation( Epilogue::Activation::LeakyReLU, 0.2f );
+            Epilogue residual = activation.withResidual( x );
+            if(m_inChannels != m_outChannels)
             {
-                if (m_temp.rows() != m_outChannels || m_temp.cols() != x.cols())
-                    m_temp.resize(m_outChannels, x.cols());
-                m_conv.forward( x, m_temp );
-                mat += m_temp;
+                auto temp = m_temp.view( m_outChannels, x.cols() );
+                m_conv.forward( x, temp );
+                residual = activation.withResidual( temp );
             }
+            m_conv1.forward( x, mat, activation );
+            m_conv2.forward( mat, mat, residual );
         }
 
-        bool m_useBatchNorm;
-        CausalDilatedConv1d m_conv1, m_conv2;
-        BatchNorm1d m_bn1, m_bn2;
-        Conv1d m_conv;
+        bool m_useBatchNorm; // folded into m_conv1 and m_conv2
+        CausalDilatedConv1dT<InChannels, OutChannels, KernelSize> m_conv1;
+        CausalDilatedConv1dT<OutChannels, OutChannels, KernelSize> m_conv2;
+        Conv1dT<InChannels, OutChannels, 1> m_conv;
         size_t m_inChannels, m_outChannels;
-        RowMatrixXf m_temp, m_block_temp;
+        ScratchBuffer m_temp;
+        RowMatrixXf m_block_temp; // in-place calls only, grow-only
     };
-}
\ No newline at end of file
+
+    using TCNBlock = TCNBlockT<>;
+}
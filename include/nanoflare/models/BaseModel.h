@@ -2,8 +2,15 @@
 
 #include <nlohmann/json.hpp>
 #include <Eigen/Dense>
+#include <algorithm>
 #include <cassert>
 #include <fstream>
+#include <limits>
+#include <memory>
+#include "nanoflare/Activations.h"
+#include "nanoflare/QuantizedGemm.h"
+#include "nanoflare/ScratchArena.h"
+#include "nanoflare/WeightPrecision.h"
 #include "nanoflare/utils.h"
 
 namespace Nanoflare
@@ -21,6 +28,9 @@ namespace Nanoflare
         j.at("norm_std").get_to(obj.norm_std);
     }
 
+    // Returned by getReceptiveField() and getTailLength() when they are unbounded
+    constexpr size_t UnboundedLength = std::numeric_limits<size_t>::max();
+
     class BaseModel
     {
     public:
@@ -33,14 +43,61 @@ namespace Nanoflare
         }
         virtual ~BaseModel() = default;
 
+        // Processes a block of any size, keeping the state across calls. Built-in models only
+        // allocate scratch memory when a block is larger than any previous one: after
+        // prepare(), or one call at the maximum block size, forward() never allocates.
         virtual inline void forward( const Eigen::Ref<const RowMatrixXf>& x, Eigen::Ref<RowMatrixXf> y ) noexcept = 0;
-        virtual void loadStateDict(std::map<std::string, nlohmann::json> state_dict) = 0;
+        virtual void loadStateDict(const nlohmann::json& state_dict) = 0;
 
         virtual void conditionedForward( const Eigen::Ref<const RowMatrixXf>& x, const Eigen::Ref<const Eigen::RowVectorXf>& cond, Eigen::Ref<RowMatrixXf> y ) noexcept { forward(x, y); }
 
         virtual void resetState() {}
 
+        // Allocates all the scratch memory needed by blocks of up to max_block_size samples,
+        // so that neither the first forward() call nor later block size changes allocate.
+        // Built-in models plan it into a single arena shared by every layer, reusing memory
+        // between buffers that are not live at the same time (see ScratchPlanner).
+        // Not real-time safe. The default runs one silent block and then resets the state.
+        virtual void prepare( size_t max_block_size )
+        {
+            RowMatrixXf x = RowMatrixXf::Zero( m_inChannels, max_block_size );
+            RowMatrixXf y( m_outChannels, max_block_size );
+            forward( x, y );
+            resetState();
+        }
+
+        // New instance sharing this model's read-only weights, with its own scratch and
+        // freshly reset state. Returns nullptr when the model does not support sharing.
+        virtual std::shared_ptr<BaseModel> clone() const { return nullptr; }
+
+        // Number of input samples, the current one included, each output sample depends on
         virtual size_t getReceptiveField() const { return 1; }
+
+        // Delay in samples between the input and the output, built-in models are causal
+        virtual size_t getLatency() const { return 0; }
+
+        // Number of samples the output keeps changing once the input has become constant
+        virtual size_t getTailLength() const
+        {
+            const size_t receptive_field = getReceptiveField();
+            return receptive_field == UnboundedLength ? UnboundedLength : receptive_field - 1;
+        }
+
+        // Resets the state and fills it from past input in one batched forward pass, as if
+        // context had just been processed. Only the last getReceptiveField() - 1 samples
+        // of context are needed. Allocates, not to be called on the audio thread.
+        virtual void prime( const Eigen::Ref<const RowMatrixXf>& context )
+        {
+            assert(context.rows() == m_inChannels && "BaseModel.prime: Wrong context shape");
+            resetState();
+            const size_t receptive_field = getReceptiveField();
+            const Eigen::Index length = receptive_field == UnboundedLength ?
+                context.cols() : std::min<Eigen::Index>( context.cols(), receptive_field - 1 );
+            if (length == 0)
+                return;
+            RowMatrixXf y( m_outChannels, length );
+            forward( context.rightCols(length), y );
+        }
         virtual size_t getCondSize() const { return 0; }
         
         inline void normalise( Eigen::Ref<RowMatrixXf> x ) noexcept
@@ -62,15 +119,78 @@ namespace Nanoflare
         float getNormMean() const { return m_normMean; }
         float getNormStd() const { return m_normStd; }
 
-        size_t getInChannels() { return m_inChannels; }
-        size_t getOutChannels() { return m_outChannels; }
+        size_t getInChannels() const { return m_inChannels; }
+        size_t getOutChannels() const { return m_outChannels; }
+
+        // Built-in models fold normalise() into the weights of the layers that read the input and
+        // denormalise() into the last layer where they can, see AffineFold. Changing the
+        // normalisation refolds them and resets the state. Not real-time safe.
+        void setNormMean( float value ) { m_normMean = value; foldNormalisation(); resetState(); }
+        void setNormStd( float value ) { assert( value > 0.f ); m_normStd = value; foldNormalisation(); resetState(); }
+
+        // Precision of the tanh and sigmoid activations of recurrent cells and gated layers,
+        // exact by default. Not real-time safe with respect to a concurrent forward().
+        virtual void setActivationPrecision( ActivationPrecision precision ) { m_activationPrecision = precision; }
+        ActivationPrecision getActivationPrecision() const { return m_activationPrecision; }
+
+        // Precision the weights of convolutional layers are stored at, Float32 by default, see
+        // WeightPrecision. Models without support keep Float32. Detaches the weights from the
+        // ones shared with clones, call prepare() again afterwards. Not real-time safe.
+        virtual void setWeightPrecision( WeightPrecision precision ) {}
+        virtual WeightPrecision getWeightPrecision() const { return WeightPrecision::Float32; }
+
+        // Bytes of the weights, 0 when the model does not report them
+        virtual size_t getWeightSize() const { return 0; }
+
+        // Load-time truncated SVD of the Linear and convolutional layer weights, see LowRank. Each
+        // layer keeps the smallest rank that holds a fraction energy of its squared singular values,
+        // at most max_rank when it is not 0, wherever that saves multiply-adds. An energy of 1 with
+        // no max_rank restores the full weights, that are kept, and recurrent weights stay full.
+        // Detaches the weights from the ones shared with clones, call prepare() again afterwards.
+        // Models without support keep their full weights. Not real-time safe.
+        virtual void setLowRank( float energy, Eigen::Index max_rank = 0 ) {}
+
+        // Integer inference of the Linear and convolutional layers, see QuantizedGemm. Each layer
+        // quantizes its input to the range it sees while calibration, an (in_channels, time)
+        // input representative of the signals to process, runs through the float model. The weights
+        // are detached from the ones shared with clones and kept in float: Quantization::None
+        // restores float inference. Resets the state, call prepare() again afterwards. Models
+        // without support stay in float. Not real-time safe.
+        void quantize( Quantization mode, const Eigen::Ref<const RowMatrixXf>& calibration )
+        {
+            assert(calibration.rows() == m_inChannels && "BaseModel.quantize: Wrong calibration shape");
+            setQuantization( Quantization::None );
+            if( mode != Quantization::None )
+            {
+                resetState();
+                setCalibration( true );
+                RowMatrixXf y( m_outChannels, calibration.cols() );
+                forward( calibration, y );
+                setCalibration( false );
+                setQuantization( mode );
+            }
+            resetState();
+        }
+        virtual Quantization getQuantization() const { return Quantization::None; }
+
+        // Scratch memory planned by prepare(), empty for models without a plan
+        const ScratchArena& getScratchArena() const { return m_scratchArena; }
+
+    protected:
+        // Steps of quantize(), that models supporting it fan out to their layers
+        virtual void setCalibration( bool calibrating ) {}
+        virtual void setQuantization( Quantization mode ) {}
+
+        // Folds the current normalisation into the weights, see setNormMean(). Models that
+        // override it call it from their constructor and no longer run what they fold.
+        virtual void foldNormalisation() {}
 
-        void setNormMean( float value ) { m_normMean = value; }
-        void setNormStd( float value ) { assert( value > 0.f ); m_normStd = value; }
+        ScratchArena m_scratchArena;
 
     private:
         float m_normMean, m_normStd;
         size_t m_inChannels, m_outChannels;
+        ActivationPrecision m_activationPrecision = ActivationPrecision::Exact;
     };
 
 }
\ No newline at end of file
@@ -32,54 +32,135 @@ namespace Nanoflare
             BaseModel(norm_mean, norm_std, input_size, output_size), 
             m_rnn(input_size, hidden_size, true), 
             m_plainSequential( hidden_size, output_size, ps_hidden_size, ps_num_hidden_layers)
-        {}
+        {
+            foldNormalisation();
+        }
         ~ResRNN() = default;
 
         inline void forward( const Eigen::Ref<const RowMatrixXf>& x, Eigen::Ref<RowMatrixXf> y ) noexcept override final
         {
             assert((y.rows() == m_plainSequential.getOutChannels() && y.cols() == x.cols()) && "ResRNN.forward: Wrong output shape");
 
-            m_norm_x = x;
-            normalise( m_norm_x );
+            // The RNN runs time-major: transposing into scratch buffers avoids the temporary
+            // copies Eigen makes when binding a transposed expression to a row-major Ref
+            auto x_t = m_x_t.view( x.cols(), x.rows() );
+            x_t = x.transpose();
 
-            // RNN: input (time, C_in), output (time, C_hidden)
-            if (m_temp.rows() != x.cols() || m_temp.cols() != m_plainSequential.getInChannels())
-                m_temp.resize( x.cols(), m_plainSequential.getInChannels() );
-            m_rnn.forward(m_norm_x.transpose(), m_temp);
+            // RNN: input (time, C_in), output (time, C_hidden), normalises it, see foldNormalisation()
+            auto temp = m_temp.view( x.cols(), m_plainSequential.getInChannels() );
+            m_rnn.forward( x_t, temp );
 
             // PlainSequential: input (C_hidden, time), output (C_out, time)
-            m_plainSequential.forwardTranspose(m_temp.transpose(), y);
+            auto hidden = m_hidden.view( m_plainSequential.getInChannels(), x.cols() );
+            hidden = temp.transpose();
+            m_plainSequential.forwardTranspose( hidden, y );
 
-            // Residual only if shapes match
+            // Residual only if shapes match, from the copy of x: y may alias it
             if(x.rows() == y.rows())
-                y += x;
+                y += x_t.transpose();
         }
 
-        void loadStateDict(std::map<std::string, nlohmann::json> state_dict) override final
+        void loadStateDict(const nlohmann::json& state_dict) override final
         {
-            auto lstm_state_dict = state_dict[std::string("rnn")].get<std::map<std::string, nlohmann::json>>();
-            m_rnn.loadStateDict( lstm_state_dict );
-            auto ps_state_dict = state_dict[std::string("plain_sequential")].get<std::map<std::string, nlohmann::json>>();
-            m_plainSequential.loadStateDict( ps_state_dict );
+            m_rnn.loadStateDict( state_dict.at("rnn") );
+            m_plainSequential.loadStateDict( state_dict.at("plain_sequential") );
         }
 
-        void resetState() { m_rnn.resetState(); }
+        void prepare( size_t max_block_size ) override final
+        {
+            ScratchPlanner planner;
+            planner.acquire( m_x_t, max_block_size * getInChannels() );
+            planner.acquire( m_temp, max_block_size * m_plainSequential.getInChannels() );
+            m_rnn.plan( planner, max_block_size );
+            planner.acquire( m_hidden, m_plainSequential.getInChannels() * max_block_size );
+            planner.release( m_temp );
+            m_plainSequential.plan( planner, max_block_size );
+            planner.release( m_hidden );
+            planner.release( m_x_t ); // read by the residual
+            planner.bind( m_scratchArena );
+        }
 
-        static void build(const nlohmann::json& data, std::shared_ptr<BaseModel>& model)
+        void resetState() override final { m_rnn.resetState(); }
+
+        void setActivationPrecision( ActivationPrecision precision ) override final
         {
-            auto doc = data.get<std::map<std::string, nlohmann::json>>();
+            BaseModel::setActivationPrecision( precision );
+            m_rnn.setActivationPrecision( precision );
+        }
+
+        size_t getReceptiveField() const override final { return UnboundedLength; }
+
+        // Only the output PlainSequential is quantized, the recurrence stays in float
+        Quantization getQuantization() const override final { return m_plainSequential.getQuantization(); }
+
+        // The recurrent weights stay full
+        void setLowRank( float energy, Eigen::Index max_rank = 0 ) override final { m_plainSequential.setLowRank( energy, max_rank ); }
+
+        // Estimated from the impulse response: number of samples until a copy fed with a
+        // unit impulse settles within TailThreshold of a copy fed with silence. Allocates.
+        size_t getTailLength() const override final
+        {
+            auto impulse = clone(), silence = clone();
+            RowMatrixXf x = RowMatrixXf::Zero( getInChannels(), TailBlockSize );
+            RowMatrixXf y_impulse( getOutChannels(), TailBlockSize ), y_silence( getOutChannels(), TailBlockSize );
+
+            size_t tail = 0;
+            for(size_t start = 0; start < TailMaxLength; start += TailBlockSize)
+            {
+                x.col(0).setConstant( start == 0 ? 1.f : 0.f );
+                impulse->forward( x, y_impulse );
+                x.col(0).setZero();
+                silence->forward( x, y_silence );
+
+                const auto diff = ((y_impulse - y_silence).cwiseAbs().colwise().maxCoeff().array() > TailThreshold).eval();
+                for(Eigen::Index n = diff.size() - 1; n >= 0; --n)
+                    if(diff(n))
+                    {
+                        tail = start + n + 1;
+                        break;
+                    }
+                if(tail <= start)
+                    return tail; // a whole block within the threshold
+            }
+            return UnboundedLength;
+        }
 
+        std::shared_ptr<BaseModel> clone() const override final
+        {
+            auto model = std::make_shared<ResRNN<T>>( *this );
+            model->resetState();
+            return model;
+        }
+
+        // Whether the document has the shapes of this instantiation
+        static bool matches(const nlohmann::json& data)
+        {
+            auto parameters = data.at("parameters").template get<ResRNNParameters>();
+            return matchesSize(T::FixedInputSize, parameters.input_size) && matchesSize(T::FixedHiddenSize, parameters.hidden_size);
+        }
+
+        static void build(const nlohmann::json& data, std::shared_ptr<BaseModel>& model)
+        {
             auto config = data.at("config").template get<ModelConfig>();
-            auto state_dict = data.at("state_dict").get<std::map<std::string, nlohmann::json>>();
             auto parameters = data.at("parameters").template get<ResRNNParameters>();
             model = std::make_shared<ResRNN<T>>(parameters.input_size, parameters.hidden_size, parameters.output_size, parameters.ps_hidden_size, parameters.ps_num_hidden_layers, config.norm_mean, config.norm_std);
-            model->loadStateDict( state_dict );
+            model->loadStateDict( data.at("state_dict") );
         }
 
+    protected:
+        void setCalibration( bool calibrating ) override final { m_plainSequential.setCalibration( calibrating ); }
+        void setQuantization( Quantization mode ) override final { m_plainSequential.setQuantization( mode ); }
+
+        // Into W_ih and the input biases, the residual adds the input itself
+        void foldNormalisation() override final { m_rnn.setInputAffine( 1.f / getNormStd(), -getNormMean() / getNormStd() ); }
+
     private:
+        static constexpr size_t TailBlockSize = 1024, TailMaxLength = 1 << 18;
+        static constexpr float TailThreshold = 1e-4f;
+
         T m_rnn;
         PlainSequential m_plainSequential;
-        RowMatrixXf m_norm_x, m_temp;
+        ScratchBuffer m_x_t, m_temp, m_hidden;
     };
 
 }
\ No newline at end of file
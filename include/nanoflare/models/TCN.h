@@ -1,6 +1,7 @@
 #pragma once
 
 #include <cassert>
+#include <utility>
 #include <nlohmann/json.hpp>
 #include <Eigen/Dense>
 #include "nanoflare/models/BaseModel.h"
@@ -25,70 +26,155 @@ namespace Nanoflare
         j.at("ps_num_hidden_layers").get_to(obj.ps_num_hidden_layers);
     }
 
-    class TCN : public BaseModel
+    // Hidden and kernel sizes given as template arguments are known at compile time in every
+    // block, see TCNBlockT. BuiltinModels.h registers the instantiations for common shapes.
+    template<int HiddenSize = Eigen::Dynamic, int KernelSize = Eigen::Dynamic>
+    class TCNT : public BaseModel
     {
     public:
         EIGEN_MAKE_ALIGNED_OPERATOR_NEW
 
-        TCN(size_t input_size, size_t hidden_size, size_t output_size, size_t kernel_size, size_t stack_size, size_t ps_hidden_size, size_t ps_num_hidden_layers, float norm_mean, float norm_std) : 
+        TCNT(size_t input_size, size_t hidden_size, size_t output_size, size_t kernel_size, size_t stack_size, size_t ps_hidden_size, size_t ps_num_hidden_layers, float norm_mean, float norm_std) : 
             BaseModel(norm_mean, norm_std, input_size, output_size), 
             m_hiddenSize(hidden_size), m_stackSize(stack_size),
             m_plainSequential(hidden_size, output_size, ps_hidden_size, ps_num_hidden_layers)
         {
             for(auto k = 0; k < stack_size; k++)
                 m_blockStack.emplace_back((k == 0) ? input_size : hidden_size, hidden_size, kernel_size, std::pow(2, k), false);
+            foldNormalisation();
         }
-        ~TCN() = default;
+        ~TCNT() = default;
         
         inline void forward( const Eigen::Ref<const RowMatrixXf>& x, Eigen::Ref<RowMatrixXf> y ) noexcept override final
         {
             assert((y.rows() == m_plainSequential.getOutChannels() && y.cols() == x.cols()) && "TCN.forward: Wrong output shape");
 
-            m_norm_x = x;
-            normalise( m_norm_x );
-
-            // TCN Block: input (C_in, time) output (C_hidden, time)
-            if (m_temp.rows() != m_plainSequential.getInChannels() || m_temp.cols() != x.cols())
-                m_temp.resize( m_plainSequential.getInChannels(), x.cols() );
-            for(auto i = 0; i < m_blockStack.size(); ++i)
+            // TCN Block: input (C_in, time) output (C_hidden, time), ping-pong between two buffers
+            auto a = m_temp.view( m_hiddenSize, x.cols() );
+            auto b = m_temp2.view( m_hiddenSize, x.cols() );
+            auto* in = &a;
+            auto* out = &b;
+            if(m_blockStack[0].canFoldInput())
+                m_blockStack[0].forward( x, *in ); // normalises it, see foldNormalisation()
+            else
+            {
+                auto norm_x = m_norm_x.view( x.rows(), x.cols() );
+                norm_x = x;
+                normalise( norm_x );
+                m_blockStack[0].forward( norm_x, *in );
+            }
+            for(auto i = 1; i < m_blockStack.size(); ++i)
             {
-                if(i == 0)
-                    m_blockStack[i].forward( m_norm_x, m_temp );
-                else
-                    m_blockStack[i].forward( m_temp, m_temp );
+                m_blockStack[i].forward( *in, *out );
+                std::swap( in, out );
             }
 
             // PlainSequential(FwdTranspose): input(C_hidden, time) output(C_out, time)
-            m_plainSequential.forwardTranspose( m_temp, y );
+            m_plainSequential.forwardTranspose( *in, y );
         }
 
-        void loadStateDict(std::map<std::string, nlohmann::json> state_dict) override final
+        void loadStateDict(const nlohmann::json& state_dict) override final
         {
             for(auto k = 0; k < m_stackSize; k++)
             {
-                auto block_state_dict = state_dict[std::string("block_stack.") + std::to_string(k)].get<std::map<std::string, nlohmann::json>>();
-                m_blockStack[k].loadStateDict( block_state_dict );
+                m_blockStack[k].loadStateDict( state_dict.at(std::string("block_stack.") + std::to_string(k)) );
             }
-            auto ps_state_dict = state_dict[std::string("plain_sequential")].get<std::map<std::string, nlohmann::json>>();
-            m_plainSequential.loadStateDict( ps_state_dict );
+            m_plainSequential.loadStateDict( state_dict.at("plain_sequential") );
         }
 
-        static void build(const nlohmann::json& data, std::shared_ptr<BaseModel>& model)
+        void prepare( size_t max_block_size ) override final
+        {
+            ScratchPlanner planner;
+            const bool folded = m_blockStack[0].canFoldInput();
+            if(!folded)
+                planner.acquire( m_norm_x, getInChannels() * max_block_size );
+            planner.acquire( m_temp, m_hiddenSize * max_block_size );
+            planner.acquire( m_temp2, m_hiddenSize * max_block_size );
+            m_blockStack[0].plan( planner, max_block_size );
+            if(!folded)
+                planner.release( m_norm_x );
+            for(auto i = 1; i < m_blockStack.size(); ++i)
+                m_blockStack[i].plan( planner, max_block_size );
+            m_plainSequential.plan( planner, max_block_size );
+            planner.release( m_temp );
+            planner.release( m_temp2 );
+            planner.bind( m_scratchArena );
+        }
+
+        void resetState() override final
+        {
+            for(auto& block: m_blockStack)
+                block.resetState();
+        }
+
+        Quantization getQuantization() const override final { return m_blockStack[0].getQuantization(); }
+
+        void setLowRank( float energy, Eigen::Index max_rank = 0 ) override final
+        {
+            for(auto& block: m_blockStack)
+                block.setLowRank( energy, max_rank );
+            m_plainSequential.setLowRank( energy, max_rank );
+        }
+
+        size_t getReceptiveField() const override final
+        {
+            size_t receptive_field = 1;
+            for(const auto& block: m_blockStack)
+                receptive_field += block.getReceptiveField() - 1;
+            return receptive_field;
+        }
+
+        std::shared_ptr<BaseModel> clone() const override final
         {
-            auto doc = data.get<std::map<std::string, nlohmann::json>>();
+            auto model = std::make_shared<TCNT>( *this );
+            model->resetState();
+            return model;
+        }
+
+        // Whether the document has the shapes of this instantiation
+        static bool matches(const nlohmann::json& data)
+        {
+            auto parameters = data.at("parameters").template get<TCNParameters>();
+            return matchesSize(HiddenSize, parameters.hidden_size) && matchesSize(KernelSize, parameters.kernel_size);
+        }
 
+        static void build(const nlohmann::json& data, std::shared_ptr<BaseModel>& model)
+        {
             auto config = data.at("config").template get<ModelConfig>();
-            auto state_dict = data.at("state_dict").get<std::map<std::string, nlohmann::json>>();
             auto parameters = data.at("parameters").template get<TCNParameters>();
-            model = std::make_shared<TCN>(parameters.input_size, parameters.hidden_size, parameters.output_size, parameters.kernel_size, parameters.stack_size, parameters.ps_hidden_size, parameters.ps_num_hidden_layers, config.norm_mean, config.norm_std);
-            model->loadStateDict( state_dict ); 
+            model = std::make_shared<TCNT>(parameters.input_size, parameters.hidden_size, parameters.output_size, parameters.kernel_size, parameters.stack_size, parameters.ps_hidden_size, parameters.ps_num_hidden_layers, config.norm_mean, config.norm_std);
+            model->loadStateDict( data.at("state_dict") ); 
+        }
+
+    protected:
+        void setCalibration( bool calibrating ) override final
+        {
+            for(auto& block: m_blockStack)
+                block.setCalibration( calibrating );
+            m_plainSequential.setCalibration( calibrating );
+        }
+
+        void setQuantization( Quantization mode ) override final
+        {
+            for(auto& block: m_blockStack)
+                block.setQuantization( mode );
+            m_plainSequential.setQuantization( mode );
+        }
+
+        // Into the first block, unless its input is also its residual
+        void foldNormalisation() override final
+        {
+            if(m_blockStack[0].canFoldInput())
+                m_blockStack[0].setInputAffine( 1.f / getNormStd(), -getNormMean() / getNormStd() );
         }
 
     private:
         size_t m_hiddenSize, m_stackSize;
-        std::vector<TCNBlock> m_blockStack;
+        std::vector<TCNBlockT<Eigen::Dynamic, HiddenSize, KernelSize>> m_blockStack; // the first block reads the input channels
         PlainSequential m_plainSequential;
-        RowMatrixXf m_norm_x, m_temp;
+        ScratchBuffer m_norm_x, m_temp, m_temp2;
     };
 
+    using TCN = TCNT<>;
+
 }
\ No newline at end of file
@@ -4,6 +4,7 @@
 #include <nlohmann/json.hpp>
 #include <Eigen/Dense>
 #include "nanoflare/models/BaseModel.h"
+#include "nanoflare/Epilogue.h"
 #include "nanoflare/layers/Conv1d.h"
 #include "nanoflare/layers/ResidualBlock.h"
 #include "nanoflare/layers/CausalDilatedConv1d.h"
@@ -44,6 +45,7 @@ namespace Nanoflare
             for(size_t k = 0; k < stack_size; k++)
                 for(auto dilation: dilations)
                     m_blockStack.emplace_back(num_channels, kernel_size, dilation, gated);
+            foldNormalisation();
         }
         ~WaveNet() = default;
 
@@ -54,65 +56,145 @@ namespace Nanoflare
             auto dilations_size = m_dilations.size();
             auto skip_scale = 1.f / std::sqrt( static_cast<float>(m_stackSize * dilations_size) );
 
-            m_norm_x = x;
-            normalise( m_norm_x );
+            // Residual stream on top of the skip sum, see ResidualBlock::forward
+            auto state = m_state.view( 2 * m_numChannels, x.cols() );
+            auto skip_sum = state.bottomRows( m_numChannels );
 
-            // CausalDilatedConv: input(C_in, time) output(C_numCh, time)
-            if (m_temp.rows() != m_numChannels || m_temp.cols() != x.cols())
-                m_temp.resize(m_numChannels, x.cols());
-            m_inputConv.forward( m_norm_x, m_temp );
+            // CausalDilatedConv: input(C_in, time) output(C_numCh, time), normalises it, see foldNormalisation()
+            m_inputConv.forward( x, state.topRows( m_numChannels ) );
+            skip_sum.setZero();
 
             // ResidualBlock: input(C_numCh, time) output(C_numCh, time)
-            if (m_skip_sum.rows() != m_numChannels|| m_skip_sum.cols() != x.cols())
-                m_skip_sum.resize(m_numChannels, x.cols());
-            if (m_skip_temp.rows() != m_numChannels || m_skip_temp.cols() != x.cols())
-                m_skip_temp.resize(m_numChannels, x.cols());
-            m_skip_sum.setZero();
-            for(auto k = 0; k < m_stackSize; k++)
-                for(auto i = 0; i < dilations_size; i++)
-                {
-                    m_blockStack[k * dilations_size + i].forward( m_temp, m_temp, m_skip_temp );
-                    m_skip_sum += m_skip_temp;
-                }
-            m_skip_sum *= skip_scale;
-            Functional::ReLU( m_skip_sum );
+            for(auto& block: m_blockStack)
+                block.forward( state );
+            skip_sum = (skip_sum * skip_scale).cwiseMax( 0.f );
             
-            if (m_temp_hidden.rows() != m_postConv1.getOutChannels() || m_temp_hidden.cols() != x.cols())
-                m_temp_hidden.resize(m_postConv1.getOutChannels(), x.cols());
-            m_postConv1.forward( m_skip_sum, m_temp_hidden );
-            Functional::ReLU( m_temp_hidden );
+            auto temp_hidden = m_temp_hidden.view( m_postConv1.getOutChannels(), x.cols() );
+            m_postConv1.forward( skip_sum, temp_hidden, Epilogue().withActivation( Epilogue::Activation::ReLU ) );
             
-            m_postConv2.forward( m_temp_hidden, y );
-            denormalise( y );
+            m_postConv2.forward( temp_hidden, y );
         }
 
-        void loadStateDict(std::map<std::string, nlohmann::json> state_dict) override final
+        void loadStateDict(const nlohmann::json& state_dict) override final
         {
-            auto input_conv_state_dict = state_dict[std::string("input_conv")].get<std::map<std::string, nlohmann::json>>();
-            m_inputConv.loadStateDict( input_conv_state_dict );
-            auto post_conv1_state_dict = state_dict[std::string("post_conv1")].get<std::map<std::string, nlohmann::json>>();
-            m_postConv1.loadStateDict( post_conv1_state_dict );
-            auto post_conv2_state_dict = state_dict[std::string("post_conv2")].get<std::map<std::string, nlohmann::json>>();
-            m_postConv2.loadStateDict( post_conv2_state_dict );
+            m_inputConv.loadStateDict( state_dict.at("input_conv") );
+            m_postConv1.loadStateDict( state_dict.at("post_conv1") );
+            m_postConv2.loadStateDict( state_dict.at("post_conv2") );
 
             for(size_t k = 0; k < m_stackSize; k++)
                 for(size_t i = 0; i < m_dilations.size(); i++)
                 {
                     size_t idx = k * m_dilations.size() + i;
-                    auto block_state_dict = state_dict[std::string("block_stack.") + std::to_string(idx)].get<std::map<std::string, nlohmann::json>>();
-                    m_blockStack[idx].loadStateDict( block_state_dict );
+                    m_blockStack[idx].loadStateDict( state_dict.at(std::string("block_stack.") + std::to_string(idx)) );
                 }
         }
 
-        static void build(const nlohmann::json& data, std::shared_ptr<BaseModel>& model)
+        void prepare( size_t max_block_size ) override final
+        {
+            ScratchPlanner planner;
+            planner.acquire( m_state, 2 * m_numChannels * max_block_size );
+            m_inputConv.plan( planner, max_block_size );
+            for(auto& block: m_blockStack)
+                block.plan( planner, max_block_size );
+            planner.acquire( m_temp_hidden, m_postConv1.getOutChannels() * max_block_size );
+            m_postConv1.plan( planner, max_block_size );
+            planner.release( m_state );
+            m_postConv2.plan( planner, max_block_size );
+            planner.release( m_temp_hidden );
+            planner.bind( m_scratchArena );
+        }
+
+        void resetState() override final
         {
-            auto doc = data.get<std::map<std::string, nlohmann::json>>();
+            m_inputConv.resetState();
+            for(auto& block: m_blockStack)
+                block.resetState();
+        }
+
+        void setActivationPrecision( ActivationPrecision precision ) override final
+        {
+            BaseModel::setActivationPrecision( precision );
+            for(auto& block: m_blockStack)
+                block.setActivationPrecision( precision );
+        }
 
+        void setWeightPrecision( WeightPrecision precision ) override final
+        {
+            m_weightPrecision = precision;
+            m_inputConv.setWeightPrecision( precision );
+            for(auto& block: m_blockStack)
+                block.setWeightPrecision( precision );
+            m_postConv1.setWeightPrecision( precision );
+            m_postConv2.setWeightPrecision( precision );
+        }
+        WeightPrecision getWeightPrecision() const override final { return m_weightPrecision; }
+
+        Quantization getQuantization() const override final { return m_inputConv.getQuantization(); }
+
+        void setLowRank( float energy, Eigen::Index max_rank = 0 ) override final
+        {
+            m_inputConv.setLowRank( energy, max_rank );
+            for(auto& block: m_blockStack)
+                block.setLowRank( energy, max_rank );
+            m_postConv1.setLowRank( energy, max_rank );
+            m_postConv2.setLowRank( energy, max_rank );
+        }
+
+        size_t getWeightSize() const override final
+        {
+            size_t size = m_inputConv.getWeightSize() + m_postConv1.getWeightSize() + m_postConv2.getWeightSize();
+            for(const auto& block: m_blockStack)
+                size += block.getWeightSize();
+            return size;
+        }
+
+        size_t getReceptiveField() const override final
+        {
+            size_t receptive_field = m_inputConv.getReceptiveField();
+            for(const auto& block: m_blockStack)
+                receptive_field += block.getReceptiveField() - 1;
+            return receptive_field;
+        }
+
+        std::shared_ptr<BaseModel> clone() const override final
+        {
+            auto model = std::make_shared<WaveNet>( *this );
+            model->resetState();
+            return model;
+        }
+
+        static void build(const nlohmann::json& data, std::shared_ptr<BaseModel>& model)
+        {
             auto config = data.at("config").template get<ModelConfig>();
-            auto state_dict = data.at("state_dict").get<std::map<std::string, nlohmann::json>>();
             auto parameters = data.at("parameters").template get<WaveNetParameters>();
             model = std::make_shared<WaveNet>(parameters.input_size, parameters.num_channels, parameters.output_size, parameters.kernel_size, parameters.dilations, parameters.stack_size, parameters.gated, parameters.hidden_size, config.norm_mean, config.norm_std);
-            model->loadStateDict( state_dict ); 
+            model->loadStateDict( data.at("state_dict") ); 
+        }
+
+    protected:
+        void setCalibration( bool calibrating ) override final
+        {
+            m_inputConv.setCalibration( calibrating );
+            for(auto& block: m_blockStack)
+                block.setCalibration( calibrating );
+            m_postConv1.setCalibration( calibrating );
+            m_postConv2.setCalibration( calibrating );
+        }
+
+        void setQuantization( Quantization mode ) override final
+        {
+            m_inputConv.setQuantization( mode );
+            for(auto& block: m_blockStack)
+                block.setQuantization( mode );
+            m_postConv1.setQuantization( mode );
+            m_postConv2.setQuantization( mode );
+        }
+
+        // Into the input conv and the last post conv
+        void foldNormalisation() override final
+        {
+            m_inputConv.setInputAffine( 1.f / getNormStd(), -getNormMean() / getNormStd() );
+            m_postConv2.setOutputAffine( getNormStd(), getNormMean() );
         }
 
     private:
@@ -122,7 +204,8 @@ namespace Nanoflare
         CausalDilatedConv1d m_inputConv;
         Conv1d m_postConv1, m_postConv2;
         std::vector<ResidualBlock> m_blockStack;
-        mutable RowMatrixXf m_temp, m_skip_temp, m_skip_sum, m_norm_x, m_temp_hidden;
+        ScratchBuffer m_state, m_temp_hidden;
+        WeightPrecision m_weightPrecision = WeightPrecision::Float32;
     };
 
 }
\ No newline at end of file
@@ -2,6 +2,9 @@
 
 #include <Eigen/Dense>
 #include <nlohmann/json.hpp>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
 #include <string>
 
 namespace Nanoflare
@@ -9,42 +12,160 @@ namespace Nanoflare
 
     typedef Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> RowMatrixXf;
 
-    inline std::vector<RowMatrixXf> loadTensor( std::string name, std::map<std::string, nlohmann::json> state_dict )
+    // Whether a run-time size fits a size template argument, Eigen::Dynamic fits any size
+    constexpr bool matchesSize( int fixed, size_t size ) noexcept { return fixed == Eigen::Dynamic || static_cast<size_t>(fixed) == size; }
+
+    // Read-only layer weights shared between copies of a layer: copying a layer (and so
+    // cloning a model) shares its weights, edit() detaches a private copy first when
+    // they are shared so that other instances never see a modification.
+    template<typename T>
+    class SharedWeights
     {
-        auto data = state_dict.at(name).get<std::map<std::string, nlohmann::json>>();
-        auto shape = data.at("shape").get<std::vector<size_t>>();
-        auto values = data.at("values").get<std::vector<float>>();
+    public:
+        explicit SharedWeights(T weights) : m_ptr(std::make_shared<T>(std::move(weights))) {}
 
-        std::vector<RowMatrixXf> tensor;
+        const T& operator*() const noexcept { return *m_ptr; }
+        const T* operator->() const noexcept { return m_ptr.get(); }
 
-        // Loop through the vector and assign elements to rows
-        for (auto i = 0; i < shape[0]; ++i)
+        T& edit()
         {
-            // Create the Eigen matrix
-            RowMatrixXf matrix(shape[1], shape[2]);
-            for (auto j = 0; j < shape[1]; ++j)
-                for (auto k = 0; k < shape[2]; ++k)
-                    matrix(j, k) = values[i * shape[1] * shape[2] + j * shape[2] + k];
-            tensor.push_back( matrix );
+            if (m_ptr.use_count() > 1)
+                m_ptr = std::make_shared<T>(*m_ptr);
+            return *m_ptr;
         }
 
+        bool isShared() const noexcept { return m_ptr.use_count() > 1; }
+
+    private:
+        std::shared_ptr<T> m_ptr;
+    };
+
+    // Contiguous rows x cols view over a scratch buffer that is only reallocated when it
+    // has to grow. After a first call at the largest size, or once reserveScratch() has
+    // sized it from prepare(), later calls with equal or smaller sizes never allocate.
+    inline void reserveScratch( RowMatrixXf& storage, Eigen::Index rows, Eigen::Index cols )
+    {
+        // Zeroed so that its pages are mapped here rather than on first use
+        if (storage.size() < rows * cols)
+            storage.setZero( rows, cols );
+    }
+
+    inline Eigen::Map<RowMatrixXf> scratchView( RowMatrixXf& storage, Eigen::Index rows, Eigen::Index cols )
+    {
+        reserveScratch( storage, rows, cols );
+        return Eigen::Map<RowMatrixXf>( storage.data(), rows, cols );
+    }
+
+    // Contiguous little-endian float32 storage backing tensors serialised by offset (see BinaryModel.h)
+    struct TensorBlob
+    {
+        const unsigned char* data = nullptr;
+        size_t size = 0;
+    };
+
+    // Blob used to resolve tensor offsets while a model is being loaded on this thread
+    inline const TensorBlob*& activeTensorBlob()
+    {
+        static thread_local const TensorBlob* blob = nullptr;
+        return blob;
+    }
+
+    class TensorBlobScope
+    {
+    public:
+        explicit TensorBlobScope(const TensorBlob& blob) : m_previous(activeTensorBlob()) { activeTensorBlob() = &blob; }
+        ~TensorBlobScope() { activeTensorBlob() = m_previous; }
+
+        TensorBlobScope(const TensorBlobScope&) = delete;
+        TensorBlobScope& operator=(const TensorBlobScope&) = delete;
+
+    private:
+        const TensorBlob* m_previous;
+    };
+
+    // Copies elements [first, first + count) of a serialised tensor into out. Values are either
+    // read in place from the active blob ("offset"), from a compact float32 binary value
+    // (see JsonLoader.h) or element by element from a plain JSON array
+    inline void readTensorValues( const nlohmann::json& data, size_t first, size_t count, float* out )
+    {
+        auto it = data.find("offset");
+        if( it != data.end() )
+        {
+            const TensorBlob* blob = activeTensorBlob();
+            if( blob == nullptr )
+                throw std::runtime_error("readTensorValues: tensor stored by offset without an active tensor blob");
+            auto offset = it->get<size_t>() + first * sizeof(float);
+            if( offset + count * sizeof(float) > blob->size )
+                throw std::runtime_error("readTensorValues: tensor out of blob bounds");
+            std::memcpy( out, blob->data + offset, count * sizeof(float) );
+            return;
+        }
+
+        const auto& values = data.at("values");
+        if( values.is_binary() )
+        {
+            const auto& bytes = values.get_binary();
+            if( (first + count) * sizeof(float) > bytes.size() )
+                throw std::runtime_error("readTensorValues: tensor out of bounds");
+            std::memcpy( out, bytes.data() + first * sizeof(float), count * sizeof(float) );
+        }
+        else
+        {
+            if( first + count > values.size() )
+                throw std::runtime_error("readTensorValues: tensor out of bounds");
+            for(size_t i = 0; i < count; ++i)
+                out[i] = values[first + i].get<float>();
+        }
+    }
+
+    // Reads a tensor of any rank, flattened in row-major order, straight into a matrix of the same size
+    inline void loadTensorInto( const std::string& name, const nlohmann::json& state_dict, RowMatrixXf& out )
+    {
+        const auto& data = state_dict.at(name);
+        auto shape = data.at("shape").get<std::vector<size_t>>();
+        size_t count = 1;
+        for(auto dim: shape)
+            count *= dim;
+        if( count != static_cast<size_t>(out.size()) )
+            throw std::runtime_error("loadTensorInto: " + name + " has " + std::to_string(count) + " values, expected " + std::to_string(out.size()));
+        readTensorValues( data, 0, count, out.data() );
+    }
+
+    inline std::vector<RowMatrixXf> loadTensor( const std::string& name, const nlohmann::json& state_dict )
+    {
+        const auto& data = state_dict.at(name);
+        auto shape = data.at("shape").get<std::vector<size_t>>();
+
+        // One row-major (shape[1], shape[2]) matrix per index of the first dimension
+        std::vector<RowMatrixXf> tensor( shape[0], RowMatrixXf(shape[1], shape[2]) );
+        for (size_t i = 0; i < shape[0]; ++i)
+            readTensorValues( data, i * shape[1] * shape[2], shape[1] * shape[2], tensor[i].data() );
+
         return tensor;
     }
 
-    inline RowMatrixXf loadMatrix( std::string name, std::map<std::string, nlohmann::json> state_dict )
+    // Weights pruned with torch.nn.utils.prune and not made permanent are saved as name_orig
+    // and a name_mask of ones and zeros, applied here: the layers detect the zeros and switch
+    // to their sparse kernels when there are enough of them
+    inline RowMatrixXf loadMatrix( const std::string& name, const nlohmann::json& state_dict )
     {
-        auto data = state_dict.at(name).get<std::map<std::string, nlohmann::json>>();
+        if( !state_dict.contains(name) && state_dict.contains(name + "_orig") && state_dict.contains(name + "_mask") )
+            return loadMatrix( name + "_orig", state_dict ).cwiseProduct( loadMatrix( name + "_mask", state_dict ) );
+
+        const auto& data = state_dict.at(name);
         auto shape = data.at("shape").get<std::vector<size_t>>();
-        auto values = data.at("values").get<std::vector<float>>();
-        return Eigen::Map<RowMatrixXf>( values.data(), shape[0], shape[1] );
+        RowMatrixXf matrix( shape[0], shape[1] );
+        readTensorValues( data, 0, matrix.size(), matrix.data() );
+        return matrix;
     }
 
-    inline Eigen::VectorXf loadVector( std::string name, std::map<std::string, nlohmann::json> state_dict )
+    inline Eigen::VectorXf loadVector( const std::string& name, const nlohmann::json& state_dict )
     {
-        auto data = state_dict.at(name).get<std::map<std::string, nlohmann::json>>();
+        const auto& data = state_dict.at(name);
         auto shape = data.at("shape").get<std::vector<size_t>>();
-        auto values = data.at("values").get<std::vector<float>>();
-        return Eigen::Map<Eigen::VectorXf>( values.data(), shape[0] );
+        Eigen::VectorXf vector( shape[0] );
+        readTensorValues( data, 0, vector.size(), vector.data() );
+        return vector;
     } 
 
     template<typename T>
@@ -0,0 +1,51 @@
+import json
+import struct
+import sys
+
+# Binary model container read by Nanoflare::BinaryModel (include/nanoflare/BinaryModel.h)
+#
+#   [header][JSON document][tensor blob]
+#
+# Tensors {'shape', 'values'} of the document are moved to the blob as float32 and
+# replaced by {'shape', 'offset'}. The JSON document and every tensor are aligned.
+MAGIC = b'NFBM'
+VERSION = 1
+ALIGNMENT = 64
+HEADER_FORMAT = '<4sIQQQQ' # magic, version, json_offset, json_size, blob_offset, blob_size
+
+def _align(n):
+    return (n + ALIGNMENT - 1) // ALIGNMENT * ALIGNMENT
+
+def _is_tensor(node):
+    return isinstance(node, dict) and set(node.keys()) == {'shape', 'values'} and isinstance(node['values'], list)
+
+def _extract_tensors(node, blob):
+    if _is_tensor(node):
+        offset = _align(len(blob))
+        blob.extend(b'\0' * (offset - len(blob)))
+        blob.extend(struct.pack(f'<{len(node["values"])}f', *node['values']))
+        return {'shape': node['shape'], 'offset': offset}
+    if isinstance(node, dict):
+        return {key: _extract_tensors(value, blob) for key, value in node.items()}
+    if isinstance(node, list):
+        return [_extract_tensors(value, blob) for value in node]
+    return node
+
+def export_binary(doc, path):
+    """Writes a document produced by generate_doc to a binary model file"""
+    blob = bytearray()
+    json_bytes = json.dumps(_extract_tensors(doc, blob)).encode('utf-8')
+    json_offset = _align(struct.calcsize(HEADER_FORMAT))
+    blob_offset = _align(json_offset + len(json_bytes))
+    header = struct.pack(HEADER_FORMAT, MAGIC, VERSION, json_offset, len(json_bytes), blob_offset, len(blob))
+    with open(path, 'wb') as file:
+        file.write(header)
+        file.write(b'\0' * (json_offset - len(header)))
+        file.write(json_bytes)
+        file.write(b'\0' * (blob_offset - json_offset - len(json_bytes)))
+        file.write(blob)
+
+if __name__ == "__main__":
+    # Convert an existing JSON model: python -m pynanoflare.binary model.json model.nfbm
+    with open(sys.argv[1], 'r') as file:
+        export_binary(json.load(file), sys.argv[2])
@@ -446,3 +446,16 @@ class Biquad(nn.Module):
             'a2': float(a2.item())
         }
         return doc
+
+class BiquadCascade(nn.Module):
+    def __init__(self, num_sections):
+        super().__init__()
+        self.sections = nn.ModuleList([Biquad() for _ in range(num_sections)])
+
+    def forward(self, x):
+        for section in self.sections:
+            x = section(x)
+        return x
+
+    def generate_doc(self):
+        return { 'sections': [section.generate_doc() for section in self.sections] }
@@ -5,9 +5,15 @@
 #include <torch/script.h>
 #include <torch/torch.h>
 #include <filesystem>
+#include <cmath>
 
+#include "nanoflare/Epilogue.h"
+#include "nanoflare/Functional.h"
+#include "nanoflare/layers/BatchNorm1d.h"
 #include "nanoflare/layers/Biquad.h"
+#include "nanoflare/layers/BiquadCascade.h"
 #include "nanoflare/layers/CausalDilatedConv1d.h"
+#include "nanoflare/layers/Conv1d.h"
 #include "nanoflare/layers/FiLM.h"
 #include "nanoflare/layers/GRU.h"
 #include "nanoflare/layers/LSTM.h"
@@ -15,6 +21,9 @@
 #include "nanoflare/layers/PlainSequential.h"
 #include "nanoflare/layers/ResidualBlock.h"
 #include "nanoflare/layers/TCNBlock.h"
+#include "nanoflare/QuantizedGemm.h"
+#include "nanoflare/SparseGemm.h"
+#include "nanoflare/WeightPrecision.h"
 
 using namespace Nanoflare;
 
@@ -69,6 +78,151 @@ TEST_CASE("BiQuad Test", "[Biquad]")
     auto target = torch_to_eigen_matrix( torch_res );
 
     REQUIRE( (eigen_pred - target).norm() < 1e-5 );
+
+    // The filter state is kept across calls
+    obj.resetState();
+    RowMatrixXf stream_pred = RowMatrixXf::Zero( numChannels, seqLength );
+    for(auto t = 0; t < seqLength; t++)
+        obj.forward( eigen_data.middleCols(t, 1), stream_pred.middleCols(t, 1) );
+
+    REQUIRE( (stream_pred - target).norm() < 1e-5 );
+}
+
+TEST_CASE("BiQuad Tail Test", "[Biquad]")
+{
+    // Resonator with poles at 0.99 * exp(+-j pi/2), impulse response 0.99^n sin((n+1) pi/2)
+    Biquad obj;
+    obj.loadStateDict( nlohmann::json{ {"b0", 1.f}, {"b1", 0.f}, {"b2", 0.f}, {"a1", 0.f}, {"a2", 0.99f * 0.99f} } );
+
+    const size_t tail = obj.getTailLength();
+    REQUIRE( tail > 600 );
+    REQUIRE( tail < 1000 );
+
+    RowMatrixXf impulse = RowMatrixXf::Zero( 1, tail + 100 );
+    impulse(0, 0) = 1.f;
+    RowMatrixXf eigen_pred = RowMatrixXf::Zero( 1, tail + 100 );
+    obj.forward( impulse, eigen_pred );
+
+    REQUIRE( eigen_pred.rightCols(100).cwiseAbs().maxCoeff() < 1e-3f );
+    REQUIRE( eigen_pred.leftCols(tail - 10).cwiseAbs().rightCols(10).maxCoeff() > 5e-4f );
+
+    // Unstable filters never settle
+    obj.loadStateDict( nlohmann::json{ {"b0", 1.f}, {"b1", 0.f}, {"b2", 0.f}, {"a1", -2.f}, {"a2", 1.f} } );
+    REQUIRE( obj.getTailLength() == std::numeric_limits<size_t>::max() );
+}
+
+// Single-section Direct Form II Transposed reference, one channel at a time
+inline void biquad_reference(const nlohmann::json& coefs, RowMatrixXf& x, Eigen::ArrayXf& z1, Eigen::ArrayXf& z2)
+{
+    const float b0 = coefs.at("b0"), b1 = coefs.at("b1"), b2 = coefs.at("b2"), a1 = coefs.at("a1"), a2 = coefs.at("a2");
+    for(auto ch = 0; ch < x.rows(); ch++)
+        for(auto n = 0; n < x.cols(); n++)
+        {
+            const float input = x(ch, n);
+            x(ch, n) = b0 * input + z1(ch);
+            z1(ch) = b1 * input + z2(ch) - a1 * x(ch, n);
+            z2(ch) = b2 * input - a2 * x(ch, n);
+        }
+}
+
+TEST_CASE("BiquadCascade Test", "[BiquadCascade]")
+{
+    // 37 channels go through the 16, 8 and 4 lanes kernels and the scalar one
+    size_t numChannels = 37;
+    size_t seqLength = 300;
+    const std::vector<int> blockSizes = { 1, 63, 128, 17, 91 };
+
+    nlohmann::json stateDict;
+    stateDict["sections"] = {
+        { {"b0", 0.2f}, {"b1", 0.4f}, {"b2", 0.2f}, {"a1", -0.6f}, {"a2", 0.2f} },
+        { {"b0", 1.1f}, {"b1", -1.8f}, {"b2", 0.8f}, {"a1", -1.7f}, {"a2", 0.9f} },
+        { {"b0", 0.9f}, {"b1", 0.1f}, {"b2", -0.3f}, {"a1", 0.5f}, {"a2", 0.3f} }
+    };
+
+    BiquadCascade obj;
+    obj.loadStateDict( stateDict );
+    REQUIRE( obj.getNumSections() == 3 );
+
+    auto eigen_data = torch_to_eigen_matrix( torch::randn({ long(numChannels), long(seqLength) }) );
+
+    // Reference: each section applied in turn over the whole sequence
+    RowMatrixXf target = eigen_data;
+    for(const auto& section: stateDict.at("sections"))
+    {
+        Eigen::ArrayXf z1 = Eigen::ArrayXf::Zero(numChannels), z2 = Eigen::ArrayXf::Zero(numChannels);
+        biquad_reference( section, target, z1, z2 );
+    }
+
+    // Block by block, in place, twice to check resetState
+    for(auto pass = 0; pass < 2; pass++)
+    {
+        obj.resetState();
+        RowMatrixXf eigen_pred = eigen_data;
+        int start = 0;
+        for(auto blockSize: blockSizes)
+        {
+            obj.forward( eigen_pred.middleCols(start, blockSize), eigen_pred.middleCols(start, blockSize) );
+            start += blockSize;
+        }
+        REQUIRE( start == seqLength );
+        REQUIRE( (eigen_pred - target).norm() < 1e-4 );
+    }
+
+    // A cascade of one section is the Biquad layer
+    Biquad biquad;
+    BiquadCascade single;
+    biquad.loadStateDict( stateDict.at("sections").at(1) );
+    single.loadStateDict( nlohmann::json{ {"sections", { stateDict.at("sections").at(1) }} } );
+    RowMatrixXf biquad_pred = RowMatrixXf::Zero( numChannels, seqLength );
+    RowMatrixXf single_pred = RowMatrixXf::Zero( numChannels, seqLength );
+    biquad.forward( eigen_data, biquad_pred );
+    single.forward( eigen_data, single_pred );
+    REQUIRE( (biquad_pred - single_pred).norm() < 1e-6 );
+}
+
+TEST_CASE("BiquadCascade Offline Test", "[BiquadCascade]")
+{
+    size_t numChannels = 3;
+    size_t seqLength = 48000 + 37; // not a multiple of the block size
+
+    nlohmann::json stateDict;
+    stateDict["sections"] = {
+        { {"b0", 0.2f}, {"b1", 0.4f}, {"b2", 0.2f}, {"a1", -0.6f}, {"a2", 0.2f} },
+        { {"b0", 1.1f}, {"b1", -1.8f}, {"b2", 0.8f}, {"a1", -1.7f}, {"a2", 0.9f} }
+    };
+
+    BiquadCascade serial, offline, threaded;
+    serial.loadStateDict( stateDict );
+    offline.loadStateDict( stateDict );
+    threaded.loadStateDict( stateDict );
+
+    auto eigen_data = torch_to_eigen_matrix( torch::randn({ long(numChannels), long(seqLength) }) );
+    RowMatrixXf target = RowMatrixXf::Zero( numChannels, seqLength );
+    RowMatrixXf eigen_pred = RowMatrixXf::Zero( numChannels, seqLength );
+    serial.forward( eigen_data, target );
+    offline.forwardOffline( eigen_data, eigen_pred );
+
+    REQUIRE( (eigen_pred - target).cwiseAbs().maxCoeff() < 1e-5 * target.cwiseAbs().maxCoeff() );
+
+    // Blocks split across 4 threads, in place
+    RowMatrixXf threaded_pred = eigen_data;
+    threaded.forwardOffline( threaded_pred, threaded_pred, 32, 4 );
+
+    REQUIRE( (threaded_pred - target).cwiseAbs().maxCoeff() < 1e-5 * target.cwiseAbs().maxCoeff() );
+    REQUIRE( (threaded_pred - eigen_pred).cwiseAbs().maxCoeff() < 1e-6 * target.cwiseAbs().maxCoeff() );
+
+    // The state carries over to the real-time path
+    auto next_data = torch_to_eigen_matrix( torch::randn({ long(numChannels), 64 }) );
+    RowMatrixXf next_target = RowMatrixXf::Zero( numChannels, 64 );
+    RowMatrixXf next_pred = RowMatrixXf::Zero( numChannels, 64 );
+    serial.forward( next_data, next_target );
+    offline.forward( next_data, next_pred );
+
+    REQUIRE( (next_pred - next_target).cwiseAbs().maxCoeff() < 1e-5 * next_target.cwiseAbs().maxCoeff() );
+
+    threaded.forward( next_data, next_pred );
+
+    REQUIRE( (next_pred - next_target).cwiseAbs().maxCoeff() < 1e-5 * next_target.cwiseAbs().maxCoeff() );
 }
 
 TEST_CASE("CausalDilatedConv1d Test", "[CausalDilatedConv1d]")
@@ -106,6 +260,14 @@ TEST_CASE("CausalDilatedConv1d Test", "[CausalDilatedConv1d]")
     auto target = torch_to_eigen_matrix( torch_res );
 
     REQUIRE( (eigen_pred - target).norm() < 1e-5 );
+
+    // Streaming one sample at a time must match the whole sequence
+    obj.resetState();
+    RowMatrixXf stream_pred = RowMatrixXf::Zero( outChannels, seqLength );
+    for(auto t = 0; t < seqLength; t++)
+        obj.forward( eigen_data.middleCols(t, 1), stream_pred.middleCols(t, 1) );
+
+    REQUIRE( (stream_pred - target).norm() < 1e-5 );
 }
 
 TEST_CASE("FiLM Test", "[FiLM]")
@@ -146,6 +308,147 @@ TEST_CASE("FiLM Test", "[FiLM]")
     REQUIRE( (eigen_pred - target).norm() < 1e-5 );
 }
 
+inline nlohmann::json torch_tensor_json(const torch::Tensor& tensor)
+{
+    auto t = tensor.detach().contiguous();
+    std::vector<float> values( t.data_ptr<float>(), t.data_ptr<float>() + t.numel() );
+    return { {"shape", t.sizes().vec()}, {"values", values} };
+}
+
+// Parameters of a torch module in the state dict format of loadStateDict()
+inline nlohmann::json torch_state_dict(const torch::nn::Module& module)
+{
+    nlohmann::json state_dict;
+    for(const auto& p: module.named_parameters())
+        state_dict[p.key()] = torch_tensor_json( p.value() );
+    return state_dict;
+}
+
+// Prunes parameter name of module with mask and saves it as torch.nn.utils.prune does, as
+// name_orig and name_mask
+inline nlohmann::json torch_pruned_state_dict(torch::nn::Module& module, const std::string& name, const torch::Tensor& mask)
+{
+    torch::NoGradGuard no_grad;
+    auto state_dict = torch_state_dict( module );
+    state_dict.erase( name );
+    auto parameter = module.named_parameters()[name];
+    state_dict[name + "_orig"] = torch_tensor_json( parameter );
+    state_dict[name + "_mask"] = torch_tensor_json( mask );
+    parameter.mul_( mask );
+    return state_dict;
+}
+
+// Zeros with probability sparsity by blocks of block_rows x 1
+inline torch::Tensor torch_block_mask(long rows, long cols, long block_rows, double sparsity)
+{
+    return ( torch::rand({ rows / block_rows, cols }) >= sparsity ).to( torch::kFloat ).repeat_interleave( block_rows, 0 );
+}
+
+TEST_CASE("GRU Test", "[GRU]")
+{
+    // A hidden size that is not a whole number of kernel blocks, streamed in blocks of several sizes
+    size_t inputSize = 3;
+    size_t hiddenSize = 20;
+    const std::vector<int> blockSizes = { 1, 16, 20 };
+
+    torch::nn::GRU module( torch::nn::GRUOptions(inputSize, hiddenSize).batch_first(true) );
+    GRU obj(inputSize, hiddenSize, true);
+    obj.loadStateDict( torch_state_dict(*module) );
+
+    auto torch_data = torch::randn({ 37, long(inputSize) });
+    auto eigen_data = torch_to_eigen_matrix( torch_data );
+    RowMatrixXf eigen_pred = RowMatrixXf::Zero( 37, hiddenSize );
+    int start = 0;
+    for(auto blockSize: blockSizes)
+    {
+        obj.forward( eigen_data.middleRows(start, blockSize), eigen_pred.middleRows(start, blockSize) );
+        start += blockSize;
+    }
+
+    torch::NoGradGuard no_grad;
+    auto torch_res = std::get<0>( module->forward( torch_data.unsqueeze(0) ) );
+    auto target = torch_to_eigen_matrix( torch_res.squeeze(0) );
+
+    REQUIRE( (eigen_pred - target).norm() < 1e-5 );
+}
+
+TEST_CASE("LSTM Test", "[LSTM]")
+{
+    size_t inputSize = 3;
+    size_t hiddenSize = 20;
+    const std::vector<int> blockSizes = { 1, 16, 20 };
+
+    torch::nn::LSTM module( torch::nn::LSTMOptions(inputSize, hiddenSize).batch_first(true) );
+    LSTM obj(inputSize, hiddenSize, true);
+    obj.loadStateDict( torch_state_dict(*module) );
+
+    auto torch_data = torch::randn({ 37, long(inputSize) });
+    auto eigen_data = torch_to_eigen_matrix( torch_data );
+    RowMatrixXf eigen_pred = RowMatrixXf::Zero( 37, hiddenSize );
+    int start = 0;
+    for(auto blockSize: blockSizes)
+    {
+        obj.forward( eigen_data.middleRows(start, blockSize), eigen_pred.middleRows(start, blockSize) );
+        start += blockSize;
+    }
+
+    torch::NoGradGuard no_grad;
+    auto torch_res = std::get<0>( module->forward( torch_data.unsqueeze(0) ) );
+    auto target = torch_to_eigen_matrix( torch_res.squeeze(0) );
+
+    REQUIRE( (eigen_pred - target).norm() < 1e-5 );
+}
+
+template<typename Layer, typename Module>
+void check_sparse_recurrent(Module module, Layer& obj, long gates, long inputSize, long hiddenSize)
+{
+    // W_hh pruned by whole kernel packets: Width hidden units of a gate from one input unit
+    auto mask = torch_block_mask( gates * hiddenSize, hiddenSize, RecurrentKernel<1>::Width, 0.8 );
+    obj.loadStateDict( torch_pruned_state_dict( *module, "weight_hh_l0", mask ) );
+    REQUIRE( obj.isSparse() );
+
+    auto torch_data = torch::randn({ 37, inputSize });
+    auto eigen_data = torch_to_eigen_matrix( torch_data );
+    RowMatrixXf eigen_pred = RowMatrixXf::Zero( 37, hiddenSize );
+    obj.forward( eigen_data.topRows(1), eigen_pred.topRows(1) );
+    obj.forward( eigen_data.bottomRows(36), eigen_pred.bottomRows(36) );
+
+    torch::NoGradGuard no_grad;
+    auto torch_res = std::get<0>( module->forward( torch_data.unsqueeze(0) ) );
+    auto target = torch_to_eigen_matrix( torch_res.squeeze(0) );
+
+    REQUIRE( (eigen_pred - target).norm() < 1e-5 );
+}
+
+TEST_CASE("Sparse Weights Test", "[Sparse]")
+{
+    const long inputSize = 3;
+    const long hiddenSize = 3 * RecurrentKernel<1>::Width;
+
+    GRU gru(inputSize, hiddenSize, true);
+    check_sparse_recurrent( torch::nn::GRU( torch::nn::GRUOptions(inputSize, hiddenSize).batch_first(true) ), gru, 3, inputSize, hiddenSize );
+    LSTM lstm(inputSize, hiddenSize, true);
+    check_sparse_recurrent( torch::nn::LSTM( torch::nn::LSTMOptions(inputSize, hiddenSize).batch_first(true) ), lstm, 4, inputSize, hiddenSize );
+
+    // Unstructured Linear pruning, over whole sparse blocks of time steps and a dense remainder
+    const long inChannels = 24, outChannels = 20, len = 2 * SparseGemm::Width + 13;
+    torch::nn::Linear module( inChannels, outChannels );
+    Linear linear(inChannels, outChannels, true);
+    linear.loadStateDict( torch_pruned_state_dict( *module, "weight", torch_block_mask(outChannels, inChannels, 1, 0.8) ) );
+    REQUIRE( linear.isSparse() );
+
+    auto torch_data = torch::randn({ len, inChannels });
+    auto eigen_data = torch_to_eigen_matrix( torch_data );
+    RowMatrixXf eigen_pred( outChannels, len ), eigen_rows( len, outChannels );
+    linear.forwardTranspose( eigen_data.transpose(), eigen_pred );
+    linear.forward( eigen_data, eigen_rows );
+
+    torch::NoGradGuard no_grad;
+    auto target = torch_to_eigen_matrix( module->forward( torch_data ) );
+    REQUIRE( (eigen_pred.transpose() - target).norm() < 1e-5 );
+    REQUIRE( (eigen_rows - target).norm() < 1e-5 );
+}
+
 TEST_CASE("MicroTCNBlock Test", "[MicroTCNBlock]")
 {
     size_t inChannels = 7;
@@ -219,6 +522,27 @@ TEST_CASE("PlainSequential Test", "[PlainSequential]")
     auto target = torch_to_eigen_matrix( torch_res );
 
     REQUIRE( (eigen_pred - target).norm() < 1e-5 );
+
+    // Blocks of several time tiles, channel-major, and in place
+    auto long_data = torch::randn({ 1000, long(inChannels) });
+    inputs[0] = long_data;
+    auto long_target = torch_to_eigen_matrix( module.forward( inputs ).toTensor() );
+    RowMatrixXf long_pred( outChannels, 1000 );
+    obj.forwardTranspose( torch_to_eigen_matrix( long_data ).transpose(), long_pred );
+    REQUIRE( (long_pred.transpose() - long_target).cwiseAbs().maxCoeff() < 1e-4f );
+
+    auto linear_json = []( size_t in, size_t out ) {
+        return nlohmann::json{ {"weight", torch_tensor_json(torch::randn({ long(out), long(in) }))}, {"bias", torch_tensor_json(torch::randn({ long(out) }))} };
+    };
+    PlainSequential square(inChannels, inChannels, hiddenChannels, numHiddenLayers);
+    square.loadStateDict({ {"negative_slope", 0.1f}, {"input_linear", linear_json(inChannels, hiddenChannels)}, {"output_linear", linear_json(hiddenChannels, inChannels)},
+                           {"hidden_linear.0", linear_json(hiddenChannels, hiddenChannels)}, {"hidden_linear.1", linear_json(hiddenChannels, hiddenChannels)},
+                           {"hidden_linear.2", linear_json(hiddenChannels, hiddenChannels)} });
+    RowMatrixXf square_data = torch_to_eigen_matrix( torch::randn({ long(inChannels), 1000 }) );
+    RowMatrixXf square_pred( inChannels, 1000 );
+    square.forwardTranspose( square_data, square_pred );
+    square.forwardTranspose( square_data, square_data );
+    REQUIRE( square_data == square_pred );
 }
 
 TEST_CASE("ResidualBlock Test", "[ResidualBlock]")
@@ -298,6 +622,49 @@ TEST_CASE("TCNBlock Test", "[TCNBlock]")
     REQUIRE( (eigen_pred - target).norm() < 1e-5 );
 }
 
+TEST_CASE("BatchNorm Folding Test", "[TCNBlock]")
+{
+    // Batch norms with trained statistics, folded into the convolutions against applied after them
+    const long inChannels = 7, outChannels = 11, kernelSize = 3, dilation = 2, seqLength = 64;
+    std::filesystem::path modelPath( PROJECT_SOURCE_DIR );
+    modelPath /= std::filesystem::path("tests/data/tcnblock.json");
+    std::ifstream model_file( modelPath.c_str() );
+    auto state_dict = nlohmann::json::parse(model_file);
+    for(auto bn: { "bn1", "bn2" })
+        state_dict[bn] = { {"weight", torch_tensor_json(torch::randn({ outChannels }))},
+                           {"bias", torch_tensor_json(torch::randn({ outChannels }))},
+                           {"running_mean", torch_tensor_json(torch::randn({ outChannels }))},
+                           {"running_var", torch_tensor_json(torch::rand({ outChannels }) + 0.1)} };
+
+    TCNBlock obj(inChannels, outChannels, kernelSize, dilation, true);
+    obj.loadStateDict( state_dict );
+    CausalDilatedConv1d conv1(inChannels, outChannels, kernelSize, true, dilation), conv2(outChannels, outChannels, kernelSize, true, 1);
+    Conv1d conv(inChannels, outChannels, 1, true);
+    BatchNorm1d bn1(outChannels), bn2(outChannels);
+    conv1.loadStateDict( state_dict.at("conv1") );
+    conv2.loadStateDict( state_dict.at("conv2") );
+    conv.loadStateDict( state_dict.at("conv") );
+    bn1.loadStateDict( state_dict.at("bn1") );
+    bn2.loadStateDict( state_dict.at("bn2") );
+
+    // Two blocks, the second one a single sample
+    auto data = torch_to_eigen_matrix( torch::randn({ inChannels, seqLength }) );
+    RowMatrixXf pred( outChannels, seqLength ), target( outChannels, seqLength ), skip( outChannels, seqLength );
+    obj.forward( data.leftCols(seqLength - 1), pred.leftCols(seqLength - 1) );
+    obj.forward( data.rightCols(1), pred.rightCols(1) );
+
+    conv1.forward( data, target );
+    bn1.apply( target );
+    Functional::LeakyReLU( target, 0.2f );
+    conv2.forward( target, target );
+    bn2.apply( target );
+    Functional::LeakyReLU( target, 0.2f );
+    conv.forward( data, skip );
+    target += skip;
+
+    REQUIRE( (pred - target).cwiseAbs().maxCoeff() < 1e-5f * std::max( 1.f, target.cwiseAbs().maxCoeff() ) );
+}
+
 TEST_CASE("convolve1d Test", "[convolve1d]")
 {
     Eigen::RowVectorXf x(5);
@@ -332,4 +699,292 @@ TEST_CASE("dilatedcausalconvolve1d Test", "[dilatedcausalconvolve1d]")
     target << 0.f, -1.f, -2.f, -2.5f, -3.0f;
 
     REQUIRE((pred - target).norm() < 1e-5);
-}
\ No newline at end of file
+}
+TEST_CASE("Activations Test", "[Activations]")
+{
+    // Documented maximum errors of every precision, see ActivationPrecision
+    const std::pair<ActivationPrecision, float> bounds[] = {
+        { ActivationPrecision::Exact, 4e-7f }, { ActivationPrecision::Rational, 1e-4f }, { ActivationPrecision::Polynomial, 1e-4f } };
+
+    Eigen::ArrayXf x = Eigen::ArrayXf::LinSpaced(200001, -20.f, 20.f);
+    Eigen::ArrayXf tanh_target = x.unaryExpr([](float v) { return static_cast<float>(std::tanh(static_cast<double>(v))); });
+    Eigen::ArrayXf sigmoid_target = x.unaryExpr([](float v) { return static_cast<float>(1.0 / (1.0 + std::exp(-static_cast<double>(v)))); });
+
+    for(auto [precision, bound]: bounds)
+    {
+        RowMatrixXf y = x.transpose().matrix();
+        Functional::Tanh( y, precision );
+        REQUIRE( (y.transpose().array() - tanh_target).abs().maxCoeff() < bound );
+        REQUIRE( y.array().abs().maxCoeff() <= 1.f );
+
+        y = x.transpose().matrix();
+        Functional::Sigmoid( y, precision );
+        REQUIRE( (y.transpose().array() - sigmoid_target).abs().maxCoeff() < bound );
+    }
+}
+
+TEST_CASE("Reduced Weights Test", "[WeightPrecision]")
+{
+    // Documented relative rounding errors, see WeightPrecision
+    const std::pair<WeightPrecision, float> bounds[] = {
+        { WeightPrecision::Float16, 5e-4f }, { WeightPrecision::BFloat16, 4e-3f } };
+
+    const RowMatrixXf m = RowMatrixXf::Random(37, 29).array() * 10.f;
+    for(auto [precision, bound]: bounds)
+    {
+        RowMatrixXf w = m;
+        ReducedWeights reduced;
+        reduced.convert( w, precision );
+        REQUIRE( reduced.isReduced() );
+        REQUIRE( w.size() == 0 );
+        REQUIRE( reduced.getSize( w ) == m.size() * 2 );
+
+        // The vectorised widening matches Eigen's element-wise casts
+        RowMatrixXf widened( m.rows(), m.cols() );
+        reduced.widen( widened );
+        if(precision == WeightPrecision::Float16)
+            REQUIRE( widened == reduced.f16.cast<float>() );
+        else
+            REQUIRE( widened == reduced.bf16.cast<float>() );
+        REQUIRE( ((widened - m).array().abs() / m.array().abs()).maxCoeff() <= bound );
+
+        reduced.convert( w, WeightPrecision::Float32 );
+        REQUIRE( !reduced.isReduced() );
+        REQUIRE( w == widened );
+    }
+}
+
+TEST_CASE("Quantized GEMM Test", "[Quantization]")
+{
+    // Shapes off the register blocks, the depth groups and the 16 time step lanes
+    const Eigen::Index rows = 13, depth = 37, cols = 45;
+    const RowMatrixXf w = RowMatrixXf::Random(rows, depth);
+    const Eigen::VectorXf b = Eigen::VectorXf::Random(rows);
+    const RowMatrixXf x = RowMatrixXf::Random(depth, cols);
+    const RowMatrixXf target = (w * x).colwise() + b;
+
+    // Half a quantization step of error on the weights and on inputs within +-1, at most
+    // depth * max|w| * (1 / 254 + 1 / 254) for int8 inputs
+    const float max_weight = w.cwiseAbs().maxCoeff();
+    const std::pair<Quantization, float> bounds[] = {
+        { Quantization::Int8, depth * max_weight / 127.f }, { Quantization::Int16, depth * max_weight / 254.f * 1.01f } };
+
+    for(auto [mode, bound]: bounds)
+    {
+        const auto quantized = QuantizedGemm::quantize( w, b, 1.f, mode );
+        std::vector<int32_t> packed( QuantizedGemm::packedSize(depth, cols, mode) );
+        RowMatrixXf y( rows, cols );
+        QuantizedGemm::forward( quantized, x, packed.data(), y );
+        REQUIRE( (y - target).cwiseAbs().maxCoeff() <= bound );
+
+        // Accumulating adds the same product, a single column packs as a block does
+        RowMatrixXf sum = target;
+        QuantizedGemm::forward<true>( quantized, x, packed.data(), sum );
+        REQUIRE( ((sum - target) - y).cwiseAbs().maxCoeff() < 1e-5f * target.cwiseAbs().maxCoeff() );
+        RowMatrixXf column( rows, 1 );
+        QuantizedGemm::forward( quantized, x.col(7), packed.data(), column );
+        REQUIRE( column == y.col(7) );
+    }
+}
+
+TEST_CASE("Quantized Layers Test", "[Quantization]")
+{
+    std::filesystem::path convPath( PROJECT_SOURCE_DIR );
+    convPath /= std::filesystem::path("tests/data/causaldilatedconv1d.json");
+    std::filesystem::path sequentialPath( PROJECT_SOURCE_DIR );
+    sequentialPath /= std::filesystem::path("tests/data/plainsequential.json");
+
+    for(auto mode: { Quantization::Int8, Quantization::Int16 })
+    {
+        // Calibrated on another signal than the one compared
+        CausalDilatedConv1d conv(7, 11, 3, true, 2);
+        std::ifstream conv_file( convPath.c_str() );
+        conv.loadStateDict( nlohmann::json::parse(conv_file) );
+        RowMatrixXf calibration = torch_to_eigen_matrix( torch::randn({ 7, 64 }) );
+        RowMatrixXf data = torch_to_eigen_matrix( torch::randn({ 7, 64 }) );
+        RowMatrixXf target( 11, 64 ), pred( 11, 64 ), stream_pred( 11, 64 );
+
+        conv.setCalibration( true );
+        conv.forward( calibration, target );
+        conv.setCalibration( false );
+        conv.resetState();
+        conv.forward( data, target );
+
+        conv.setQuantization( mode );
+        REQUIRE( conv.getQuantization() == mode );
+        conv.resetState();
+        conv.forward( data, pred );
+        REQUIRE( (pred - target).norm() < 2e-2f * target.norm() );
+
+        // Single samples run the same integer products as blocks
+        conv.resetState();
+        for(auto t = 0; t < data.cols(); t++)
+            conv.forward( data.middleCols(t, 1), stream_pred.middleCols(t, 1) );
+        REQUIRE( (stream_pred - pred).cwiseAbs().maxCoeff() < 1e-5f );
+
+        // Time-major and channel-major Linear products
+        PlainSequential sequential(7, 11, 8, 3);
+        std::ifstream sequential_file( sequentialPath.c_str() );
+        sequential.loadStateDict( nlohmann::json::parse(sequential_file) );
+        RowMatrixXf rows_target( 64, 11 ), rows_pred( 64, 11 ), cols_target( 11, 64 ), cols_pred( 11, 64 );
+
+        sequential.setCalibration( true );
+        sequential.forwardTranspose( calibration, cols_target );
+        sequential.setCalibration( false );
+        sequential.forward( data.transpose(), rows_target );
+        sequential.forwardTranspose( data, cols_target );
+
+        sequential.setQuantization( mode );
+        sequential.forward( data.transpose(), rows_pred );
+        sequential.forwardTranspose( data, cols_pred );
+        REQUIRE( (rows_pred - rows_target).norm() < 2e-2f * rows_target.norm() );
+        REQUIRE( (cols_pred - rows_pred.transpose()).cwiseAbs().maxCoeff() < 1e-5f );
+
+        sequential.setQuantization( Quantization::None );
+        sequential.forwardTranspose( data, cols_pred );
+        REQUIRE( cols_pred == cols_target );
+    }
+}
+
+TEST_CASE("Low Rank Layers Test", "[LowRank]")
+{
+    // Weights of rank 3: the truncation keeps it exactly, max_rank cuts below it
+    const long inChannels = 8, outChannels = 12, kernelSize = 3, len = 50;
+    auto low_rank = []( long rows, long cols ) { return torch::matmul( torch::randn({ rows, 3 }), torch::randn({ 3, cols }) ); };
+    auto data = torch_to_eigen_matrix( torch::randn({ inChannels, len }) );
+
+    Linear linear(inChannels, outChannels, true);
+    auto linear_weight = low_rank( outChannels, inChannels );
+    linear.loadStateDict({ {"weight", torch_tensor_json(linear_weight)}, {"bias", torch_tensor_json(torch::randn({ outChannels }))} });
+    CausalDilatedConv1d cdc(inChannels, outChannels, kernelSize, true, 2);
+    Conv1d conv(inChannels, outChannels, kernelSize, true);
+    const nlohmann::json conv_state = { {"weight", torch_tensor_json(low_rank( outChannels, inChannels * kernelSize ).reshape({ outChannels, inChannels, kernelSize }))},
+                                        {"bias", torch_tensor_json(torch::randn({ outChannels }))} };
+    cdc.loadStateDict( conv_state );
+    conv.loadStateDict( conv_state );
+
+    RowMatrixXf linear_target( outChannels, len ), cdc_target( outChannels, len ), conv_target( outChannels, len - kernelSize + 1 );
+    linear.forwardTranspose( data, linear_target );
+    cdc.forward( data, cdc_target );
+    conv.forward( data, conv_target );
+
+    for(auto [energy, max_rank, rank]: { std::tuple{ 0.9999f, 0l, 3l }, std::tuple{ 1.f, 2l, 2l } })
+    {
+        linear.setLowRank( energy, max_rank );
+        cdc.setLowRank( energy, max_rank );
+        conv.setLowRank( energy, max_rank );
+        REQUIRE( (linear.getRank() == rank && cdc.getRank() == rank && conv.getRank() == rank) );
+
+        RowMatrixXf linear_pred( outChannels, len ), cdc_pred( outChannels, len ), conv_pred( outChannels, len - kernelSize + 1 ), rows_pred( len, outChannels );
+        linear.forwardTranspose( data, linear_pred );
+        linear.forward( data.transpose(), rows_pred );
+        cdc.resetState();
+        cdc.forward( data.leftCols(1), cdc_pred.leftCols(1) );
+        cdc.forward( data.rightCols(len - 1), cdc_pred.rightCols(len - 1) );
+        conv.forward( data, conv_pred );
+        REQUIRE( (rows_pred.transpose() - linear_pred).cwiseAbs().maxCoeff() < 1e-5f );
+
+        // The output error follows the reconstruction error of the weights
+        for(auto [pred, target, error]: { std::tuple{ &linear_pred, &linear_target, linear.getLowRankError() },
+                                          std::tuple{ &cdc_pred, &cdc_target, cdc.getLowRankError() },
+                                          std::tuple{ &conv_pred, &conv_target, conv.getLowRankError() } })
+        {
+            if(rank == 3)
+                REQUIRE( (error < 1e-4f && (*pred - *target).norm() < 1e-4f * target->norm()) );
+            else
+                REQUIRE( (error > 1e-3f && (*pred - *target).norm() > 0.f) );
+        }
+    }
+
+    // Back to the full weights
+    linear.setLowRank( 1.f );
+    cdc.setLowRank( 1.f );
+    REQUIRE( (linear.getRank() == 0 && cdc.getRank() == 0) );
+    RowMatrixXf pred( outChannels, len );
+    linear.forwardTranspose( data, pred );
+    REQUIRE( pred == linear_target );
+    cdc.resetState();
+    cdc.forward( data, pred );
+    REQUIRE( pred == cdc_target );
+}
+
+TEST_CASE("Epilogue Test", "[Epilogue]")
+{
+    // Long enough for several GEMM panels, see Epilogue::panelWidth()
+    const long inChannels = 8, outChannels = 12, len = 700;
+    auto data = torch_to_eigen_matrix( torch::randn({ inChannels, len }) );
+    const RowMatrixXf residual = torch_to_eigen_matrix( torch::randn({ outChannels, len }) );
+    const Eigen::RowVectorXf slopes = torch_to_eigen_vector( torch::rand({ outChannels }) );
+
+    const Epilogue epilogues[] = {
+        Epilogue().withActivation( Epilogue::Activation::LeakyReLU, 0.2f ).withResidual( residual ),
+        Epilogue().withActivation( Epilogue::Activation::ReLU ).withScale( 0.5f ),
+        Epilogue().withPReLU( slopes.data() ).withResidual( residual ),
+        Epilogue().withTanh( ActivationPrecision::Exact ).withScale( 2.f ) };
+
+    // The unfused passes the epilogue replaces, on a channel-major output from time step t
+    auto reference = [&]( const Epilogue& epilogue, RowMatrixXf y, Eigen::Index t ) {
+        for(auto o = 0; o < y.rows(); o++)
+            for(auto i = 0; i < y.cols(); i++)
+            {
+                float& v = y(o, i);
+                switch(epilogue.activation)
+                {
+                    case Epilogue::Activation::None:      break;
+                    case Epilogue::Activation::ReLU:      v = std::max( v, 0.f ); break;
+                    case Epilogue::Activation::LeakyReLU: v = v > 0.f ? v : 0.2f * v; break;
+                    case Epilogue::Activation::PReLU:     v = v > 0.f ? v : slopes(o) * v; break;
+                    case Epilogue::Activation::Tanh:      v = std::tanh( v ); break;
+                }
+                v *= epilogue.scale;
+                if(epilogue.residual != nullptr)
+                    v += residual(o, t + i);
+            }
+        return y;
+    };
+
+    for(long kernelSize: { 1l, 3l })
+    {
+        const nlohmann::json conv_state = { {"weight", torch_tensor_json(torch::randn({ outChannels, inChannels, kernelSize }))},
+                                            {"bias", torch_tensor_json(torch::randn({ outChannels }))} };
+        CausalDilatedConv1d cdc(inChannels, outChannels, kernelSize, true, 2);
+        Conv1d conv(inChannels, outChannels, kernelSize, true);
+        cdc.loadStateDict( conv_state );
+        conv.loadStateDict( conv_state );
+        const long convLen = len - kernelSize + 1;
+
+        RowMatrixXf cdc_plain( outChannels, len ), conv_plain( outChannels, convLen );
+        cdc.forward( data, cdc_plain );
+        conv.forward( data, conv_plain );
+
+        for(const auto& epilogue: epilogues)
+        {
+            // Whole blocks, then a single sample after a block
+            RowMatrixXf cdc_pred( outChannels, len ), conv_pred( outChannels, convLen );
+            cdc.resetState();
+            cdc.forward( data.leftCols(len - 1), cdc_pred.leftCols(len - 1), epilogue );
+            cdc.forward( data.rightCols(1), cdc_pred.rightCols(1), epilogue.fromTimeStep(len - 1) );
+            conv.forward( data, conv_pred, epilogue );
+            REQUIRE( (cdc_pred - reference( epilogue, cdc_plain, 0 )).cwiseAbs().maxCoeff() < 1e-4f );
+            REQUIRE( (conv_pred - reference( epilogue, conv_plain, 0 )).cwiseAbs().maxCoeff() < 1e-4f );
+        }
+    }
+
+    Linear linear(inChannels, outChannels, true);
+    linear.loadStateDict({ {"weight", torch_tensor_json(torch::randn({ outChannels, inChannels }))}, {"bias", torch_tensor_json(torch::randn({ outChannels }))} });
+    RowMatrixXf linear_plain( outChannels, len );
+    linear.forwardTranspose( data, linear_plain );
+    const RowMatrixXf residual_rows = residual.transpose();
+    for(auto epilogue: epilogues)
+    {
+        RowMatrixXf cols_pred( outChannels, len ), rows_pred( len, outChannels );
+        linear.forwardTranspose( data, cols_pred, epilogue );
+        REQUIRE( (cols_pred - reference( epilogue, linear_plain, 0 )).cwiseAbs().maxCoeff() < 1e-4f );
+
+        // Time-major outputs take a time-major residual
+        if(epilogue.residual != nullptr)
+            epilogue = epilogue.withResidual( residual_rows );
+        linear.forward( data.transpose(), rows_pred, epilogue );
+        REQUIRE( (rows_pred.transpose() - cols_pred).cwiseAbs().maxCoeff() < 1e-4f );
+    }
+}
@@ -1,10 +1,16 @@
 #include <catch2/catch_test_macros.hpp>
 #include <catch2/benchmark/catch_benchmark.hpp>
+#include <random>
+#include "nanoflare/Epilogue.h"
+#include "nanoflare/Functional.h"
+#include "nanoflare/layers/Biquad.h"
 #include "nanoflare/layers/Linear.h"
 #include "nanoflare/layers/GRU.h"
 #include "nanoflare/layers/LSTM.h"
 #include "nanoflare/layers/Conv1d.h"
 #include "nanoflare/layers/CausalDilatedConv1d.h"
+#include "nanoflare/layers/PlainSequential.h"
+#include "nanoflare/layers/TCNBlock.h"
 #include "nanoflare/utils.h"
 
 using namespace Nanoflare;
@@ -41,6 +47,11 @@ TEST_CASE("GRU 1->64")
     RowMatrixXf x = RowMatrixXf::Random(num_samples, 1);
     RowMatrixXf y = RowMatrixXf::Zero(num_samples, 64);
     BENCHMARK("Nanoflare") { nf.resetState(); nf.forward(x, y); return y(0, 0); };
+
+    nf.setActivationPrecision(ActivationPrecision::Rational);
+    BENCHMARK("Nanoflare rational") { nf.resetState(); nf.forward(x, y); return y(0, 0); };
+    nf.setActivationPrecision(ActivationPrecision::Polynomial);
+    BENCHMARK("Nanoflare polynomial") { nf.resetState(); nf.forward(x, y); return y(0, 0); };
 }
 
 // ---------------------------------------------------------------------------
@@ -53,6 +64,11 @@ TEST_CASE("LSTM 1->64")
     RowMatrixXf x = RowMatrixXf::Random(num_samples, 1);
     RowMatrixXf y = RowMatrixXf::Zero(num_samples, 64);
     BENCHMARK("Nanoflare") { nf.resetState(); nf.forward(x, y); return y(0, 0); };
+
+    nf.setActivationPrecision(ActivationPrecision::Rational);
+    BENCHMARK("Nanoflare rational") { nf.resetState(); nf.forward(x, y); return y(0, 0); };
+    nf.setActivationPrecision(ActivationPrecision::Polynomial);
+    BENCHMARK("Nanoflare polynomial") { nf.resetState(); nf.forward(x, y); return y(0, 0); };
 }
 
 // ---------------------------------------------------------------------------
@@ -86,3 +102,276 @@ TEST_CASE("CausalDilatedConv1d 8->8 k=3 d=8")
     RowMatrixXf y = RowMatrixXf::Zero(8, num_samples);
     BENCHMARK("Nanoflare") { nf.forward(x, y); return y(0, 0); };
 }
+
+// Every convolution shape of the bundled models, against the im2col + GEMM they used to run
+TEST_CASE("CausalDilatedConv1d shapes")
+{
+    struct Shape { int in, out, kernel, dilation; };
+    for(auto shape: { Shape{1, 8, 3, 1}, Shape{8, 8, 3, 1}, Shape{8, 8, 3, 16}, Shape{8, 16, 3, 1},
+                      Shape{7, 7, 4, 8}, Shape{16, 32, 3, 1}, Shape{8, 8, 1, 1}, Shape{8, 16, 1, 1}, Shape{16, 1, 1, 1} })
+    {
+        const std::string name = std::to_string(shape.in) + "->" + std::to_string(shape.out) + " k="
+            + std::to_string(shape.kernel) + " d=" + std::to_string(shape.dilation);
+        for(int len: { 64, 512 })
+        {
+            CausalDilatedConv1d nf(shape.in, shape.out, shape.kernel, true, shape.dilation);
+            RowMatrixXf x = RowMatrixXf::Random(shape.in, len);
+            RowMatrixXf y = RowMatrixXf::Zero(shape.out, len);
+            BENCHMARK("Nanoflare " + name + " T=" + std::to_string(len)) { nf.forward(x, y); return y(0, 0); };
+
+            RowMatrixXf w = RowMatrixXf::Random(shape.out, shape.in * shape.kernel);
+            RowMatrixXf im2col = RowMatrixXf::Zero(shape.in * shape.kernel, len);
+            BENCHMARK("im2col " + name + " T=" + std::to_string(len))
+            {
+                const int left_pad = shape.dilation * (shape.kernel - 1);
+                for(int j = 0; j < shape.in; ++j)
+                    for(int k = 0; k < shape.kernel; ++k)
+                    {
+                        const int from_history = std::min(len, left_pad - k * shape.dilation);
+                        im2col.row(j * shape.kernel + k).tail(len - from_history) = x.row(j).head(len - from_history);
+                    }
+                y.noalias() = w * im2col;
+                return y(0, 0);
+            };
+        }
+    }
+}
+
+// Float against integer inference at WaveNet shapes, see QuantizedGemm
+TEST_CASE("Quantized CausalDilatedConv1d")
+{
+    for(int channels: { 16, 32, 64, 128 })
+        for(int len: { 64, 512 })
+            for(auto [label, mode]: { std::pair{ "float", Quantization::None }, std::pair{ "int8", Quantization::Int8 },
+                                      std::pair{ "int16", Quantization::Int16 } })
+            {
+                CausalDilatedConv1d nf(channels, 2 * channels, 3, true, 4);
+                RowMatrixXf x = RowMatrixXf::Random(channels, len);
+                RowMatrixXf y = RowMatrixXf::Zero(2 * channels, len);
+                nf.setCalibration(true);
+                nf.forward(x, y);
+                nf.setCalibration(false);
+                nf.setQuantization(mode);
+                BENCHMARK(std::string(label) + " " + std::to_string(channels) + "->" + std::to_string(2 * channels) + " k=3 T=" + std::to_string(len))
+                {
+                    nf.forward(x, y);
+                    return y(0, 0);
+                };
+            }
+}
+
+TEST_CASE("Quantized Linear 64->64")
+{
+    for(auto [label, mode]: { std::pair{ "float", Quantization::None }, std::pair{ "int8", Quantization::Int8 },
+                              std::pair{ "int16", Quantization::Int16 } })
+    {
+        Linear nf(64, 64, true);
+        RowMatrixXf x = RowMatrixXf::Random(64, 512);
+        RowMatrixXf y = RowMatrixXf::Zero(64, 512);
+        nf.setCalibration(true);
+        nf.forwardTranspose(x, y);
+        nf.setCalibration(false);
+        nf.setQuantization(mode);
+        BENCHMARK(std::string(label) + " T=512") { nf.forwardTranspose(x, y); return y(0, 0); };
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Sparse weights
+// ---------------------------------------------------------------------------
+
+// Random (rows, cols) weights pruned with probability sparsity by blocks of block_rows x 1
+inline nlohmann::json prunedTensor(Eigen::Index rows, Eigen::Index cols, Eigen::Index block_rows, double sparsity)
+{
+    static std::mt19937 gen(0);
+    std::bernoulli_distribution pruned(sparsity);
+    RowMatrixXf w = RowMatrixXf::Random(rows, cols);
+    for(Eigen::Index i = 0; i < rows; i += block_rows)
+        for(Eigen::Index j = 0; j < cols; j++)
+            if(pruned(gen))
+                w.block(i, j, block_rows, 1).setZero();
+    return { {"shape", { rows, cols }}, {"values", std::vector<float>(w.data(), w.data() + w.size())} };
+}
+
+inline nlohmann::json randomTensor(Eigen::Index size)
+{
+    Eigen::VectorXf v = Eigen::VectorXf::Random(size);
+    return { {"shape", { size }}, {"values", std::vector<float>(v.data(), v.data() + v.size())} };
+}
+
+// Recurrent cells pruned by kernel packets, dense below RecurrentKernel::SparseThreshold
+TEST_CASE("Sparse GRU and LSTM 1->64")
+{
+    constexpr int hidden = 64;
+    for(double sparsity: { 0.0, 0.5, 0.6, 0.7, 0.8, 0.9 })
+    {
+        const std::string label = std::to_string(int(sparsity * 100)) + "% zeros";
+        RowMatrixXf x = RowMatrixXf::Random(num_samples, 1);
+        RowMatrixXf y = RowMatrixXf::Zero(num_samples, hidden);
+
+        GRU gru(1, hidden, true);
+        gru.loadStateDict({ {"weight_ih_l0", prunedTensor(3 * hidden, 1, 1, 0.0)},
+                            {"weight_hh_l0", prunedTensor(3 * hidden, hidden, RecurrentKernel<3>::Width, sparsity)},
+                            {"bias_ih_l0", randomTensor(3 * hidden)}, {"bias_hh_l0", randomTensor(3 * hidden)} });
+        BENCHMARK("GRU " + label) { gru.resetState(); gru.forward(x, y); return y(0, 0); };
+
+        LSTM lstm(1, hidden, true);
+        lstm.loadStateDict({ {"weight_ih_l0", prunedTensor(4 * hidden, 1, 1, 0.0)},
+                             {"weight_hh_l0", prunedTensor(4 * hidden, hidden, RecurrentKernel<4>::Width, sparsity)},
+                             {"bias_ih_l0", randomTensor(4 * hidden)}, {"bias_hh_l0", randomTensor(4 * hidden)} });
+        BENCHMARK("LSTM " + label) { lstm.resetState(); lstm.forward(x, y); return y(0, 0); };
+    }
+}
+
+// Unstructured pruning, dense below SparseGemm::SparseThreshold
+TEST_CASE("Sparse Linear 64->64")
+{
+    for(double sparsity: { 0.0, 0.5, 0.7, 0.8, 0.9 })
+        for(int len: { 64, 512 })
+        {
+            Linear nf(64, 64, true);
+            nf.loadStateDict({ {"weight", prunedTensor(64, 64, 1, sparsity)}, {"bias", randomTensor(64)} });
+            RowMatrixXf x = RowMatrixXf::Random(64, len);
+            RowMatrixXf y = RowMatrixXf::Zero(64, len);
+            BENCHMARK(std::to_string(int(sparsity * 100)) + "% zeros T=" + std::to_string(len)) { nf.forwardTranspose(x, y); return y(0, 0); };
+        }
+}
+
+TEST_CASE("Low Rank Linear and Conv1d 128->128")
+{
+    // Truncated to max_rank, 0 keeps the full weights
+    for(int rank: { 0, 48, 32, 16 })
+    {
+        Linear linear(128, 128, true);
+        linear.loadStateDict({ {"weight", prunedTensor(128, 128, 1, 0.0)}, {"bias", randomTensor(128)} });
+        linear.setLowRank(1.f, rank);
+        Conv1d conv(128, 128, 3, true);
+        conv.loadStateDict({ {"weight", prunedTensor(128, 128 * 3, 1, 0.0)}, {"bias", randomTensor(128)} });
+        conv.setLowRank(1.f, rank);
+        RowMatrixXf x = RowMatrixXf::Random(128, 256);
+        RowMatrixXf y = RowMatrixXf::Zero(128, 256);
+        RowMatrixXf z = RowMatrixXf::Zero(128, 256 - 2);
+        BENCHMARK("Linear rank " + std::to_string(rank)) { linear.forwardTranspose(x, y); return y(0, 0); };
+        BENCHMARK("Conv1d k=3 rank " + std::to_string(rank)) { conv.forward(x, z); return z(0, 0); };
+    }
+}
+
+// Batch norms folded into the convolutions at load time
+TEST_CASE("TCNBlock with batch norm")
+{
+    for(int channels: { 8, 16, 32 })
+    {
+        auto conv = [channels](int in_channels, int kernel_size) {
+            return nlohmann::json{ {"weight", prunedTensor(channels, in_channels * kernel_size, 1, 0.0)}, {"bias", randomTensor(channels)} };
+        };
+        auto bn = [channels]() {
+            return nlohmann::json{ {"weight", randomTensor(channels)}, {"bias", randomTensor(channels)}, {"running_mean", randomTensor(channels)},
+                                   {"running_var", { {"shape", { channels }}, {"values", std::vector<float>(channels, 0.5f)} }} };
+        };
+        TCNBlock nf(channels, channels, 3, 4, true);
+        nf.loadStateDict({ {"conv", conv(channels, 1)}, {"conv1", conv(channels, 3)}, {"conv2", conv(channels, 3)}, {"bn1", bn()}, {"bn2", bn()} });
+        RowMatrixXf x = RowMatrixXf::Random(channels, num_samples);
+        RowMatrixXf y = RowMatrixXf::Zero(channels, num_samples);
+        BENCHMARK("Nanoflare " + std::to_string(channels) + " channels") { nf.forward(x, y); return y(0, 0); };
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Epilogue fusion: LeakyReLU and residual add of a TCNBlock conv applied to
+// the output in registers or L1, against one pass over it for each
+// ---------------------------------------------------------------------------
+
+TEST_CASE("Epilogue fusion")
+{
+    const Epilogue fused = Epilogue().withActivation( Epilogue::Activation::LeakyReLU, 0.2f );
+    for(int channels: { 16, 64 })
+        for(int len: { 64, 512 })
+        {
+            const std::string shape = std::to_string(channels) + "->" + std::to_string(channels) + " T=" + std::to_string(len);
+            RowMatrixXf x = RowMatrixXf::Random(channels, len);
+            RowMatrixXf y = RowMatrixXf::Zero(channels, len);
+
+            for(int kernel_size: { 1, 3 })
+            {
+                CausalDilatedConv1d nf(channels, channels, kernel_size, true, 2);
+                const std::string name = "CausalDilatedConv1d k=" + std::to_string(kernel_size) + " " + shape;
+                BENCHMARK(name + " separate") { nf.forward(x, y); Functional::LeakyReLU(y, 0.2f); y += x; return y(0, 0); };
+                BENCHMARK(name + " fused") { nf.forward(x, y, fused.withResidual(x)); return y(0, 0); };
+            }
+
+            Linear nf(channels, channels, true);
+            BENCHMARK("Linear " + shape + " separate") { nf.forwardTranspose(x, y); Functional::LeakyReLU(y, 0.2f); y += x; return y(0, 0); };
+            BENCHMARK("Linear " + shape + " fused") { nf.forwardTranspose(x, y, fused.withResidual(x)); return y(0, 0); };
+        }
+}
+
+// ---------------------------------------------------------------------------
+// PlainSequential heads of TCN, MicroTCN and ResRNN, run over time tiles
+// ---------------------------------------------------------------------------
+
+TEST_CASE("PlainSequential")
+{
+    for(auto [in_channels, hidden_channels]: { std::pair{ 8, 8 }, std::pair{ 8, 24 }, std::pair{ 64, 8 } })
+    {
+        auto linear = [](int in, int out) { return nlohmann::json{ {"weight", prunedTensor(out, in, 1, 0.0)}, {"bias", randomTensor(out)} }; };
+        PlainSequential nf(in_channels, 1, hidden_channels, 3);
+        nf.loadStateDict({ {"negative_slope", 0.01f}, {"direct_linear", { {"weight", prunedTensor(1, in_channels, 1, 0.0)} }},
+                           {"input_linear", linear(in_channels, hidden_channels)}, {"output_linear", linear(hidden_channels, 1)},
+                           {"hidden_linear.0", linear(hidden_channels, hidden_channels)}, {"hidden_linear.1", linear(hidden_channels, hidden_channels)},
+                           {"hidden_linear.2", linear(hidden_channels, hidden_channels)} });
+        for(int len: { 64, 512, 4096 })
+        {
+            RowMatrixXf x = RowMatrixXf::Random(in_channels, len);
+            RowMatrixXf y = RowMatrixXf::Zero(1, len);
+            BENCHMARK(std::to_string(in_channels) + "->" + std::to_string(hidden_channels) + "x3->1 T=" + std::to_string(len)) { nf.forwardTranspose(x, y); return y(0, 0); };
+        }
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Biquad
+// ---------------------------------------------------------------------------
+
+TEST_CASE("Biquad")
+{
+    nlohmann::json coefs = { {"b0", 0.2f}, {"b1", 0.4f}, {"b2", 0.2f}, {"a1", -0.6f}, {"a2", 0.2f} };
+    for(int channels: { 1, 2, 8, 32 })
+    {
+        Biquad nf;
+        nf.loadStateDict(coefs);
+        RowMatrixXf x = RowMatrixXf::Random(channels, num_samples);
+        RowMatrixXf y = RowMatrixXf::Zero(channels, num_samples);
+        BENCHMARK("Nanoflare " + std::to_string(channels) + " channels") { nf.forward(x, y); return y(0, 0); };
+    }
+}
+
+TEST_CASE("Biquad offline")
+{
+    constexpr int offline_samples = 1 << 20;
+    nlohmann::json coefs = { {"b0", 0.2f}, {"b1", 0.4f}, {"b2", 0.2f}, {"a1", -0.6f}, {"a2", 0.2f} };
+    Biquad nf;
+    nf.loadStateDict(coefs);
+    RowMatrixXf x = RowMatrixXf::Random(1, offline_samples);
+    RowMatrixXf y = RowMatrixXf::Zero(1, offline_samples);
+    BENCHMARK("Nanoflare serial") { nf.forward(x, y); return y(0, 0); };
+    for(int block_size: { 16, 32, 64 })
+        BENCHMARK("Nanoflare offline block " + std::to_string(block_size)) { nf.forwardOffline(x, y, block_size); return y(0, 0); };
+    BENCHMARK("Nanoflare offline block 32 all threads") { nf.forwardOffline(x, y, 32, 0); return y(0, 0); };
+}
+
+// ---------------------------------------------------------------------------
+// tanh / sigmoid per precision
+// ---------------------------------------------------------------------------
+
+TEST_CASE("Activations")
+{
+    RowMatrixXf x = 4.f * RowMatrixXf::Random(64, num_samples);
+    RowMatrixXf y = x;
+    for(auto [name, precision]: { std::pair{ "exact", ActivationPrecision::Exact },
+                                  std::pair{ "rational", ActivationPrecision::Rational },
+                                  std::pair{ "polynomial", ActivationPrecision::Polynomial } })
+    {
+        BENCHMARK(std::string("Tanh ") + name) { y = x; Functional::Tanh(y, precision); return y(0, 0); };
+        BENCHMARK(std::string("Sigmoid ") + name) { y = x; Functional::Sigmoid(y, precision); return y(0, 0); };
+    }
+}
@@ -2,6 +2,7 @@
 #include "nanoflare/ModelBuilder.h"
 #include "nanoflare/BuiltinModels.h"
 #include "nanoflare/models/BaseModel.h"
+#include "nanoflare/ModelSlot.h"
 #include <nlohmann/json.hpp>
 #include <fstream>
 #include <torch/script.h>
@@ -9,6 +10,8 @@
 #include <vector>
 #include <filesystem>
 #include <iostream>
+#include <thread>
+#include <typeinfo>
 
 using namespace Nanoflare;
 using Catch::Approx;
@@ -188,4 +191,627 @@ TEST_CASE("WaveNet Test", "[WaveNet]")
     auto target = torch_to_eigen_matrix( torch_res.squeeze(0) );
     
     REQUIRE( (pred - target).norm() == Approx(0.0).margin(1e-4) );
-}
\ No newline at end of file
+}
+TEST_CASE("Binary Format Test", "[BinaryModel]")
+{
+    for(auto name: { "microtcn", "resgru", "reslstm", "tcn", "wavenet" })
+    {
+        std::filesystem::path jsonPath( PROJECT_SOURCE_DIR );
+        jsonPath /= std::filesystem::path("tests/data/") / (std::string(name) + ".json");
+        std::filesystem::path binaryPath( PROJECT_SOURCE_DIR );
+        binaryPath /= std::filesystem::path("tests/data/") / (std::string(name) + ".nfbm");
+
+        std::shared_ptr<BaseModel> json_obj, binary_obj;
+        std::ifstream model_file( jsonPath.c_str() );
+        ModelBuilder::getInstance().buildModel(nlohmann::json::parse(model_file), json_obj );
+        BinaryModel binary_file( binaryPath.string() );
+        ModelBuilder::getInstance().buildModel( binary_file, binary_obj );
+
+        auto eigen_data = torch_to_eigen_matrix( torch::randn({1, num_samples}) );
+        RowMatrixXf json_pred = RowMatrixXf::Zero(1, num_samples);
+        RowMatrixXf binary_pred = RowMatrixXf::Zero(1, num_samples);
+        json_obj->forward( eigen_data, json_pred );
+        binary_obj->forward( eigen_data, binary_pred );
+
+        REQUIRE( (json_pred - binary_pred).norm() == Approx(0.0).margin(1e-6) );
+    }
+}
+
+TEST_CASE("JsonLoader Test", "[JsonLoader]")
+{
+    for(auto name: { "microtcn", "resgru", "reslstm", "tcn", "wavenet" })
+    {
+        std::filesystem::path modelPath( PROJECT_SOURCE_DIR );
+        modelPath /= std::filesystem::path("tests/data/") / (std::string(name) + ".json");
+
+        std::shared_ptr<BaseModel> dom_obj, sax_obj;
+        std::ifstream dom_file( modelPath.c_str() );
+        ModelBuilder::getInstance().buildModel(nlohmann::json::parse(dom_file), dom_obj );
+        std::ifstream sax_file( modelPath.c_str() );
+        ModelBuilder::getInstance().buildModel( sax_file, sax_obj );
+
+        auto eigen_data = torch_to_eigen_matrix( torch::randn({1, num_samples}) );
+        RowMatrixXf dom_pred = RowMatrixXf::Zero(1, num_samples);
+        RowMatrixXf sax_pred = RowMatrixXf::Zero(1, num_samples);
+        dom_obj->forward( eigen_data, dom_pred );
+        sax_obj->forward( eigen_data, sax_pred );
+
+        REQUIRE( (dom_pred - sax_pred).norm() == Approx(0.0).margin(1e-6) );
+    }
+}
+
+TEST_CASE("Shared Weights Test", "[ModelBuilder]")
+{
+    for(auto name: { "microtcn", "resgru", "reslstm", "tcn", "wavenet" })
+    {
+        std::filesystem::path modelPath( PROJECT_SOURCE_DIR );
+        modelPath /= std::filesystem::path("tests/data/") / (std::string(name) + ".json");
+
+        std::shared_ptr<BaseModel> obj, first, second;
+        std::ifstream model_file( modelPath.c_str() );
+        ModelBuilder::getInstance().buildModel( nlohmann::json::parse(model_file), obj );
+        ModelBuilder::getInstance().loadModel( modelPath.string(), first );
+        ModelBuilder::getInstance().loadModel( modelPath.string(), second );
+        REQUIRE( first != second );
+
+        // Instances sharing weights must still keep their own state
+        auto first_data = torch_to_eigen_matrix( torch::randn({1, num_samples}) );
+        auto second_data = torch_to_eigen_matrix( torch::randn({1, num_samples}) );
+        RowMatrixXf first_pred = RowMatrixXf::Zero(1, num_samples);
+        RowMatrixXf second_pred = RowMatrixXf::Zero(1, num_samples);
+        RowMatrixXf target = RowMatrixXf::Zero(1, num_samples);
+        first->forward( first_data, first_pred );
+        second->forward( second_data, second_pred );
+        obj->forward( second_data, target );
+
+        REQUIRE( (second_pred - target).norm() == Approx(0.0).margin(1e-6) );
+
+        auto third = second->clone();
+        RowMatrixXf third_pred = RowMatrixXf::Zero(1, num_samples);
+        third->forward( second_data, third_pred );
+
+        REQUIRE( (third_pred - target).norm() == Approx(0.0).margin(1e-6) );
+    }
+
+    // Concurrent loads, two threads per file, build outside the cache lock
+    const std::vector<std::string> names = { "microtcn", "resgru", "reslstm", "tcn", "wavenet" };
+    ModelBuilder::getInstance().clearCache();
+    std::vector<std::shared_ptr<BaseModel>> loaded( 2 * names.size() );
+    std::vector<std::thread> threads;
+    for(size_t i = 0; i < loaded.size(); i++)
+        threads.emplace_back( [&, i]() {
+            std::filesystem::path modelPath( PROJECT_SOURCE_DIR );
+            modelPath /= std::filesystem::path("tests/data/") / (names[i % names.size()] + ".json");
+            ModelBuilder::getInstance().loadModel( modelPath.string(), loaded[i] );
+        } );
+    for(auto& thread: threads)
+        thread.join();
+
+    auto data = torch_to_eigen_matrix( torch::randn({1, num_samples}) );
+    for(size_t i = 0; i < loaded.size(); i++)
+    {
+        std::filesystem::path modelPath( PROJECT_SOURCE_DIR );
+        modelPath /= std::filesystem::path("tests/data/") / (names[i % names.size()] + ".json");
+        std::shared_ptr<BaseModel> obj;
+        std::ifstream model_file( modelPath.c_str() );
+        ModelBuilder::getInstance().buildModel( nlohmann::json::parse(model_file), obj );
+
+        REQUIRE( loaded[i] );
+        RowMatrixXf pred = RowMatrixXf::Zero(1, num_samples), target = RowMatrixXf::Zero(1, num_samples);
+        loaded[i]->forward( data, pred );
+        obj->forward( data, target );
+        REQUIRE( (pred - target).norm() == Approx(0.0).margin(1e-6) );
+    }
+}
+
+TEST_CASE("Streaming Test", "[Streaming]")
+{
+    // Blocks of uneven sizes, some shorter than the receptive field, then sample by sample
+    const std::vector<std::vector<int>> schedules = {
+        { 1, 7, 64, 3, 500, 1, 1, 256, 1215 },
+        std::vector<int>( num_samples, 1 )
+    };
+
+    for(auto name: { "microtcn", "resgru", "reslstm", "tcn", "wavenet" })
+    {
+        std::filesystem::path modelPath( PROJECT_SOURCE_DIR );
+        modelPath /= std::filesystem::path("tests/data/") / (std::string(name) + ".json");
+
+        std::shared_ptr<BaseModel> obj;
+        std::ifstream model_file( modelPath.c_str() );
+        ModelBuilder::getInstance().buildModel( nlohmann::json::parse(model_file), obj );
+
+        auto eigen_data = torch_to_eigen_matrix( torch::randn({1, num_samples}) );
+        RowMatrixXf target = RowMatrixXf::Zero(1, num_samples);
+        obj->forward( eigen_data, target );
+
+        for(const auto& block_sizes: schedules)
+        {
+            obj->resetState();
+            RowMatrixXf pred = RowMatrixXf::Zero(1, num_samples);
+            int start = 0;
+            for(auto block_size: block_sizes)
+            {
+                obj->forward( eigen_data.middleCols(start, block_size), pred.middleCols(start, block_size) );
+                start += block_size;
+            }
+            REQUIRE( start == num_samples );
+            REQUIRE( (pred - target).norm() == Approx(0.0).margin(1e-4) );
+        }
+    }
+}
+
+TEST_CASE("Receptive Field Test", "[ReceptiveField]")
+{
+    const std::vector<std::pair<std::string, size_t>> receptive_fields = { { "microtcn", 511 }, { "tcn", 790 }, { "wavenet", 257 } };
+
+    for(const auto& [name, receptive_field]: receptive_fields)
+    {
+        std::filesystem::path modelPath( PROJECT_SOURCE_DIR );
+        modelPath /= std::filesystem::path("tests/data/") / (name + ".json");
+
+        std::shared_ptr<BaseModel> obj;
+        std::ifstream model_file( modelPath.c_str() );
+        ModelBuilder::getInstance().buildModel( nlohmann::json::parse(model_file), obj );
+
+        REQUIRE( obj->getReceptiveField() == receptive_field );
+        REQUIRE( obj->getTailLength() == receptive_field - 1 );
+        REQUIRE( obj->getLatency() == 0 );
+
+        // An impulse never changes the output receptive_field samples later or after. Close to the
+        // edge its contribution goes through every layer and can be lost in float rounding.
+        RowMatrixXf impulse = RowMatrixXf::Zero(1, num_samples);
+        impulse(0, 0) = 1.f;
+        RowMatrixXf impulse_pred = RowMatrixXf::Zero(1, num_samples);
+        RowMatrixXf silence_pred = RowMatrixXf::Zero(1, num_samples);
+        obj->forward( impulse, impulse_pred );
+        obj->resetState();
+        obj->forward( RowMatrixXf::Zero(1, num_samples), silence_pred );
+
+        RowMatrixXf diff = (impulse_pred - silence_pred).cwiseAbs();
+        REQUIRE( diff.leftCols(receptive_field).rightCols(receptive_field / 4).maxCoeff() > 0.f );
+        REQUIRE( diff.rightCols(num_samples - receptive_field).maxCoeff() == 0.f );
+    }
+
+    for(auto name: { "resgru", "reslstm" })
+    {
+        std::filesystem::path modelPath( PROJECT_SOURCE_DIR );
+        modelPath /= std::filesystem::path("tests/data/") / (std::string(name) + ".json");
+
+        std::shared_ptr<BaseModel> obj;
+        std::ifstream model_file( modelPath.c_str() );
+        ModelBuilder::getInstance().buildModel( nlohmann::json::parse(model_file), obj );
+
+        REQUIRE( obj->getReceptiveField() == UnboundedLength );
+        REQUIRE( obj->getTailLength() > 0 );
+        REQUIRE( obj->getTailLength() < UnboundedLength );
+    }
+}
+
+TEST_CASE("Prime Test", "[Prime]")
+{
+    for(auto name: { "microtcn", "resgru", "reslstm", "tcn", "wavenet" })
+    {
+        std::filesystem::path modelPath( PROJECT_SOURCE_DIR );
+        modelPath /= std::filesystem::path("tests/data/") / (std::string(name) + ".json");
+
+        std::shared_ptr<BaseModel> obj;
+        std::ifstream model_file( modelPath.c_str() );
+        ModelBuilder::getInstance().buildModel( nlohmann::json::parse(model_file), obj );
+
+        // Priming with the context then processing a block equals processing both at once
+        auto eigen_data = torch_to_eigen_matrix( torch::randn({1, 2 * num_samples}) );
+        RowMatrixXf target = RowMatrixXf::Zero(1, 2 * num_samples);
+        obj->forward( eigen_data, target );
+
+        RowMatrixXf pred = RowMatrixXf::Zero(1, num_samples);
+        obj->prime( eigen_data.leftCols(num_samples) );
+        obj->forward( eigen_data.rightCols(num_samples), pred );
+
+        REQUIRE( (pred - target.rightCols(num_samples)).norm() == Approx(0.0).margin(1e-4) );
+    }
+}
+
+TEST_CASE("Scratch Arena Test", "[ScratchArena]")
+{
+    // Blocks up to the prepared size, then one larger block that falls back to private scratch
+    const int max_block_size = 512;
+    const std::vector<int> block_sizes = { 512, 1, 7, 64, 300, 1, 128, 1035 };
+
+    for(auto name: { "microtcn", "resgru", "reslstm", "tcn", "wavenet" })
+    {
+        std::filesystem::path modelPath( PROJECT_SOURCE_DIR );
+        modelPath /= std::filesystem::path("tests/data/") / (std::string(name) + ".json");
+
+        std::shared_ptr<BaseModel> obj;
+        std::ifstream model_file( modelPath.c_str() );
+        ModelBuilder::getInstance().buildModel( nlohmann::json::parse(model_file), obj );
+
+        // Layers sharing the arena give the same output as layers with their own scratch
+        auto reference = obj->clone();
+        obj->prepare( max_block_size );
+        const auto& arena = obj->getScratchArena();
+        REQUIRE( arena.getSize() > 0 );
+        REQUIRE( arena.getSize() < arena.getUnsharedSize() );
+        REQUIRE( reference->getScratchArena().getSize() == 0 );
+
+        auto eigen_data = torch_to_eigen_matrix( torch::randn({1, 2048}) );
+        RowMatrixXf target = RowMatrixXf::Zero(1, 2048), pred = RowMatrixXf::Zero(1, 2048);
+        int start = 0;
+        for(auto block_size: block_sizes)
+        {
+            reference->forward( eigen_data.middleCols(start, block_size), target.middleCols(start, block_size) );
+            obj->forward( eigen_data.middleCols(start, block_size), pred.middleCols(start, block_size) );
+            start += block_size;
+        }
+        REQUIRE( start == 2048 );
+        REQUIRE( pred == target );
+    }
+}
+
+TEST_CASE("Activation Precision Test", "[ActivationPrecision]")
+{
+    // Fast tanh and sigmoid against the exact ones, on every model that uses them
+    const std::pair<const char*, ActivationPrecision> precisions[] = {
+        { "rational", ActivationPrecision::Rational }, { "polynomial", ActivationPrecision::Polynomial } };
+
+    auto eigen_data = torch_to_eigen_matrix( torch::randn({1, num_samples}) );
+    for(auto name: { "microtcn", "resgru", "reslstm", "tcn", "wavenet" })
+    {
+        std::filesystem::path modelPath( PROJECT_SOURCE_DIR );
+        modelPath /= std::filesystem::path("tests/data/") / (std::string(name) + ".json");
+
+        std::shared_ptr<BaseModel> obj;
+        std::ifstream model_file( modelPath.c_str() );
+        ModelBuilder::getInstance().buildModel( nlohmann::json::parse(model_file), obj );
+        REQUIRE( obj->getActivationPrecision() == ActivationPrecision::Exact );
+
+        RowMatrixXf target = RowMatrixXf::Zero(1, num_samples);
+        obj->clone()->forward( eigen_data, target );
+
+        for(auto [label, precision]: precisions)
+        {
+            auto fast = obj->clone();
+            fast->setActivationPrecision( precision );
+            REQUIRE( fast->getActivationPrecision() == precision );
+
+            RowMatrixXf pred = RowMatrixXf::Zero(1, num_samples);
+            fast->forward( eigen_data, pred );
+            const float max_diff = (pred - target).cwiseAbs().maxCoeff();
+            std::cout << name << " " << label << ": max abs diff " << max_diff << std::endl;
+            REQUIRE( max_diff < 1e-3f );
+        }
+    }
+}
+
+TEST_CASE("Model Slot Test", "[ModelSlot]")
+{
+    constexpr int block_size = 256, crossfade = 64;
+    for(auto name: { "microtcn", "resgru", "reslstm", "tcn", "wavenet" })
+    {
+        std::filesystem::path modelPath( PROJECT_SOURCE_DIR );
+        modelPath /= std::filesystem::path("tests/data/") / (std::string(name) + ".json");
+
+        ModelSlot slot( 1, 1, block_size, crossfade );
+        slot.load( modelPath.string() );
+
+        // Dry signal until the worker publishes the model, then a crossfade within one block
+        auto first_data = torch_to_eigen_matrix( torch::randn({1, block_size}) );
+        RowMatrixXf first_pred = RowMatrixXf::Zero(1, block_size);
+        for(int i = 0; i < 1000 && slot.getSwapCount() == 0; i++)
+        {
+            slot.process( first_data, first_pred );
+            if( slot.getSwapCount() == 0 )
+            {
+                REQUIRE( (first_pred - first_data).norm() == Approx(0.0).margin(1e-6) );
+                std::this_thread::sleep_for( std::chrono::milliseconds(1) );
+            }
+        }
+        REQUIRE( slot.getSwapCount() == 1 );
+        REQUIRE( slot.getLastError().empty() );
+
+        std::shared_ptr<BaseModel> obj;
+        std::ifstream model_file( modelPath.c_str() );
+        ModelBuilder::getInstance().buildModel( nlohmann::json::parse(model_file), obj );
+        RowMatrixXf target = RowMatrixXf::Zero(1, block_size);
+        obj->forward( first_data, target );
+
+        RowMatrixXf faded = first_data.leftCols(crossfade);
+        for(int n = 0; n < crossfade; n++)
+        {
+            const float gain = static_cast<float>(n + 1) / crossfade;
+            faded(0, n) = (1.f - gain) * first_data(0, n) + gain * target(0, n);
+        }
+        REQUIRE( (first_pred.leftCols(crossfade) - faded).norm() == Approx(0.0).margin(1e-5) );
+        REQUIRE( (first_pred.rightCols(block_size - crossfade) - target.rightCols(block_size - crossfade)).norm() == Approx(0.0).margin(1e-5) );
+
+        // Blocks larger than the maximum block size are split
+        auto second_data = torch_to_eigen_matrix( torch::randn({1, 3 * block_size}) );
+        RowMatrixXf second_pred = RowMatrixXf::Zero(1, 3 * block_size);
+        slot.process( second_data, second_pred );
+        for(int i = 0; i < 3; i++)
+            obj->forward( second_data.middleCols(i * block_size, block_size), target );
+        REQUIRE( (second_pred.rightCols(block_size) - target).norm() == Approx(0.0).margin(1e-5) );
+
+        // Failed loads keep the current model
+        slot.load( modelPath.string() + ".missing" );
+        for(int i = 0; i < 1000 && slot.getLastError().empty(); i++)
+            std::this_thread::sleep_for( std::chrono::milliseconds(1) );
+        REQUIRE_FALSE( slot.getLastError().empty() );
+        REQUIRE( slot.getSwapCount() == 1 );
+    }
+}
+
+TEST_CASE("Model Slot Crossfade Test", "[ModelSlot]")
+{
+    // Model to model fades over several blocks, called out of place and in place
+    constexpr int block_size = 64, crossfade = 160, num_blocks = 8;
+    auto modelPath = []( const std::string& name ) {
+        std::filesystem::path path( PROJECT_SOURCE_DIR );
+        return (path / std::filesystem::path("tests/data/") / (name + ".json")).string();
+    };
+    auto build = [&]( const std::string& name ) {
+        std::shared_ptr<BaseModel> obj;
+        std::ifstream model_file( modelPath(name) );
+        ModelBuilder::getInstance().buildModel( nlohmann::json::parse(model_file), obj );
+        return obj;
+    };
+
+    for(auto [from, to]: { std::pair{ "tcn", "wavenet" }, std::pair{ "resgru", "microtcn" } })
+        for(bool in_place: { false, true })
+        {
+            ModelSlot slot( 1, 1, block_size, crossfade );
+            auto run = [&]( const RowMatrixXf& data ) {
+                RowMatrixXf pred = data;
+                if( in_place )
+                    slot.process( pred, pred );
+                else
+                    slot.process( data, pred );
+                return pred;
+            };
+            auto wait = [&]() {
+                for(int i = 0; i < 1000 && !slot.isSwapPending(); i++)
+                    std::this_thread::sleep_for( std::chrono::milliseconds(1) );
+                REQUIRE( slot.isSwapPending() );
+            };
+
+            // The first model fades in from the dry signal, it is compared once alone
+            auto from_obj = build( from );
+            slot.load( modelPath(from) );
+            wait();
+            for(int i = 0; i < num_blocks; i++)
+            {
+                auto data = torch_to_eigen_matrix( torch::randn({1, block_size}) );
+                RowMatrixXf target( 1, block_size );
+                from_obj->forward( data, target );
+                auto pred = run( data );
+                if( i * block_size >= crossfade )
+                    REQUIRE( (pred - target).cwiseAbs().maxCoeff() < 1e-5f );
+            }
+            REQUIRE( slot.getSwapCount() == 1 );
+
+            auto to_obj = build( to );
+            slot.load( modelPath(to) );
+            wait();
+            for(int i = 0; i < num_blocks; i++)
+            {
+                auto data = torch_to_eigen_matrix( torch::randn({1, block_size}) );
+                RowMatrixXf from_target( 1, block_size ), to_target( 1, block_size ), target( 1, block_size );
+                from_obj->forward( data, from_target );
+                to_obj->forward( data, to_target );
+                for(int n = 0; n < block_size; n++)
+                {
+                    const float gain = std::min( 1.f, static_cast<float>(i * block_size + n + 1) / crossfade );
+                    target(0, n) = (1.f - gain) * from_target(0, n) + gain * to_target(0, n);
+                }
+                REQUIRE( (run( data ) - target).cwiseAbs().maxCoeff() < 1e-5f );
+            }
+            REQUIRE( slot.getSwapCount() == 2 );
+        }
+}
+
+TEST_CASE("Fixed Size Models Test", "[ModelBuilder]")
+{
+    // Matching documents build the compile-time shaped instantiations registered in
+    // BuiltinModels.h, the others the dynamic models, with the same output either way
+    auto eigen_data = torch_to_eigen_matrix( torch::randn({1, num_samples}) );
+
+    auto check = [&](const char* name, bool fixed, ModelBuilder::BuildFn dynamic_build)
+    {
+        std::filesystem::path modelPath( PROJECT_SOURCE_DIR );
+        modelPath /= std::filesystem::path("tests/data/") / (std::string(name) + ".json");
+        std::ifstream model_file( modelPath.c_str() );
+        const auto data = nlohmann::json::parse(model_file);
+
+        std::shared_ptr<BaseModel> obj, dynamic;
+        ModelBuilder::getInstance().buildModel( data, obj );
+        dynamic_build( data, dynamic );
+        REQUIRE( (typeid(*obj) != typeid(*dynamic)) == fixed );
+
+        RowMatrixXf pred = RowMatrixXf::Zero(1, num_samples), target = RowMatrixXf::Zero(1, num_samples);
+        obj->forward( eigen_data, pred );
+        dynamic->forward( eigen_data, target );
+        REQUIRE( (pred - target).cwiseAbs().maxCoeff() < 1e-5f );
+    };
+
+#ifdef NANOFLARE_FIXED_SIZE_MODELS
+    constexpr bool fixed = true;
+
+    // Every translation unit including BuiltinModels.h registers them again, only once is kept
+    REQUIRE_FALSE( registerSpecialization<TCNT<8, 3>>("TCN") );
+#else
+    constexpr bool fixed = false;
+#endif
+    check( "microtcn", fixed, &MicroTCN::build );    // hidden 8, kernel 3
+    check( "resgru", fixed, &ResRNN<GRU>::build );   // input 1, hidden 64
+    check( "reslstm", fixed, &ResRNN<LSTM>::build ); // input 1, hidden 64
+    check( "tcn", false, &TCN::build );              // kernel 4 is not compiled in
+    check( "wavenet", false, &WaveNet::build );
+}
+
+TEST_CASE("Weight Precision Test", "[WeightPrecision]")
+{
+    // Half precision weights against the float ones, on a clone so that the shared weights are untouched
+    const std::pair<const char*, WeightPrecision> precisions[] = {
+        { "float16", WeightPrecision::Float16 }, { "bfloat16", WeightPrecision::BFloat16 } };
+
+    std::filesystem::path modelPath( PROJECT_SOURCE_DIR );
+    modelPath /= "tests/data/wavenet.json";
+    std::shared_ptr<BaseModel> obj;
+    std::ifstream model_file( modelPath.c_str() );
+    ModelBuilder::getInstance().buildModel( nlohmann::json::parse(model_file), obj );
+    REQUIRE( obj->getWeightPrecision() == WeightPrecision::Float32 );
+
+    auto eigen_data = torch_to_eigen_matrix( torch::randn({1, num_samples}) );
+    RowMatrixXf target = RowMatrixXf::Zero(1, num_samples);
+    obj->clone()->forward( eigen_data, target );
+
+    for(auto [label, precision]: precisions)
+    {
+        auto reduced = obj->clone();
+        reduced->setWeightPrecision( precision );
+        reduced->prepare( num_samples );
+        REQUIRE( reduced->getWeightPrecision() == precision );
+        REQUIRE( reduced->getWeightSize() < obj->getWeightSize() * 6 / 10 );
+
+        RowMatrixXf pred = RowMatrixXf::Zero(1, num_samples);
+        reduced->forward( eigen_data, pred );
+        const float max_diff = (pred - target).cwiseAbs().maxCoeff();
+        std::cout << "wavenet " << label << ": " << reduced->getWeightSize() << " of " << obj->getWeightSize()
+                  << " weight bytes, max abs diff " << max_diff << std::endl;
+        REQUIRE( max_diff < 1e-2f );
+    }
+
+    // The original keeps its float weights
+    REQUIRE( obj->getWeightPrecision() == WeightPrecision::Float32 );
+    RowMatrixXf pred = RowMatrixXf::Zero(1, num_samples);
+    obj->forward( eigen_data, pred );
+    REQUIRE( pred == target );
+}
+
+TEST_CASE("Quantization Test", "[Quantization]")
+{
+    // Integer inference against float, on clones calibrated with another signal than the one compared
+    const std::pair<const char*, Quantization> modes[] = { { "int8", Quantization::Int8 }, { "int16", Quantization::Int16 } };
+    auto calibration = torch_to_eigen_matrix( torch::randn({1, num_samples}) );
+    auto eigen_data = torch_to_eigen_matrix( torch::randn({1, num_samples}) );
+
+    for(auto name: { "microtcn", "resgru", "tcn", "wavenet" })
+    {
+        std::filesystem::path modelPath( PROJECT_SOURCE_DIR );
+        modelPath /= std::string("tests/data/") + name + ".json";
+        std::shared_ptr<BaseModel> obj;
+        std::ifstream model_file( modelPath.c_str() );
+        ModelBuilder::getInstance().buildModel( nlohmann::json::parse(model_file), obj );
+        REQUIRE( obj->getQuantization() == Quantization::None );
+
+        RowMatrixXf target = RowMatrixXf::Zero(1, num_samples);
+        obj->clone()->forward( eigen_data, target );
+
+        for(auto [label, mode]: modes)
+        {
+            auto quantized = obj->clone();
+            quantized->quantize( mode, calibration );
+            quantized->prepare( 256 );
+            REQUIRE( quantized->getQuantization() == mode );
+
+            RowMatrixXf pred = RowMatrixXf::Zero(1, num_samples);
+            for(int t = 0; t < num_samples; t += 256)
+                quantized->forward( eigen_data.middleCols(t, 256), pred.middleCols(t, 256) );
+            const float error = (pred - target).norm() / target.norm();
+            std::cout << name << " " << label << ": relative error " << error << std::endl;
+            REQUIRE( error < 5e-2f );
+
+            // Float inference comes back exactly
+            quantized->quantize( Quantization::None, calibration );
+            REQUIRE( quantized->getQuantization() == Quantization::None );
+            quantized->forward( eigen_data, pred );
+            REQUIRE( pred == target );
+        }
+
+        // The original keeps its float weights
+        REQUIRE( obj->getQuantization() == Quantization::None );
+        RowMatrixXf pred = RowMatrixXf::Zero(1, num_samples);
+        obj->forward( eigen_data, pred );
+        REQUIRE( pred == target );
+    }
+}
+
+TEST_CASE("Low Rank Test", "[LowRank]")
+{
+    // Truncated SVD of the Linear and convolutional weights against the full ones
+    auto eigen_data = torch_to_eigen_matrix( torch::randn({1, num_samples}) );
+
+    for(auto name: { "microtcn", "resgru", "tcn", "wavenet" })
+    {
+        std::filesystem::path modelPath( PROJECT_SOURCE_DIR );
+        modelPath /= std::string("tests/data/") + name + ".json";
+        std::shared_ptr<BaseModel> obj;
+        std::ifstream model_file( modelPath.c_str() );
+        ModelBuilder::getInstance().buildModel( nlohmann::json::parse(model_file), obj );
+
+        RowMatrixXf target = RowMatrixXf::Zero(1, num_samples);
+        obj->clone()->forward( eigen_data, target );
+
+        auto factorized = obj->clone();
+        factorized->setLowRank( 0.9f );
+        factorized->prepare( 256 );
+        RowMatrixXf pred = RowMatrixXf::Zero(1, num_samples);
+        for(int t = 0; t < num_samples; t += 256)
+            factorized->forward( eigen_data.middleCols(t, 256), pred.middleCols(t, 256) );
+        const float error = (pred - target).norm() / target.norm();
+        std::cout << name << " low rank: relative error " << error << std::endl;
+        REQUIRE( error < 5e-2f );
+
+        // The full weights come back exactly
+        factorized->setLowRank( 1.f );
+        factorized->resetState();
+        factorized->forward( eigen_data, pred );
+        REQUIRE( pred == target );
+
+        // The original keeps its full weights
+        obj->forward( eigen_data, pred );
+        REQUIRE( pred == target );
+    }
+}
+
+TEST_CASE("Normalisation Folding Test", "[Normalisation]")
+{
+    // A new normalisation against the original one fed with the input mapped between the two
+    auto eigen_data = torch_to_eigen_matrix( torch::randn({1, num_samples}) );
+    const float mean = 0.3f, std = 1.7f;
+
+    for(auto name: { "microtcn", "resgru", "reslstm", "tcn", "wavenet" })
+    {
+        std::filesystem::path modelPath( PROJECT_SOURCE_DIR );
+        modelPath /= std::string("tests/data/") + name + ".json";
+        std::shared_ptr<BaseModel> obj;
+        std::ifstream model_file( modelPath.c_str() );
+        ModelBuilder::getInstance().buildModel( nlohmann::json::parse(model_file), obj );
+        const float old_mean = obj->getNormMean(), old_std = obj->getNormStd();
+
+        RowMatrixXf target = RowMatrixXf::Zero(1, num_samples);
+        obj->clone()->forward( eigen_data, target );
+
+        auto renormalised = obj->clone();
+        renormalised->setNormMean( mean );
+        renormalised->setNormStd( std );
+        RowMatrixXf pred = RowMatrixXf::Zero(1, num_samples);
+        renormalised->forward( eigen_data, pred );
+
+        RowMatrixXf mapped_data = ((eigen_data.array() - mean) * (old_std / std) + old_mean).matrix();
+        RowMatrixXf expected = RowMatrixXf::Zero(1, num_samples);
+        obj->clone()->forward( mapped_data, expected );
+        if(std::string(name) == "wavenet")
+            expected = ((expected.array() - old_mean) * (std / old_std) + mean).matrix(); // denormalised output
+        else if(std::string(name) == "resgru" || std::string(name) == "reslstm")
+            expected += eigen_data - mapped_data; // the residual adds the input itself
+        REQUIRE( (pred - expected).cwiseAbs().maxCoeff() < 1e-4f );
+
+        // The original normalisation comes back exactly
+        renormalised->setNormMean( old_mean );
+        renormalised->setNormStd( old_std );
+        renormalised->forward( eigen_data, pred );
+        REQUIRE( pred == target );
+    }
+}
@@ -0,0 +1,206 @@
+#include <catch2/catch_test_macros.hpp>
+#include <nlohmann/json.hpp>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+#include "nanoflare/ModelBuilder.h"
+#include "nanoflare/BuiltinModels.h"
+#include "nanoflare/ModelSlot.h"
+
+using namespace Nanoflare;
+
+// ---------------------------------------------------------------------------
+// Heap tracking: while t_tracking is set on a thread, every call it makes to
+// operator new / delete and, with glibc, to the malloc family (used by Eigen)
+// is counted. Other threads, such as the ModelSlot worker, are not tracked.
+// ---------------------------------------------------------------------------
+
+static thread_local bool t_tracking = false;
+static std::atomic<size_t> g_allocations{0}, g_deallocations{0};
+
+inline void countAllocation() { if (t_tracking) ++g_allocations; }
+inline void countDeallocation() { if (t_tracking) ++g_deallocations; }
+
+#if defined(__GLIBC__)
+extern "C"
+{
+    void* __libc_malloc(size_t size);
+    void* __libc_calloc(size_t count, size_t size);
+    void* __libc_realloc(void* ptr, size_t size);
+    void __libc_free(void* ptr);
+
+    void* malloc(size_t size) { countAllocation(); return __libc_malloc(size); }
+    void* calloc(size_t count, size_t size) { countAllocation(); return __libc_calloc(count, size); }
+    void* realloc(void* ptr, size_t size) { countAllocation(); return __libc_realloc(ptr, size); }
+    void free(void* ptr) { if (ptr != nullptr) countDeallocation(); __libc_free(ptr); }
+}
+#endif
+
+void* operator new(size_t size)
+{
+    countAllocation();
+    void* ptr = std::malloc(size == 0 ? 1 : size);
+    if (ptr == nullptr)
+        throw std::bad_alloc();
+    return ptr;
+}
+
+void operator delete(void* ptr) noexcept
+{
+    if (ptr != nullptr)
+        countDeallocation();
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept
+{
+    operator delete(ptr);
+}
+
+// Counts the heap operations made in its scope
+struct AllocationTracker
+{
+    AllocationTracker() { g_allocations = 0; g_deallocations = 0; t_tracking = true; }
+    ~AllocationTracker() { t_tracking = false; }
+    size_t allocations() const { return g_allocations.load(); }
+    size_t deallocations() const { return g_deallocations.load(); }
+};
+
+inline std::string dataPath(const std::string& file_name)
+{
+    std::filesystem::path path( PROJECT_SOURCE_DIR );
+    path /= std::filesystem::path("tests/data") / file_name;
+    return path.string();
+}
+
+constexpr int max_block_size = 512;
+const std::vector<int> block_sizes = { 512, 1, 64, 7, 512, 128, 1, 333 };
+
+TEST_CASE("Steady-state forward does not allocate")
+{
+    for(auto name: { "microtcn", "resgru", "reslstm", "tcn", "wavenet" })
+    {
+        SECTION(name)
+        {
+            std::shared_ptr<BaseModel> model;
+            std::ifstream model_file( dataPath(std::string(name) + ".json") );
+            ModelBuilder::getInstance().buildModel( nlohmann::json::parse(model_file), model );
+
+            RowMatrixXf x = RowMatrixXf::Random( model->getInChannels(), max_block_size );
+            RowMatrixXf y = RowMatrixXf::Zero( model->getOutChannels(), max_block_size );
+
+            // Warm-up at the maximum block size
+            model->forward( x, y );
+
+            AllocationTracker tracker;
+            for(int block_size: block_sizes)
+                model->forward( x.leftCols(block_size), y.leftCols(block_size) );
+            model->resetState();
+            model->forward( x, y );
+
+            const size_t allocations = tracker.allocations(), deallocations = tracker.deallocations();
+            INFO( name << ": " << allocations << " allocations, " << deallocations << " deallocations" );
+            REQUIRE( allocations == 0 );
+            REQUIRE( deallocations == 0 );
+        }
+    }
+}
+
+TEST_CASE("Forward after prepare does not allocate")
+{
+    // Reduced precision weights are widened into planned scratch
+    for(auto [name, precision]: { std::pair{ "microtcn", WeightPrecision::Float32 }, std::pair{ "resgru", WeightPrecision::Float32 },
+                                  std::pair{ "reslstm", WeightPrecision::Float32 }, std::pair{ "tcn", WeightPrecision::Float32 },
+                                  std::pair{ "wavenet", WeightPrecision::Float32 }, std::pair{ "wavenet", WeightPrecision::Float16 } })
+    {
+        SECTION(std::string(name) + (precision == WeightPrecision::Float32 ? "" : " float16"))
+        {
+            std::shared_ptr<BaseModel> model;
+            std::ifstream model_file( dataPath(std::string(name) + ".json") );
+            ModelBuilder::getInstance().buildModel( nlohmann::json::parse(model_file), model );
+            model->setWeightPrecision( precision );
+
+            RowMatrixXf x = RowMatrixXf::Random( model->getInChannels(), max_block_size );
+            RowMatrixXf y = RowMatrixXf::Zero( model->getOutChannels(), max_block_size );
+
+            model->prepare( max_block_size );
+
+            // Growing block sizes, the worst case for lazily sized scratch buffers
+            AllocationTracker tracker;
+            for(int block_size: { 1, 7, 64, 128, 333, 512 })
+                model->forward( x.leftCols(block_size), y.leftCols(block_size) );
+
+            const size_t allocations = tracker.allocations(), deallocations = tracker.deallocations();
+            INFO( name << ": " << allocations << " allocations, " << deallocations << " deallocations" );
+            REQUIRE( allocations == 0 );
+            REQUIRE( deallocations == 0 );
+        }
+    }
+}
+
+TEST_CASE("Quantized forward after prepare does not allocate")
+{
+    // Quantized inputs are packed into planned scratch
+    for(auto name: { "microtcn", "resgru", "tcn", "wavenet" })
+    {
+        SECTION(name)
+        {
+            std::shared_ptr<BaseModel> model;
+            std::ifstream model_file( dataPath(std::string(name) + ".json") );
+            ModelBuilder::getInstance().buildModel( nlohmann::json::parse(model_file), model );
+
+            RowMatrixXf x = RowMatrixXf::Random( model->getInChannels(), max_block_size );
+            RowMatrixXf y = RowMatrixXf::Zero( model->getOutChannels(), max_block_size );
+
+            model->quantize( Quantization::Int8, x );
+            model->prepare( max_block_size );
+
+            AllocationTracker tracker;
+            for(int block_size: { 1, 7, 64, 128, 333, 512 })
+                model->forward( x.leftCols(block_size), y.leftCols(block_size) );
+
+            const size_t allocations = tracker.allocations(), deallocations = tracker.deallocations();
+            INFO( name << ": " << allocations << " allocations, " << deallocations << " deallocations" );
+            REQUIRE( allocations == 0 );
+            REQUIRE( deallocations == 0 );
+        }
+    }
+}
+
+TEST_CASE("ModelSlot process does not allocate")
+{
+    ModelSlot slot( 1, 1, max_block_size, 256 );
+    RowMatrixXf x = RowMatrixXf::Random( 1, max_block_size );
+    RowMatrixXf y = RowMatrixXf::Zero( 1, max_block_size );
+
+    for(auto name: { "microtcn", "resgru", "reslstm", "tcn", "wavenet" })
+    {
+        const size_t swaps = slot.getSwapCount();
+        slot.load( dataPath(std::string(name) + ".json") );
+
+        // Crossfades from the previous model while processing
+        size_t allocations = 0, deallocations = 0;
+        for(int i = 0; i < 2000 && slot.getSwapCount() == swaps; i++)
+        {
+            {
+                AllocationTracker tracker;
+                for(int block_size: block_sizes)
+                    slot.process( x.leftCols(block_size), y.leftCols(block_size) );
+                allocations += tracker.allocations();
+                deallocations += tracker.deallocations();
+            }
+            std::this_thread::sleep_for( std::chrono::milliseconds(1) );
+        }
+
+        INFO( name << ": " << allocations << " allocations, " << deallocations << " deallocations" );
+        REQUIRE( slot.getSwapCount() == swaps + 1 );
+        REQUIRE( allocations == 0 );
+        REQUIRE( deallocations == 0 );
+    }
+}
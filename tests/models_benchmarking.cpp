@@ -0,0 +1,507 @@
+#include <catch2/catch_test_macros.hpp>
+#include <catch2/benchmark/catch_benchmark.hpp>
+#include <nlohmann/json.hpp>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <new>
+#include <random>
+#include "nanoflare/ModelBuilder.h"
+#include "nanoflare/BuiltinModels.h"
+#include "nanoflare/BinaryModel.h"
+
+using namespace Nanoflare;
+
+// ---------------------------------------------------------------------------
+// Heap accounting: every operator new allocation is prefixed with its size so
+// that live and peak heap usage can be reported per loading path. Eigen
+// matrices use malloc directly and are not counted, they are the same size
+// for every path.
+// ---------------------------------------------------------------------------
+
+static std::atomic<size_t> g_liveBytes{0}, g_peakBytes{0};
+constexpr size_t g_headerSize = alignof(std::max_align_t);
+
+void* operator new(size_t size)
+{
+    void* ptr = std::malloc(size + g_headerSize);
+    if (ptr == nullptr)
+        throw std::bad_alloc();
+    *static_cast<size_t*>(ptr) = size;
+    size_t live = g_liveBytes += size;
+    size_t peak = g_peakBytes.load();
+    while (live > peak && !g_peakBytes.compare_exchange_weak(peak, live)) {}
+    return static_cast<char*>(ptr) + g_headerSize;
+}
+
+void operator delete(void* ptr) noexcept
+{
+    if (ptr == nullptr)
+        return;
+    void* base = static_cast<char*>(ptr) - g_headerSize;
+    g_liveBytes -= *static_cast<size_t*>(base);
+    std::free(base);
+}
+
+inline std::string dataPath(const std::string& file_name)
+{
+    std::filesystem::path path( PROJECT_SOURCE_DIR );
+    path /= std::filesystem::path("tests/data") / file_name;
+    return path.string();
+}
+
+// Gated WaveNet document with random weights and stack_size * 10 blocks of dilations 1 to 512
+inline nlohmann::json syntheticWaveNet(size_t channels, size_t stack_size)
+{
+    const size_t kernel_size = 3, hidden_size = 32;
+    const std::vector<size_t> dilations = { 1, 2, 4, 8, 16, 32, 64, 128, 256, 512 };
+
+    std::mt19937 gen(42);
+    std::uniform_real_distribution<float> dist(-0.1f, 0.1f);
+    auto tensor = [&](std::vector<size_t> shape) {
+        size_t count = 1;
+        for(auto dim: shape)
+            count *= dim;
+        std::vector<float> values(count);
+        for(auto& v: values)
+            v = dist(gen);
+        return nlohmann::json{ {"shape", shape}, {"values", values} };
+    };
+    auto conv = [&](size_t in_channels, size_t out_channels, size_t kernel) {
+        return nlohmann::json{ {"weight", tensor({out_channels, in_channels, kernel})}, {"bias", tensor({out_channels})} };
+    };
+
+    nlohmann::json doc;
+    doc["config"] = { {"model_type", "WaveNet"}, {"norm_mean", 0.f}, {"norm_std", 1.f} };
+    doc["parameters"] = { {"input_size", 1}, {"num_channels", channels}, {"output_size", 1}, {"kernel_size", kernel_size},
+        {"dilations", dilations}, {"stack_size", stack_size}, {"gated", true}, {"hidden_size", hidden_size} };
+    auto& state_dict = doc["state_dict"];
+    state_dict["input_conv"] = conv(1, channels, kernel_size);
+    state_dict["post_conv1"] = conv(channels, hidden_size, 1);
+    state_dict["post_conv2"] = conv(hidden_size, 1, 1);
+    for(size_t i = 0; i < stack_size * dilations.size(); i++)
+        state_dict["block_stack." + std::to_string(i)] = {
+            {"input_conv", conv(channels, 2 * channels, kernel_size)},
+            {"residual_conv", conv(channels, channels, 1)},
+            {"skip_conv", conv(channels, channels, 1)}
+        };
+    return doc;
+}
+
+// tests/data ResGRU or ResLSTM with input_size inputs and a random input projection
+inline nlohmann::json syntheticResRNN(const std::string& name, size_t input_size)
+{
+    std::ifstream file( dataPath(name + ".json") );
+    auto doc = nlohmann::json::parse( file );
+    auto& weight_ih = doc["state_dict"]["rnn"]["weight_ih_l0"];
+    const size_t gate_size = weight_ih["shape"][0].get<size_t>();
+
+    std::mt19937 gen(42);
+    std::uniform_real_distribution<float> dist(-0.1f, 0.1f);
+    std::vector<float> values( gate_size * input_size );
+    for(auto& v: values)
+        v = dist(gen);
+    weight_ih = { {"shape", {gate_size, input_size}}, {"values", values} };
+    doc["parameters"]["input_size"] = input_size;
+    return doc;
+}
+
+// WaveNet with 128 channels and 20 gated blocks, about 50 MB of JSON text
+inline std::string writeSyntheticModel()
+{
+    std::filesystem::path path = std::filesystem::temp_directory_path() / "nanoflare_synthetic_wavenet.json";
+    std::ofstream file( path );
+    file << syntheticWaveNet( 128, 2 );
+    return path.string();
+}
+
+// ---------------------------------------------------------------------------
+// Model loading: JSON DOM vs JSON SAX vs memory-mapped binary
+// ---------------------------------------------------------------------------
+
+TEST_CASE("Load time")
+{
+    for(auto name: { "microtcn", "resgru", "reslstm", "tcn", "wavenet" })
+    {
+        const auto json_path = dataPath(std::string(name) + ".json");
+        const auto binary_path = dataPath(std::string(name) + ".nfbm");
+
+        BENCHMARK(std::string(name) + " JSON")
+        {
+            std::shared_ptr<BaseModel> model;
+            std::ifstream model_file( json_path );
+            ModelBuilder::getInstance().buildModel( nlohmann::json::parse(model_file), model );
+            return model;
+        };
+
+        BENCHMARK(std::string(name) + " JSON SAX")
+        {
+            std::shared_ptr<BaseModel> model;
+            std::ifstream model_file( json_path );
+            ModelBuilder::getInstance().buildModel( model_file, model );
+            return model;
+        };
+
+        BENCHMARK(std::string(name) + " Binary")
+        {
+            std::shared_ptr<BaseModel> model;
+            BinaryModel model_file( binary_path );
+            ModelBuilder::getInstance().buildModel( model_file, model );
+            return model;
+        };
+    }
+}
+
+TEST_CASE("Load peak memory")
+{
+    auto measure = [](const char* label, const std::string& path, auto load) {
+        std::shared_ptr<BaseModel> model;
+        const size_t baseline = g_liveBytes.load();
+        g_peakBytes = baseline;
+        auto start = std::chrono::steady_clock::now();
+        load( path, model );
+        auto elapsed = std::chrono::duration<double, std::milli>( std::chrono::steady_clock::now() - start ).count();
+        REQUIRE( model != nullptr );
+        std::printf("  %-10s %10.1f ms %12.2f MB peak heap\n", label, elapsed, (g_peakBytes.load() - baseline) / 1048576.0);
+    };
+    auto dom = [](const std::string& path, std::shared_ptr<BaseModel>& model) {
+        std::ifstream model_file( path );
+        ModelBuilder::getInstance().buildModel( nlohmann::json::parse(model_file), model );
+    };
+    auto sax = [](const std::string& path, std::shared_ptr<BaseModel>& model) {
+        std::ifstream model_file( path );
+        ModelBuilder::getInstance().buildModel( model_file, model );
+    };
+
+    std::vector<std::string> paths;
+    for(auto name: { "microtcn", "resgru", "reslstm", "tcn", "wavenet" })
+        paths.push_back( dataPath(std::string(name) + ".json") );
+    paths.push_back( writeSyntheticModel() );
+
+    for(const auto& path: paths)
+    {
+        std::printf("%s (%.1f MB)\n", std::filesystem::path(path).filename().string().c_str(), std::filesystem::file_size(path) / 1048576.0);
+        measure( "JSON DOM", path, dom );
+        measure( "JSON SAX", path, sax );
+    }
+    std::filesystem::remove( paths.back() );
+}
+
+// ---------------------------------------------------------------------------
+// Block processing: stateful streaming vs re-processing an overlapping context
+// ---------------------------------------------------------------------------
+
+TEST_CASE("Streaming vs overlap")
+{
+    constexpr int block_size = 64, context_size = 2048;
+
+    for(auto name: { "microtcn", "tcn", "wavenet" })
+    {
+        std::shared_ptr<BaseModel> model;
+        ModelBuilder::getInstance().loadModel( dataPath(std::string(name) + ".json"), model );
+
+        RowMatrixXf x = RowMatrixXf::Random(1, block_size);
+        RowMatrixXf y = RowMatrixXf::Zero(1, block_size);
+        BENCHMARK(std::string(name) + " streaming") { model->forward( x, y ); return y(0, 0); };
+
+        // Without state, every block is processed again with its preceding context
+        RowMatrixXf window = RowMatrixXf::Random(1, context_size + block_size);
+        RowMatrixXf window_y = RowMatrixXf::Zero(1, context_size + block_size);
+        BENCHMARK(std::string(name) + " overlap") {
+            model->resetState();
+            model->forward( window, window_y );
+            y = window_y.rightCols(block_size);
+            return y(0, 0);
+        };
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Throughput per host block size, block size 1 uses the single sample path
+// ---------------------------------------------------------------------------
+
+TEST_CASE("Block size")
+{
+    constexpr int total_samples = 4096;
+
+    for(auto name: { "microtcn", "tcn", "wavenet" })
+    {
+        std::shared_ptr<BaseModel> model;
+        ModelBuilder::getInstance().loadModel( dataPath(std::string(name) + ".json"), model );
+
+        RowMatrixXf x = RowMatrixXf::Random(1, total_samples);
+        RowMatrixXf y = RowMatrixXf::Zero(1, total_samples);
+        for(int block_size: { 1, 8, 64 })
+        {
+            auto run = [&]() {
+                for(int start = 0; start < total_samples; start += block_size)
+                    model->forward( x.middleCols(start, block_size), y.middleCols(start, block_size) );
+                return y(0, 0);
+            };
+            BENCHMARK(std::string(name) + " block size " + std::to_string(block_size)) { return run(); };
+
+            auto start = std::chrono::steady_clock::now();
+            run();
+            auto elapsed = std::chrono::duration<double>( std::chrono::steady_clock::now() - start ).count();
+            std::printf("  %-10s block size %3d: %10.0f samples/s\n", name, block_size, total_samples / elapsed);
+        }
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Workspace allocation: first call and growing block sizes, with and without
+// prepare(). Every run uses a fresh clone that has not processed anything yet.
+// ---------------------------------------------------------------------------
+
+TEST_CASE("Prepare")
+{
+    constexpr int max_block_size = 512;
+    const std::vector<int> block_sizes = { 32, 64, 128, 256, 512 };
+
+    for(auto name: { "microtcn", "resgru", "tcn", "wavenet" })
+    {
+        std::shared_ptr<BaseModel> model;
+        ModelBuilder::getInstance().loadModel( dataPath(std::string(name) + ".json"), model );
+
+        RowMatrixXf x = RowMatrixXf::Random(1, max_block_size);
+        RowMatrixXf y = RowMatrixXf::Zero(1, max_block_size);
+
+        for(bool prepared: { false, true })
+        {
+            auto clones = [&](int runs) {
+                std::vector<std::shared_ptr<BaseModel>> models( runs );
+                for(auto& m: models)
+                {
+                    m = model->clone();
+                    if(prepared)
+                        m->prepare( max_block_size );
+                }
+                return models;
+            };
+            const std::string suffix = prepared ? " prepared" : " lazy";
+
+            BENCHMARK_ADVANCED(std::string(name) + " first call" + suffix)(Catch::Benchmark::Chronometer meter)
+            {
+                auto models = clones( meter.runs() );
+                meter.measure( [&](int i) { models[i]->forward( x, y ); return y(0, 0); } );
+            };
+
+            BENCHMARK_ADVANCED(std::string(name) + " growing blocks" + suffix)(Catch::Benchmark::Chronometer meter)
+            {
+                auto models = clones( meter.runs() );
+                meter.measure( [&](int i) {
+                    for(int block_size: block_sizes)
+                        models[i]->forward( x.leftCols(block_size), y.leftCols(block_size) );
+                    return y(0, 0);
+                } );
+            };
+        }
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Scratch memory: private buffers per layer vs one arena planned by prepare().
+// Deep WaveNets at long blocks spill private scratch out of L2, the arena not.
+// ---------------------------------------------------------------------------
+
+TEST_CASE("Scratch arena")
+{
+    for(auto name: { "microtcn", "resgru", "reslstm", "tcn", "wavenet" })
+    {
+        std::shared_ptr<BaseModel> model;
+        ModelBuilder::getInstance().loadModel( dataPath(std::string(name) + ".json"), model );
+        model->prepare( 512 );
+        std::printf("  %-10s block size 512: %9zu bytes unshared, %9zu bytes planned\n", name,
+            model->getScratchArena().getUnsharedSize(), model->getScratchArena().getSize());
+    }
+
+    std::shared_ptr<BaseModel> model;
+    ModelBuilder::getInstance().buildModel( syntheticWaveNet( 16, 4 ), model );
+    for(int block_size: { 512, 2048, 8192 })
+    {
+        RowMatrixXf x = RowMatrixXf::Random(1, block_size);
+        RowMatrixXf y = RowMatrixXf::Zero(1, block_size);
+
+        // Private scratch grown by a first call, vs the planned arena
+        auto unshared = model->clone(), planned = model->clone();
+        unshared->forward( x, y );
+        planned->prepare( block_size );
+        std::printf("  deep wavenet block size %4d: %9zu bytes unshared, %9zu bytes planned\n", block_size,
+            planned->getScratchArena().getUnsharedSize(), planned->getScratchArena().getSize());
+
+        BENCHMARK("deep wavenet unshared block size " + std::to_string(block_size)) { unshared->forward( x, y ); return y(0, 0); };
+        BENCHMARK("deep wavenet planned block size " + std::to_string(block_size)) { planned->forward( x, y ); return y(0, 0); };
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Gated WaveNet per channel count, the residual blocks dominate
+// ---------------------------------------------------------------------------
+
+TEST_CASE("WaveNet channels")
+{
+    for(size_t channels: { 8, 16, 32 })
+    {
+        std::shared_ptr<BaseModel> model;
+        ModelBuilder::getInstance().buildModel( syntheticWaveNet( channels, 1 ), model );
+        model->prepare( 512 );
+        for(int block_size: { 64, 512 })
+        {
+            RowMatrixXf x = RowMatrixXf::Random(1, block_size);
+            RowMatrixXf y = RowMatrixXf::Zero(1, block_size);
+            BENCHMARK("wavenet " + std::to_string(channels) + " channels block size " + std::to_string(block_size)) { model->forward( x, y ); return y(0, 0); };
+        }
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Recurrent and gated models per tanh / sigmoid precision
+// ---------------------------------------------------------------------------
+
+TEST_CASE("Activation precision")
+{
+    constexpr int block_size = 512;
+    RowMatrixXf x = RowMatrixXf::Random(1, block_size);
+    RowMatrixXf y = RowMatrixXf::Zero(1, block_size);
+
+    for(auto name: { "resgru", "reslstm", "wavenet" })
+    {
+        std::shared_ptr<BaseModel> model;
+        ModelBuilder::getInstance().loadModel( dataPath(std::string(name) + ".json"), model );
+        model->prepare( block_size );
+        for(auto [label, precision]: { std::pair{ "exact", ActivationPrecision::Exact },
+                                       std::pair{ "rational", ActivationPrecision::Rational },
+                                       std::pair{ "polynomial", ActivationPrecision::Polynomial } })
+        {
+            model->setActivationPrecision( precision );
+            BENCHMARK(std::string(name) + " " + label) { model->forward( x, y ); return y(0, 0); };
+        }
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Recurrent models per input size, the input projection is one GEMM per block
+// ---------------------------------------------------------------------------
+
+TEST_CASE("ResRNN input size")
+{
+    for(auto name: { "resgru", "reslstm" })
+        for(size_t input_size: { 1, 4, 16 })
+        {
+            std::shared_ptr<BaseModel> model;
+            ModelBuilder::getInstance().buildModel( syntheticResRNN( name, input_size ), model );
+            model->prepare( 512 );
+            for(int block_size: { 64, 512 })
+            {
+                RowMatrixXf x = RowMatrixXf::Random(input_size, block_size);
+                RowMatrixXf y = RowMatrixXf::Zero(1, block_size);
+                BENCHMARK(std::string(name) + " input size " + std::to_string(input_size) + " block size " + std::to_string(block_size)) { model->forward( x, y ); return y(0, 0); };
+            }
+        }
+}
+
+TEST_CASE("Fixed size models")
+{
+    // Compile-time shaped instantiations picked by ModelBuilder against the dynamic models
+    for(auto [name, dynamic_build]: { std::pair<const char*, ModelBuilder::BuildFn>{ "microtcn", &MicroTCN::build },
+                                      std::pair<const char*, ModelBuilder::BuildFn>{ "resgru", &ResRNN<GRU>::build },
+                                      std::pair<const char*, ModelBuilder::BuildFn>{ "reslstm", &ResRNN<LSTM>::build } })
+    {
+        std::ifstream model_file( dataPath(std::string(name) + ".json") );
+        const auto data = nlohmann::json::parse( model_file );
+
+        std::shared_ptr<BaseModel> fixed, dynamic;
+        ModelBuilder::getInstance().buildModel( data, fixed );
+        dynamic_build( data, dynamic );
+        fixed->prepare( 512 );
+        dynamic->prepare( 512 );
+        for(int block_size: { 64, 512 })
+        {
+            RowMatrixXf x = RowMatrixXf::Random(1, block_size);
+            RowMatrixXf y = RowMatrixXf::Zero(1, block_size);
+            BENCHMARK(std::string(name) + " fixed block size " + std::to_string(block_size)) { fixed->forward( x, y ); return y(0, 0); };
+            BENCHMARK(std::string(name) + " dynamic block size " + std::to_string(block_size)) { dynamic->forward( x, y ); return y(0, 0); };
+        }
+    }
+}
+
+TEST_CASE("Weight precision")
+{
+    for(size_t channels: { 32, 128 })
+    {
+        std::shared_ptr<BaseModel> model;
+        ModelBuilder::getInstance().buildModel( syntheticWaveNet( channels, 2 ), model );
+        for(auto [label, precision]: { std::pair{ "float32", WeightPrecision::Float32 },
+                                       std::pair{ "float16", WeightPrecision::Float16 },
+                                       std::pair{ "bfloat16", WeightPrecision::BFloat16 } })
+        {
+            auto reduced = model->clone();
+            reduced->setWeightPrecision( precision );
+            reduced->prepare( 512 );
+            std::printf( "wavenet %zu channels %s: %zu KB of weights\n", channels, label, reduced->getWeightSize() / 1024 );
+            for(int block_size: { 64, 512 })
+            {
+                RowMatrixXf x = RowMatrixXf::Random(1, block_size);
+                RowMatrixXf y = RowMatrixXf::Zero(1, block_size);
+                BENCHMARK("wavenet " + std::to_string(channels) + " channels " + label + " block size " + std::to_string(block_size)) { reduced->forward( x, y ); return y(0, 0); };
+            }
+        }
+    }
+}
+
+TEST_CASE("Quantization")
+{
+    for(size_t channels: { 32, 128 })
+    {
+        std::shared_ptr<BaseModel> model;
+        ModelBuilder::getInstance().buildModel( syntheticWaveNet( channels, 2 ), model );
+        RowMatrixXf calibration = RowMatrixXf::Random(1, 4096);
+        for(auto [label, mode]: { std::pair{ "float", Quantization::None },
+                                  std::pair{ "int8", Quantization::Int8 },
+                                  std::pair{ "int16", Quantization::Int16 } })
+        {
+            auto quantized = model->clone();
+            quantized->quantize( mode, calibration );
+            quantized->prepare( 512 );
+            for(int block_size: { 64, 512 })
+            {
+                RowMatrixXf x = RowMatrixXf::Random(1, block_size);
+                RowMatrixXf y = RowMatrixXf::Zero(1, block_size);
+                BENCHMARK("wavenet " + std::to_string(channels) + " channels " + label + " block size " + std::to_string(block_size)) { quantized->forward( x, y ); return y(0, 0); };
+            }
+        }
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Epilogue fusion: throughput per model with the bias, activations and
+// residual adds applied as the layer outputs are stored. A TCNBlock saves five
+// passes over its output, a MicroTCNBlock three, every Linear of
+// PlainSequential two and the WaveNet head three.
+// ---------------------------------------------------------------------------
+
+TEST_CASE("Epilogue fusion")
+{
+    for(auto name: { "microtcn", "tcn", "resgru", "reslstm", "wavenet" })
+    {
+        std::shared_ptr<BaseModel> model;
+        ModelBuilder::getInstance().loadModel( dataPath(std::string(name) + ".json"), model );
+        model->prepare( 512 );
+        for(int block_size: { 64, 512 })
+        {
+            RowMatrixXf x = RowMatrixXf::Random(1, block_size);
+            RowMatrixXf y = RowMatrixXf::Zero(1, block_size);
+            BENCHMARK(std::string(name) + " block size " + std::to_string(block_size)) { model->forward( x, y ); return y(0, 0); };
+
+            constexpr int runs = 200;
+            auto start = std::chrono::steady_clock::now();
+            for(int i = 0; i < runs; i++)
+                model->forward( x, y );
+            auto elapsed = std::chrono::duration<double>( std::chrono::steady_clock::now() - start ).count();
+            std::printf("  %-10s block size %3d: %10.0f samples/s\n", name, block_size, runs * block_size / elapsed);
+        }
+    }
+}